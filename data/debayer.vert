@@ -7,6 +7,8 @@ attribute vec2 tex_coord;
 
 uniform mat3 transform;
 uniform vec2 pixel_size;
+// Moves the samples onto the first CFA cell when skipping cells
+uniform vec2 sample_offset;
 
 varying vec2 top_left_uv;
 varying vec2 top_right_uv;
@@ -16,8 +18,8 @@ varying vec2 bottom_right_uv;
 void
 main()
 {
-        top_left_uv = tex_coord - pixel_size / 2.0;
-        bottom_right_uv = tex_coord + pixel_size / 2.0;
+        top_left_uv = tex_coord + sample_offset;
+        bottom_right_uv = top_left_uv + pixel_size;
         top_right_uv = vec2(top_left_uv.x, bottom_right_uv.y);
         bottom_left_uv = vec2(bottom_right_uv.x, top_left_uv.y);
 
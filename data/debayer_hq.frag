@@ -0,0 +1,108 @@
+#ifdef GL_ES
+precision highp float;
+#endif
+
+uniform sampler2D texture;
+uniform mat3 color_matrix;
+uniform vec2 pixel_size;
+uniform float black_level;
+uniform float white_level;
+#ifdef BITS_10
+uniform float row_length;
+uniform float padding_ratio;
+#endif
+
+varying vec2 uv;
+varying vec2 position;
+
+// Offset of the red pixel within the 2x2 CFA cell
+#if defined(CFA_BGGR)
+const vec2 first_red = vec2(1, 1);
+#elif defined(CFA_GBRG)
+const vec2 first_red = vec2(0, 1);
+#elif defined(CFA_GRBG)
+const vec2 first_red = vec2(1, 0);
+#else
+const vec2 first_red = vec2(0, 0);
+#endif
+
+#ifdef BITS_10
+vec2
+skip_5th_pixel(vec2 uv)
+{
+        vec2 new_uv = uv;
+
+        new_uv.x *= 0.8;
+        new_uv.x += floor(uv.x * row_length / 5.0) / row_length;
+
+        // Crop out padding
+        new_uv.x *= padding_ratio;
+
+        return new_uv;
+}
+#endif
+
+float
+fetch(float x, float y)
+{
+#ifdef BITS_10
+        return texture2D(texture, skip_5th_pixel(uv + vec2(x, y) * pixel_size)).r;
+#else
+        return texture2D(texture, uv + vec2(x, y) * pixel_size).r;
+#endif
+}
+
+void
+main()
+{
+        // 0,0 on red, 1,1 on blue, and 1,0 or 0,1 on the green in the red and
+        // the blue row respectively
+        vec2 alternate = mod(floor(position) + first_red, 2.0);
+
+        float c = fetch(0.0, 0.0);
+        float h1 = fetch(-1.0, 0.0) + fetch(1.0, 0.0);
+        float v1 = fetch(0.0, -1.0) + fetch(0.0, 1.0);
+        float d = fetch(-1.0, -1.0) + fetch(1.0, -1.0) + fetch(-1.0, 1.0) +
+                  fetch(1.0, 1.0);
+
+        // The missing colors, named after where their neighbours are
+#ifdef DEMOSAIC_BILINEAR
+        float plus = (h1 + v1) / 4.0;
+        float row = h1 / 2.0;
+        float col = v1 / 2.0;
+        float diag = d / 4.0;
+#else
+        // Malvar-He-Cutler, bilinear interpolation corrected with the
+        // gradient of the color that was sampled
+        float h2 = fetch(-2.0, 0.0) + fetch(2.0, 0.0);
+        float v2 = fetch(0.0, -2.0) + fetch(0.0, 2.0);
+
+        float plus = (4.0 * c + 2.0 * (h1 + v1) - (h2 + v2)) / 8.0;
+        float row = (5.0 * c + 4.0 * h1 - h2 - d + 0.5 * v2) / 8.0;
+        float col = (5.0 * c + 4.0 * v1 - v2 - d + 0.5 * h2) / 8.0;
+        float diag = (6.0 * c + 2.0 * d - 1.5 * (h2 + v2)) / 8.0;
+#endif
+
+        vec3 color;
+        if (alternate.y < 0.5) {
+                if (alternate.x < 0.5) {
+                        color = vec3(c, plus, diag);
+                } else {
+                        color = vec3(row, c, col);
+                }
+        } else {
+                if (alternate.x < 0.5) {
+                        color = vec3(col, c, row);
+                } else {
+                        color = vec3(diag, plus, c);
+                }
+        }
+
+        vec3 corrected = (color - black_level) / (white_level - black_level);
+
+        corrected = clamp(color_matrix * corrected, 0.0, 1.0);
+
+        vec3 srgb_color = pow(corrected, vec3(1.0 / 2.2));
+
+        gl_FragColor = vec4(srgb_color, 1);
+}
@@ -0,0 +1,25 @@
+#ifdef GL_ES
+precision highp float;
+#endif
+
+attribute vec2 vert;
+attribute vec2 tex_coord;
+
+uniform mat3 transform;
+uniform vec2 pixel_size;
+// Moves the sample onto the first source pixel when skipping pixels
+uniform vec2 sample_offset;
+
+varying vec2 uv;
+varying vec2 position;
+
+void
+main()
+{
+        uv = tex_coord + sample_offset;
+
+        // Position in source pixels, used to find the color of the CFA cell
+        position = uv / pixel_size;
+
+        gl_Position = vec4(transform * vec3(vert, 1), 1);
+}
@@ -3,7 +3,10 @@
 # The post-processing script gets called after taking a burst of
 # pictures into a temporary directory. The first argument is the
 # directory containing the raw files in the burst. The contents
-# are 1.dng, 2.dng.... up to the number of photos in the burst.
+# are 0.dng, 1.dng.... up to the number of photos in the burst.
+# The sharpest frame of the burst is always 1.dng. Cameras that only
+# output YUV or MJPEG produce 0.jpg, 1.jpg... instead, which are final
+# photos.
 #
 # The second argument is the filename for the final photo without
 # the extension, like "/home/user/Pictures/IMG202104031234" 
@@ -27,7 +30,15 @@ SAVE_DNG="$3"
 
 MAIN_PICTURE="$BURST_DIR"/1
 
-# Copy the first frame of the burst as the raw photo
+# There is no raw photo to develop for YUV cameras
+if [ -f "$MAIN_PICTURE.jpg" ]; then
+	cp "$MAIN_PICTURE.jpg" "$TARGET_NAME.jpg"
+	rm -rf "$BURST_DIR"
+	echo "$TARGET_NAME.jpg"
+	exit 0
+fi
+
+# Copy the sharpest frame of the burst as the raw photo
 cp "$BURST_DIR"/1.dng "$TARGET_NAME.dng"
 
 # Create a .jpg if raw processing tools are installed
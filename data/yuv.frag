@@ -0,0 +1,34 @@
+#ifdef GL_ES
+precision highp float;
+#endif
+
+uniform sampler2D texture;
+uniform float padding_ratio;
+
+varying vec2 uv;
+varying float pair_x;
+
+void
+main()
+{
+        // Every RGBA texel holds two pixels that share their chroma
+        vec4 texel = texture2D(texture, vec2(uv.x * padding_ratio, uv.y));
+        bool is_second = fract(pair_x) >= 0.5;
+
+#ifdef YUV_UYVY
+        float luma = is_second ? texel.a : texel.g;
+        vec2 chroma = texel.rb;
+#else
+        float luma = is_second ? texel.b : texel.r;
+        vec2 chroma = texel.ga;
+#endif
+
+        // BT.601 in limited range, the output is already gamma encoded
+        float y = (luma - 16.0 / 255.0) * (255.0 / 219.0);
+        vec2 c = (chroma - 128.0 / 255.0) * (255.0 / 224.0);
+        vec3 color = vec3(y + 1.402 * c.y,
+                          y - 0.344136 * c.x - 0.714136 * c.y,
+                          y + 1.772 * c.x);
+
+        gl_FragColor = vec4(clamp(color, 0.0, 1.0), 1);
+}
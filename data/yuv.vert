@@ -0,0 +1,25 @@
+#ifdef GL_ES
+precision highp float;
+#endif
+
+attribute vec2 vert;
+attribute vec2 tex_coord;
+
+uniform mat3 transform;
+uniform vec2 pixel_size;
+// Moves the sample onto the first source pixel when skipping pixels
+uniform vec2 sample_offset;
+
+varying vec2 uv;
+// Horizontal position in pixel pairs, the fraction tells which of the two
+// pixels of a texel is sampled
+varying float pair_x;
+
+void
+main()
+{
+        uv = tex_coord + sample_offset;
+        pair_x = uv.x / pixel_size.x / 2.0;
+
+        gl_Position = vec4(transform * vec3(vert, 1), 1);
+}
@@ -0,0 +1,105 @@
+#include "auto_exposure.h"
+
+#include <glib.h>
+#include <math.h>
+
+// The preview shows the raw values without a gamma curve, so aim a bit above
+// linear middle grey
+#define TARGET_MEAN 0.25f
+// Keep most of the frame out of the clipped range, unless that makes the
+// image too dark
+#define HIGHLIGHT_PERCENTILE 0.98f
+#define HIGHLIGHT_MAX 0.95f
+#define MIN_MEAN 0.1f
+
+// Ignore small errors so the controls don't hunt around the target
+#define DEADBAND 0.06f
+// Only take part of each correction step, the sensor response isn't linear
+// near clipping
+#define DAMPING 0.85f
+#define MAX_STEP 8.0f
+
+void
+mp_auto_exposure_init(MPAutoExposure *ae,
+                      int exposure_min,
+                      int exposure_max,
+                      int gain_min,
+                      int gain_max,
+                      int gain_unity,
+                      int latency)
+{
+        ae->exposure_min = MAX(exposure_min, 1);
+        ae->exposure_max = MAX(exposure_max, ae->exposure_min);
+        ae->gain_min = gain_min;
+        ae->gain_max = MAX(gain_max, gain_min);
+        ae->gain_unity = CLAMP(gain_unity, MAX(gain_min, 1), ae->gain_max);
+        ae->gain_is_locked = false;
+        ae->latency = latency;
+
+        mp_auto_exposure_reset(ae, ae->exposure_max / 2, ae->gain_unity);
+}
+
+void
+mp_auto_exposure_reset(MPAutoExposure *ae, int exposure, int gain)
+{
+        ae->exposure = CLAMP(exposure, ae->exposure_min, ae->exposure_max);
+        ae->gain = CLAMP(gain, ae->gain_min, ae->gain_max);
+        ae->frames_to_skip = ae->latency;
+}
+
+// Factor to multiply the exposure with to reach the target brightness
+static float
+get_correction(const MPFrameStats *stats)
+{
+        const float min_value = 1.0f / (MP_FRAME_STATS_BINS - 1);
+
+        float mean = MAX(stats->mean_luminance, min_value);
+        float highlight = MAX(
+                mp_frame_stats_get_percentile(stats, HIGHLIGHT_PERCENTILE),
+                min_value);
+
+        float correction = MIN(TARGET_MEAN / mean, HIGHLIGHT_MAX / highlight);
+        return MAX(correction, MIN_MEAN / mean);
+}
+
+bool
+mp_auto_exposure_update(MPAutoExposure *ae, const MPFrameStats *stats)
+{
+        // Wait for the previous change to take effect
+        if (ae->frames_to_skip > 0) {
+                --ae->frames_to_skip;
+                return false;
+        }
+
+        float correction = get_correction(stats);
+        if (fabsf(correction - 1.0f) < DEADBAND) {
+                return false;
+        }
+
+        correction = CLAMP(correction, 1.0f / MAX_STEP, MAX_STEP);
+        correction = powf(correction, DAMPING);
+
+        // Prefer a longer exposure over more gain to keep the noise down
+        float gain = MAX(ae->gain, 1);
+        float unity = ae->gain_is_locked ? gain : ae->gain_unity;
+        float total = ae->exposure * (gain / unity) * correction;
+
+        int exposure =
+                CLAMP((int)roundf(total), ae->exposure_min, ae->exposure_max);
+        int new_gain = ae->gain;
+        if (!ae->gain_is_locked) {
+                new_gain = CLAMP((int)roundf(unity * total / exposure),
+                                 ae->gain_min,
+                                 ae->gain_max);
+        }
+
+        if (exposure == ae->exposure && new_gain == ae->gain) {
+                // Limited by the sensor
+                return false;
+        }
+
+        ae->exposure = exposure;
+        ae->gain = new_gain;
+        ae->frames_to_skip = ae->latency;
+        return true;
+}
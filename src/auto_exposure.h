@@ -0,0 +1,38 @@
+#pragma once
+
+#include "frame_stats.h"
+
+#include <stdbool.h>
+
+// Closed loop exposure control for sensors without (usable) auto exposure,
+// driven by the statistics of the frames it produces
+typedef struct {
+        int exposure_min;
+        int exposure_max;
+
+        int gain_min;
+        int gain_max;
+        // Gain value that corresponds to a gain of 1x
+        int gain_unity;
+        // Only adjust the exposure, used when the gain is set manually
+        bool gain_is_locked;
+
+        // Number of frames before a change shows up in the statistics
+        int latency;
+        int frames_to_skip;
+
+        int exposure;
+        int gain;
+} MPAutoExposure;
+
+void mp_auto_exposure_init(MPAutoExposure *ae,
+                           int exposure_min,
+                           int exposure_max,
+                           int gain_min,
+                           int gain_max,
+                           int gain_unity,
+                           int latency);
+
+void mp_auto_exposure_reset(MPAutoExposure *ae, int exposure, int gain);
+
+bool mp_auto_exposure_update(MPAutoExposure *ae, const MPFrameStats *stats);
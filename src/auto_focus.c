@@ -0,0 +1,108 @@
+#include "auto_focus.h"
+
+#include <glib.h>
+
+// The first pass looks at this many positions over the whole range
+#define COARSE_STEPS 12
+// Positioning the lens more precisely than this is lost in the depth of field
+#define FINE_STEPS 64
+// Give up and use the best position so far after this many moves
+#define MAX_STEPS 40
+
+// Changes in sharpness smaller than this are noise
+#define NOISE 0.03f
+// Only turn around once the sharpness dropped twice in a row
+#define MAX_MISSES 2
+
+void
+mp_auto_focus_init(MPAutoFocus *af,
+                   int position_min,
+                   int position_max,
+                   int step_min,
+                   int latency)
+{
+        af->position_min = position_min;
+        af->position_max = MAX(position_max, position_min);
+        af->step_min = MAX(MAX(step_min, 1),
+                           (af->position_max - af->position_min) / FINE_STEPS);
+        af->latency = latency;
+        af->is_running = false;
+        af->position = position_min;
+}
+
+void
+mp_auto_focus_start(MPAutoFocus *af, int position)
+{
+        af->position = CLAMP(position, af->position_min, af->position_max);
+        af->step = MAX((af->position_max - af->position_min) / COARSE_STEPS,
+                       af->step_min);
+
+        // Start towards the side with the most room
+        af->direction = af->position - af->position_min <
+                                        af->position_max - af->position ?
+                                1 :
+                                -1;
+
+        af->num_steps = 0;
+        af->misses = 0;
+        af->best_position = af->position;
+        af->best_sharpness = -1.0f;
+        af->frames_to_skip = af->latency;
+        af->is_running = true;
+}
+
+static bool
+finish(MPAutoFocus *af)
+{
+        bool has_moved = af->position != af->best_position;
+        af->position = af->best_position;
+        af->is_running = false;
+        return has_moved;
+}
+
+bool
+mp_auto_focus_update(MPAutoFocus *af, float sharpness)
+{
+        if (!af->is_running) {
+                return false;
+        }
+
+        // Wait for the lens to settle
+        if (af->frames_to_skip > 0) {
+                --af->frames_to_skip;
+                return false;
+        }
+
+        if (sharpness > af->best_sharpness) {
+                af->best_sharpness = sharpness;
+                af->best_position = af->position;
+                af->misses = 0;
+        } else if (sharpness < af->best_sharpness * (1.0f - NOISE)) {
+                ++af->misses;
+        }
+
+        if (++af->num_steps > MAX_STEPS) {
+                return finish(af);
+        }
+
+        int next = af->position + af->direction * af->step;
+        if (af->misses >= MAX_MISSES || next < af->position_min ||
+            next > af->position_max) {
+                if (af->step <= af->step_min) {
+                        return finish(af);
+                }
+
+                // The peak is within a step of the best position, search
+                // back over it with a finer step
+                af->step = MAX(af->step / 2, af->step_min);
+                af->direction = -af->direction;
+                af->misses = 0;
+                next = CLAMP(af->best_position + af->direction * af->step,
+                             af->position_min,
+                             af->position_max);
+        }
+
+        af->position = next;
+        af->frames_to_skip = af->latency;
+        return true;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Contrast detect focus for lenses that only have a position control, climbs
+// the sharpness of the frames until it passes the peak
+typedef struct {
+        int position_min;
+        int position_max;
+        // Smallest step that's worth taking
+        int step_min;
+
+        // Number of frames before a move shows up in the statistics
+        int latency;
+        int frames_to_skip;
+
+        bool is_running;
+        int position;
+        int step;
+        int direction;
+        int num_steps;
+        // Consecutive frames less sharp than the best one
+        int misses;
+
+        int best_position;
+        float best_sharpness;
+} MPAutoFocus;
+
+void mp_auto_focus_init(MPAutoFocus *af,
+                        int position_min,
+                        int position_max,
+                        int step_min,
+                        int latency);
+
+void mp_auto_focus_start(MPAutoFocus *af, int position);
+
+bool mp_auto_focus_update(MPAutoFocus *af, float sharpness);
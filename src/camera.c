@@ -45,13 +45,19 @@ struct _MPCamera {
 
         struct video_buffer buffers[MAX_VIDEO_BUFFERS];
         uint32_t num_buffers;
+        bool is_streaming;
 
         // keeping track of background task child-PIDs for cleanup code
         int child_bg_pids[MAX_BG_TASKS];
 
         bool use_mplane;
+
+        // Control id to struct control_entry
+        GHashTable *controls;
 };
 
+static void load_controls(MPCamera *camera);
+
 MPCamera *
 mp_camera_new(int video_fd, int subdev_fd)
 {
@@ -78,10 +84,14 @@ mp_camera_new(int video_fd, int subdev_fd)
         camera->subdev_fd = subdev_fd;
         camera->has_set_mode = false;
         camera->num_buffers = 0;
+        camera->is_streaming = false;
         camera->use_mplane = use_mplane;
         memset(camera->child_bg_pids,
                0,
                sizeof(camera->child_bg_pids[0]) * MAX_BG_TASKS);
+
+        load_controls(camera);
+
         return camera;
 }
 
@@ -95,6 +105,7 @@ mp_camera_free(MPCamera *camera)
                 mp_camera_stop_capture(camera);
         }
 
+        g_hash_table_destroy(camera->controls);
         free(camera);
 }
 
@@ -260,56 +271,64 @@ mp_camera_get_mode(const MPCamera *camera)
 }
 
 bool
-mp_camera_set_mode(MPCamera *camera, MPMode *mode)
+mp_camera_set_subdev_mode(MPCamera *camera, MPMode *mode)
 {
-        // Set the mode in the subdev the camera is one
-        if (mp_camera_is_subdev(camera)) {
-                struct v4l2_subdev_frame_interval interval = {};
-                interval.pad = 0;
+        g_return_val_if_fail(mp_camera_is_subdev(camera), false);
+
+        struct v4l2_subdev_frame_interval interval = {};
+        interval.pad = 0;
+        interval.interval = mode->frame_interval;
+        if (xioctl(camera->subdev_fd,
+                   VIDIOC_SUBDEV_S_FRAME_INTERVAL,
+                   &interval) == -1) {
+                errno_printerr("VIDIOC_SUBDEV_S_FRAME_INTERVAL");
+        }
+
+        bool did_set_frame_rate =
+                interval.interval.numerator == mode->frame_interval.numerator &&
+                interval.interval.denominator == mode->frame_interval.denominator;
+
+        struct v4l2_subdev_format fmt = {};
+        fmt.pad = 0;
+        fmt.which = V4L2_SUBDEV_FORMAT_ACTIVE;
+        fmt.format.width = mode->width;
+        fmt.format.height = mode->height;
+        fmt.format.code = mp_pixel_format_to_v4l_bus_code(mode->pixel_format);
+        fmt.format.field = V4L2_FIELD_ANY;
+        if (xioctl(camera->subdev_fd, VIDIOC_SUBDEV_S_FMT, &fmt) == -1) {
+                errno_printerr("VIDIOC_SUBDEV_S_FMT");
+                return false;
+        }
+
+        // Some drivers like ov5640 don't allow you to set the frame format
+        // with too high a frame-rate, but that means the frame-rate won't be
+        // set after the format change. So we need to try again here if we
+        // didn't succeed before. Ideally we'd be able to set both at once.
+        if (!did_set_frame_rate) {
                 interval.interval = mode->frame_interval;
                 if (xioctl(camera->subdev_fd,
                            VIDIOC_SUBDEV_S_FRAME_INTERVAL,
                            &interval) == -1) {
                         errno_printerr("VIDIOC_SUBDEV_S_FRAME_INTERVAL");
                 }
+        }
 
-                bool did_set_frame_rate = interval.interval.numerator ==
-                                                  mode->frame_interval.numerator &&
-                                          interval.interval.denominator ==
-                                                  mode->frame_interval.denominator;
+        // Update the mode
+        mode->pixel_format = mp_pixel_format_from_v4l_bus_code(fmt.format.code);
+        mode->frame_interval = interval.interval;
+        mode->width = fmt.format.width;
+        mode->height = fmt.format.height;
 
-                struct v4l2_subdev_format fmt = {};
-                fmt.pad = 0;
-                fmt.which = V4L2_SUBDEV_FORMAT_ACTIVE;
-                fmt.format.width = mode->width;
-                fmt.format.height = mode->height;
-                fmt.format.code =
-                        mp_pixel_format_to_v4l_bus_code(mode->pixel_format);
-                fmt.format.field = V4L2_FIELD_ANY;
-                if (xioctl(camera->subdev_fd, VIDIOC_SUBDEV_S_FMT, &fmt) == -1) {
-                        errno_printerr("VIDIOC_SUBDEV_S_FMT");
-                        return false;
-                }
-
-                // Some drivers like ov5640 don't allow you to set the frame format
-                // with too high a frame-rate, but that means the frame-rate won't be
-                // set after the format change. So we need to try again here if we
-                // didn't succeed before. Ideally we'd be able to set both at once.
-                if (!did_set_frame_rate) {
-                        interval.interval = mode->frame_interval;
-                        if (xioctl(camera->subdev_fd,
-                                   VIDIOC_SUBDEV_S_FRAME_INTERVAL,
-                                   &interval) == -1) {
-                                errno_printerr("VIDIOC_SUBDEV_S_FRAME_INTERVAL");
-                        }
-                }
+        return true;
+}
 
-                // Update the mode
-                mode->pixel_format =
-                        mp_pixel_format_from_v4l_bus_code(fmt.format.code);
-                mode->frame_interval = interval.interval;
-                mode->width = fmt.format.width;
-                mode->height = fmt.format.height;
+bool
+mp_camera_set_mode(MPCamera *camera, MPMode *mode)
+{
+        // Set the mode in the subdev the camera is one
+        if (mp_camera_is_subdev(camera) &&
+            !mp_camera_set_subdev_mode(camera, mode)) {
+                return false;
         }
 
         // Set the mode for the video device
@@ -326,8 +345,38 @@ mp_camera_set_mode(MPCamera *camera, MPMode *mode)
         return true;
 }
 
+static void
+release_buffers(MPCamera *camera)
+{
+        const enum v4l2_buf_type buftype = get_buf_type(camera);
+
+        // Unmap any mapped buffers
+        assert(camera->num_buffers <= MAX_VIDEO_BUFFERS);
+        for (uint32_t i = 0; i < camera->num_buffers; ++i) {
+                if (munmap(camera->buffers[i].data, camera->buffers[i].length) ==
+                    -1) {
+                        errno_printerr("munmap");
+                }
+
+                if (close(camera->buffers[i].fd) == -1) {
+                        errno_printerr("close");
+                }
+        }
+
+        camera->num_buffers = 0;
+
+        // Reset allocated buffers
+        struct v4l2_requestbuffers req = {};
+        req.count = 0;
+        req.type = buftype;
+        req.memory = V4L2_MEMORY_MMAP;
+        if (xioctl(camera->video_fd, VIDIOC_REQBUFS, &req) == -1) {
+                errno_printerr("VIDIOC_REQBUFS");
+        }
+}
+
 bool
-mp_camera_start_capture(MPCamera *camera)
+mp_camera_prepare_capture(MPCamera *camera)
 {
         g_return_val_if_fail(camera->has_set_mode, false);
         g_return_val_if_fail(camera->num_buffers == 0, false);
@@ -413,6 +462,22 @@ mp_camera_start_capture(MPCamera *camera)
                 goto error;
         }
 
+        return true;
+
+error:
+        release_buffers(camera);
+
+        return false;
+}
+
+bool
+mp_camera_resume_capture(MPCamera *camera)
+{
+        g_return_val_if_fail(camera->num_buffers > 0, false);
+        g_return_val_if_fail(!camera->is_streaming, false);
+
+        const enum v4l2_buf_type buftype = get_buf_type(camera);
+
         for (uint32_t i = 0; i < camera->num_buffers; ++i) {
                 struct v4l2_buffer buf = {
                         .type = buftype,
@@ -429,7 +494,7 @@ mp_camera_start_capture(MPCamera *camera)
                 // Queue the buffer for capture
                 if (xioctl(camera->video_fd, VIDIOC_QBUF, &buf) == -1) {
                         errno_printerr("VIDIOC_QBUF");
-                        goto error;
+                        return false;
                 }
         }
 
@@ -437,38 +502,43 @@ mp_camera_start_capture(MPCamera *camera)
         enum v4l2_buf_type type = buftype;
         if (xioctl(camera->video_fd, VIDIOC_STREAMON, &type) == -1) {
                 errno_printerr("VIDIOC_STREAMON");
-                goto error;
+                return false;
         }
 
+        camera->is_streaming = true;
+
         return true;
+}
 
-error:
-        // Unmap any mapped buffers
-        assert(camera->num_buffers <= MAX_VIDEO_BUFFERS);
-        for (uint32_t i = 0; i < camera->num_buffers; ++i) {
-                if (munmap(camera->buffers[i].data, camera->buffers[i].length) ==
-                    -1) {
-                        errno_printerr("munmap");
-                }
+bool
+mp_camera_pause_capture(MPCamera *camera)
+{
+        g_return_val_if_fail(camera->is_streaming, false);
 
-                if (close(camera->buffers[i].fd) == -1) {
-                        errno_printerr("close");
-                }
+        // This also dequeues all buffers, they are queued again on resume
+        enum v4l2_buf_type type = get_buf_type(camera);
+        if (xioctl(camera->video_fd, VIDIOC_STREAMOFF, &type) == -1) {
+                errno_printerr("VIDIOC_STREAMOFF");
         }
 
-        // Reset allocated buffers
-        {
-                struct v4l2_requestbuffers req = {};
-                req.count = 0;
-                req.type = buftype;
-                req.memory = V4L2_MEMORY_MMAP;
+        camera->is_streaming = false;
 
-                if (xioctl(camera->video_fd, VIDIOC_REQBUFS, &req) == -1) {
-                        errno_printerr("VIDIOC_REQBUFS");
-                }
+        return true;
+}
+
+bool
+mp_camera_start_capture(MPCamera *camera)
+{
+        if (!mp_camera_prepare_capture(camera)) {
+                return false;
         }
 
-        return false;
+        if (!mp_camera_resume_capture(camera)) {
+                release_buffers(camera);
+                return false;
+        }
+
+        return true;
 }
 
 bool
@@ -476,34 +546,11 @@ mp_camera_stop_capture(MPCamera *camera)
 {
         g_return_val_if_fail(camera->num_buffers > 0, false);
 
-        const enum v4l2_buf_type buftype = get_buf_type(camera);
-
-        enum v4l2_buf_type type = buftype;
-        if (xioctl(camera->video_fd, VIDIOC_STREAMOFF, &type) == -1) {
-                errno_printerr("VIDIOC_STREAMOFF");
+        if (camera->is_streaming) {
+                mp_camera_pause_capture(camera);
         }
 
-        assert(camera->num_buffers <= MAX_VIDEO_BUFFERS);
-        for (int i = 0; i < camera->num_buffers; ++i) {
-                if (munmap(camera->buffers[i].data, camera->buffers[i].length) ==
-                    -1) {
-                        errno_printerr("munmap");
-                }
-
-                if (close(camera->buffers[i].fd) == -1) {
-                        errno_printerr("close");
-                }
-        }
-
-        camera->num_buffers = 0;
-
-        struct v4l2_requestbuffers req = {};
-        req.count = 0;
-        req.type = buftype;
-        req.memory = V4L2_MEMORY_MMAP;
-        if (xioctl(camera->video_fd, VIDIOC_REQBUFS, &req) == -1) {
-                errno_printerr("VIDIOC_REQBUFS");
-        }
+        release_buffers(camera);
 
         return true;
 }
@@ -514,6 +561,12 @@ mp_camera_is_capturing(MPCamera *camera)
         return camera->num_buffers > 0;
 }
 
+bool
+mp_camera_is_streaming(MPCamera *camera)
+{
+        return camera->is_streaming;
+}
+
 bool
 mp_camera_capture_buffer(MPCamera *camera, MPBuffer *buffer)
 {
@@ -554,14 +607,25 @@ mp_camera_capture_buffer(MPCamera *camera, MPBuffer *buffer)
                 bytesused = buf.bytesused;
         }
 
-        assert(bytesused == (mp_pixel_format_width_to_bytes(pixel_format, width) +
-                             mp_pixel_format_width_to_padding(pixel_format, width)) *
-                                    height);
-        assert(bytesused == camera->buffers[buf.index].length);
+        if (pixel_format != MP_PIXEL_FMT_MJPEG) {
+                assert(bytesused ==
+                       (mp_pixel_format_width_to_bytes(pixel_format, width) +
+                        mp_pixel_format_width_to_padding(pixel_format, width)) *
+                               height);
+                assert(bytesused == camera->buffers[buf.index].length);
+        }
 
         buffer->index = buf.index;
         buffer->data = camera->buffers[buf.index].data;
         buffer->fd = camera->buffers[buf.index].fd;
+        buffer->bytesused = bytesused;
+
+        // Not every driver timestamps its buffers
+        buffer->timestamp =
+                buf.timestamp.tv_sec * 1000000LL + buf.timestamp.tv_usec;
+        if (buffer->timestamp == 0) {
+                buffer->timestamp = g_get_monotonic_time();
+        }
 
         return true;
 }
@@ -988,6 +1052,15 @@ struct _MPControlList {
         MPControlList *next;
 };
 
+struct control_entry {
+        MPControl control;
+
+        // Queried the first time they are asked for
+        bool has_menu_items;
+        MPControlMenuItem *menu_items;
+        size_t num_menu_items;
+};
+
 static int
 control_fd(MPCamera *camera)
 {
@@ -997,48 +1070,128 @@ control_fd(MPCamera *camera)
         return camera->video_fd;
 }
 
-MPControlList *
-mp_camera_list_controls(MPCamera *camera)
+int
+mp_camera_get_control_fd(MPCamera *camera)
 {
-        MPControlList *item = NULL;
+        return control_fd(camera);
+}
+
+static void
+control_from_query(MPControl *control, const struct v4l2_query_ext_ctrl *ctrl)
+{
+        control->id = ctrl->id;
+        control->type = ctrl->type;
+        strcpy(control->name, ctrl->name);
+        control->min = ctrl->minimum;
+        control->max = ctrl->maximum;
+        control->step = ctrl->step;
+        control->default_value = ctrl->default_value;
+        control->flags = ctrl->flags;
+        control->element_size = ctrl->elem_size;
+        control->element_count = ctrl->elems;
+        control->dimensions_count = ctrl->nr_of_dims;
+        memcpy(control->dimensions,
+               ctrl->dims,
+               sizeof(uint32_t) * V4L2_CTRL_MAX_DIMS);
+}
+
+static void
+query_menu_items(MPCamera *camera, struct control_entry *entry)
+{
+        free(entry->menu_items);
+        entry->menu_items = NULL;
+        entry->num_menu_items = 0;
+        entry->has_menu_items = true;
+
+        const MPControl *control = &entry->control;
+        if ((control->type != V4L2_CTRL_TYPE_MENU &&
+             control->type != V4L2_CTRL_TYPE_INTEGER_MENU) ||
+            control->max < control->min) {
+                return;
+        }
+
+        // Drivers can skip indices, those fail to query
+        entry->menu_items = calloc(control->max - control->min + 1,
+                                   sizeof(MPControlMenuItem));
+        for (int32_t i = control->min; i <= control->max; ++i) {
+                struct v4l2_querymenu menu = {
+                        .id = control->id,
+                        .index = i,
+                };
+                if (xioctl(control_fd(camera), VIDIOC_QUERYMENU, &menu) == -1) {
+                        continue;
+                }
+
+                MPControlMenuItem *item =
+                        &entry->menu_items[entry->num_menu_items++];
+                item->index = i;
+                if (control->type == V4L2_CTRL_TYPE_MENU) {
+                        strncpy(item->name,
+                                (const char *)menu.name,
+                                sizeof(item->name) - 1);
+                } else {
+                        item->value = menu.value;
+                }
+        }
+}
+
+static void
+free_control_entry(gpointer data)
+{
+        struct control_entry *entry = data;
+        free(entry->menu_items);
+        free(entry);
+}
+
+// Enumerate all controls once, so querying them doesn't need an ioctl
+static void
+load_controls(MPCamera *camera)
+{
+        camera->controls = g_hash_table_new_full(
+                g_direct_hash, g_direct_equal, NULL, free_control_entry);
 
         struct v4l2_query_ext_ctrl ctrl = {};
         ctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
-        while (true) {
-                if (xioctl(control_fd(camera), VIDIOC_QUERY_EXT_CTRL, &ctrl) == -1) {
-                        if (errno != EINVAL) {
-                                errno_printerr("VIDIOC_QUERY_EXT_CTRL");
-                        }
-                        break;
-                }
+        while (xioctl(control_fd(camera), VIDIOC_QUERY_EXT_CTRL, &ctrl) != -1) {
+                struct control_entry *entry =
+                        calloc(1, sizeof(struct control_entry));
+                control_from_query(&entry->control, &ctrl);
+                g_hash_table_insert(
+                        camera->controls, GUINT_TO_POINTER(ctrl.id), entry);
 
-                MPControl control = {
-                        .id = ctrl.id,
-                        .type = ctrl.type,
-                        .name = {},
-                        .min = ctrl.minimum,
-                        .max = ctrl.maximum,
-                        .step = ctrl.step,
-                        .default_value = ctrl.default_value,
-                        .flags = ctrl.flags,
-                        .element_size = ctrl.elem_size,
-                        .element_count = ctrl.elems,
-                        .dimensions_count = ctrl.nr_of_dims,
-                        .dimensions = {},
-                };
+                ctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+        }
+        if (errno != EINVAL) {
+                errno_printerr("VIDIOC_QUERY_EXT_CTRL");
+        }
+}
 
-                strcpy(control.name, ctrl.name);
-                memcpy(control.dimensions,
-                       ctrl.dims,
-                       sizeof(uint32_t) * V4L2_CTRL_MAX_DIMS);
+static gint
+compare_control_ids(gconstpointer a, gconstpointer b)
+{
+        guint id_a = GPOINTER_TO_UINT(a);
+        guint id_b = GPOINTER_TO_UINT(b);
+        return id_a < id_b ? -1 : id_a > id_b;
+}
+
+MPControlList *
+mp_camera_list_controls(MPCamera *camera)
+{
+        MPControlList *item = NULL;
+
+        // In the order they were enumerated in, by increasing id
+        GList *ids = g_list_sort(g_hash_table_get_keys(camera->controls),
+                                 compare_control_ids);
+        for (GList *id = ids; id; id = id->next) {
+                struct control_entry *entry =
+                        g_hash_table_lookup(camera->controls, id->data);
 
                 MPControlList *new_item = malloc(sizeof(MPControlList));
-                new_item->control = control;
+                new_item->control = entry->control;
                 new_item->next = item;
                 item = new_item;
-
-                ctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
         }
+        g_list_free(ids);
 
         return item;
 }
@@ -1070,34 +1223,107 @@ mp_control_list_free(MPControlList *list)
 bool
 mp_camera_query_control(MPCamera *camera, uint32_t id, MPControl *control)
 {
-        struct v4l2_query_ext_ctrl ctrl = {};
-        ctrl.id = id;
-        if (xioctl(control_fd(camera), VIDIOC_QUERY_EXT_CTRL, &ctrl) == -1) {
-                if (errno != EINVAL) {
-                        errno_printerr("VIDIOC_QUERY_EXT_CTRL");
-                }
+        struct control_entry *entry =
+                g_hash_table_lookup(camera->controls, GUINT_TO_POINTER(id));
+        if (!entry) {
                 return false;
         }
 
         if (control) {
-                control->id = ctrl.id;
-                control->type = ctrl.type;
-                strcpy(control->name, ctrl.name);
-                control->min = ctrl.minimum;
-                control->max = ctrl.maximum;
-                control->step = ctrl.step;
-                control->default_value = ctrl.default_value;
-                control->flags = ctrl.flags;
-                control->element_size = ctrl.elem_size;
-                control->element_count = ctrl.elems;
-                control->dimensions_count = ctrl.nr_of_dims;
-                memcpy(control->dimensions,
-                       ctrl.dims,
-                       sizeof(uint32_t) * V4L2_CTRL_MAX_DIMS);
+                *control = entry->control;
+        }
+        return true;
+}
+
+const MPControlMenuItem *
+mp_camera_get_control_menu(MPCamera *camera, uint32_t id, size_t *count)
+{
+        struct control_entry *entry =
+                g_hash_table_lookup(camera->controls, GUINT_TO_POINTER(id));
+        if (!entry) {
+                *count = 0;
+                return NULL;
+        }
+
+        if (!entry->has_menu_items) {
+                query_menu_items(camera, entry);
+        }
+
+        *count = entry->num_menu_items;
+        return entry->menu_items;
+}
+
+void
+mp_camera_handle_control_event(MPCamera *camera, const struct v4l2_event *event)
+{
+        if (event->type != V4L2_EVENT_CTRL) {
+                return;
+        }
+
+        struct control_entry *entry = g_hash_table_lookup(
+                camera->controls, GUINT_TO_POINTER(event->id));
+        if (!entry) {
+                return;
+        }
+
+        const struct v4l2_event_ctrl *ctrl = &event->u.ctrl;
+        if (ctrl->changes & V4L2_EVENT_CTRL_CH_FLAGS) {
+                entry->control.flags = ctrl->flags;
+        }
+        if (ctrl->changes & V4L2_EVENT_CTRL_CH_RANGE) {
+                entry->control.min = ctrl->minimum;
+                entry->control.max = ctrl->maximum;
+                entry->control.step = ctrl->step;
+                entry->control.default_value = ctrl->default_value;
+
+                // The items might have changed with the range
+                free(entry->menu_items);
+                entry->menu_items = NULL;
+                entry->num_menu_items = 0;
+                entry->has_menu_items = false;
+        }
+}
+
+bool
+mp_camera_subscribe_control_events(MPCamera *camera,
+                                   const uint32_t *ids,
+                                   size_t count)
+{
+        for (size_t i = 0; i < count; ++i) {
+                struct v4l2_event_subscription sub = {
+                        .type = V4L2_EVENT_CTRL,
+                        .id = ids[i],
+                        .flags = V4L2_EVENT_SUB_FL_SEND_INITIAL |
+                                 V4L2_EVENT_SUB_FL_ALLOW_FEEDBACK,
+                };
+                if (xioctl(control_fd(camera), VIDIOC_SUBSCRIBE_EVENT, &sub) ==
+                    -1) {
+                        errno_printerr("VIDIOC_SUBSCRIBE_EVENT");
+
+                        struct v4l2_event_subscription unsub = {
+                                .type = V4L2_EVENT_ALL,
+                        };
+                        xioctl(control_fd(camera), VIDIOC_UNSUBSCRIBE_EVENT, &unsub);
+                        return false;
+                }
         }
         return true;
 }
 
+bool
+mp_camera_dequeue_event(MPCamera *camera, struct v4l2_event *event)
+{
+        if (xioctl(control_fd(camera), VIDIOC_DQEVENT, event) == -1) {
+                if (errno != ENOENT) {
+                        errno_printerr("VIDIOC_DQEVENT");
+                }
+                return false;
+        }
+
+        mp_camera_handle_control_event(camera, event);
+        return true;
+}
+
 static bool
 control_impl_int32(MPCamera *camera, uint32_t id, int request, int32_t *value)
 {
@@ -1151,6 +1377,127 @@ mp_camera_control_set_int32_bg(MPCamera *camera, uint32_t id, int32_t v)
         _exit(0);
 }
 
+bool
+mp_camera_control_set_int32_batch(MPCamera *camera,
+                                  const uint32_t *ids,
+                                  const int32_t *values,
+                                  size_t count)
+{
+        assert(count <= MP_MAX_BATCH_CONTROLS);
+
+        struct v4l2_ext_control ctrl[MP_MAX_BATCH_CONTROLS] = {};
+        for (size_t i = 0; i < count; ++i) {
+                ctrl[i].id = ids[i];
+                ctrl[i].value = values[i];
+        }
+
+        // A single call, so the sensor applies all of them to the same frame
+        struct v4l2_ext_controls ctrls = {
+                .ctrl_class = 0,
+                .which = V4L2_CTRL_WHICH_CUR_VAL,
+                .count = count,
+                .controls = ctrl,
+        };
+        return xioctl(control_fd(camera), VIDIOC_S_EXT_CTRLS, &ctrls) != -1;
+}
+
+void
+mp_camera_control_snapshot_init(MPCamera *camera,
+                                MPControlSnapshot *snapshot,
+                                const uint32_t *ids,
+                                size_t count)
+{
+        assert(count <= MP_MAX_BATCH_CONTROLS);
+
+        snapshot->count = 0;
+        snapshot->is_valid = false;
+        for (size_t i = 0; i < count; ++i) {
+                if (mp_camera_query_control(camera, ids[i], NULL)) {
+                        snapshot->ids[snapshot->count++] = ids[i];
+                }
+        }
+}
+
+bool
+mp_camera_control_snapshot_update(MPCamera *camera, MPControlSnapshot *snapshot)
+{
+        if (snapshot->is_valid) {
+                return true;
+        }
+
+        while (snapshot->count > 0) {
+                struct v4l2_ext_control ctrl[MP_MAX_BATCH_CONTROLS] = {};
+                for (size_t i = 0; i < snapshot->count; ++i) {
+                        ctrl[i].id = snapshot->ids[i];
+                }
+
+                struct v4l2_ext_controls ctrls = {
+                        .ctrl_class = 0,
+                        .which = V4L2_CTRL_WHICH_CUR_VAL,
+                        .count = snapshot->count,
+                        .controls = ctrl,
+                };
+                if (xioctl(control_fd(camera), VIDIOC_G_EXT_CTRLS, &ctrls) != -1) {
+                        for (size_t i = 0; i < snapshot->count; ++i) {
+                                snapshot->values[i] = ctrl[i].value;
+                        }
+                        snapshot->is_valid = true;
+                        return true;
+                }
+
+                // A control that can't be read, like a write only one, fails
+                // the whole batch. Leave it out from now on.
+                if (ctrls.error_idx >= snapshot->count) {
+                        errno_printerr("VIDIOC_G_EXT_CTRLS");
+                        return false;
+                }
+
+                printf("Can't read control %s, leaving it out\n",
+                       mp_control_id_to_str(snapshot->ids[ctrls.error_idx]));
+                --snapshot->count;
+                for (size_t i = ctrls.error_idx; i < snapshot->count; ++i) {
+                        snapshot->ids[i] = snapshot->ids[i + 1];
+                }
+        }
+
+        return false;
+}
+
+void
+mp_control_snapshot_invalidate(MPControlSnapshot *snapshot)
+{
+        snapshot->is_valid = false;
+}
+
+void
+mp_control_snapshot_set(MPControlSnapshot *snapshot, uint32_t id, int32_t value)
+{
+        for (size_t i = 0; i < snapshot->count; ++i) {
+                if (snapshot->ids[i] == id) {
+                        snapshot->values[i] = value;
+                        return;
+                }
+        }
+}
+
+bool
+mp_control_snapshot_get(const MPControlSnapshot *snapshot,
+                        uint32_t id,
+                        int32_t *value)
+{
+        if (!snapshot->is_valid) {
+                return false;
+        }
+
+        for (size_t i = 0; i < snapshot->count; ++i) {
+                if (snapshot->ids[i] == id) {
+                        *value = snapshot->values[i];
+                        return true;
+                }
+        }
+        return false;
+}
+
 bool
 mp_camera_control_try_int32(MPCamera *camera, uint32_t id, int32_t *v)
 {
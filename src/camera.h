@@ -2,7 +2,9 @@
 
 #include "mode.h"
 
+#include <linux/videodev2.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/wait.h>
 
@@ -11,6 +13,10 @@ typedef struct {
 
         uint8_t *data;
         int fd;
+        // Size of the frame, less than the buffer for compressed formats
+        uint32_t bytesused;
+        // Time the frame was captured in microseconds, CLOCK_MONOTONIC
+        int64_t timestamp;
 } MPBuffer;
 
 typedef struct _MPCamera MPCamera;
@@ -25,14 +31,22 @@ bool mp_camera_check_task_complete(MPCamera *camera, pid_t pid);
 bool mp_camera_is_subdev(MPCamera *camera);
 int mp_camera_get_video_fd(MPCamera *camera);
 int mp_camera_get_subdev_fd(MPCamera *camera);
+// The fd controls are set on, the subdev if there is one
+int mp_camera_get_control_fd(MPCamera *camera);
 
 const MPMode *mp_camera_get_mode(const MPCamera *camera);
 bool mp_camera_try_mode(MPCamera *camera, MPMode *mode);
 
 bool mp_camera_set_mode(MPCamera *camera, MPMode *mode);
+bool mp_camera_set_subdev_mode(MPCamera *camera, MPMode *mode);
 bool mp_camera_start_capture(MPCamera *camera);
 bool mp_camera_stop_capture(MPCamera *camera);
 bool mp_camera_is_capturing(MPCamera *camera);
+// allocate buffers without streaming, and toggle streaming while keeping them
+bool mp_camera_prepare_capture(MPCamera *camera);
+bool mp_camera_resume_capture(MPCamera *camera);
+bool mp_camera_pause_capture(MPCamera *camera);
+bool mp_camera_is_streaming(MPCamera *camera);
 bool mp_camera_capture_buffer(MPCamera *camera, MPBuffer *buffer);
 bool mp_camera_release_buffer(MPCamera *camera, uint32_t buffer_index);
 
@@ -70,7 +84,31 @@ MPControl *mp_control_list_get(MPControlList *list);
 MPControlList *mp_control_list_next(MPControlList *list);
 void mp_control_list_free(MPControlList *list);
 
+typedef struct {
+        uint32_t index;
+        // Set for menu controls, integer menu controls have a value instead
+        char name[32];
+        int64_t value;
+} MPControlMenuItem;
+
+// Looked up in the controls enumerated when the camera was created
 bool mp_camera_query_control(MPCamera *camera, uint32_t id, MPControl *control);
+// The valid items of a menu control, queried the first time they are asked
+// for and owned by the camera
+const MPControlMenuItem *
+mp_camera_get_control_menu(MPCamera *camera, uint32_t id, size_t *count);
+// Update the enumerated controls from a V4L2_EVENT_CTRL event
+void mp_camera_handle_control_event(MPCamera *camera,
+                                    const struct v4l2_event *event);
+// Subscribe to V4L2_EVENT_CTRL for the controls, which are signaled with
+// POLLPRI on the control fd. Also sent for the current values and changes
+// made by ourselves.
+bool mp_camera_subscribe_control_events(MPCamera *camera,
+                                        const uint32_t *ids,
+                                        size_t count);
+// Returns false once no event is pending. The enumerated controls are
+// updated before the event is returned.
+bool mp_camera_dequeue_event(MPCamera *camera, struct v4l2_event *event);
 
 bool mp_camera_control_try_int32(MPCamera *camera, uint32_t id, int32_t *v);
 bool mp_camera_control_set_int32(MPCamera *camera, uint32_t id, int32_t v);
@@ -78,6 +116,39 @@ int32_t mp_camera_control_get_int32(MPCamera *camera, uint32_t id);
 // set the value in the background, discards result
 pid_t mp_camera_control_set_int32_bg(MPCamera *camera, uint32_t id, int32_t v);
 
+#define MP_MAX_BATCH_CONTROLS 8
+
+bool mp_camera_control_set_int32_batch(MPCamera *camera,
+                                       const uint32_t *ids,
+                                       const int32_t *values,
+                                       size_t count);
+
+// The values of a set of controls, read together with one ioctl and kept
+// until invalidated
+typedef struct {
+        uint32_t ids[MP_MAX_BATCH_CONTROLS];
+        int32_t values[MP_MAX_BATCH_CONTROLS];
+        size_t count;
+        bool is_valid;
+} MPControlSnapshot;
+
+// Controls the camera doesn't have are left out
+void mp_camera_control_snapshot_init(MPCamera *camera,
+                                     MPControlSnapshot *snapshot,
+                                     const uint32_t *ids,
+                                     size_t count);
+// Reads all values, unless they were read since the last invalidate
+bool mp_camera_control_snapshot_update(MPCamera *camera,
+                                       MPControlSnapshot *snapshot);
+void mp_control_snapshot_invalidate(MPControlSnapshot *snapshot);
+// Update a value that is known to have changed, like from a control event
+void mp_control_snapshot_set(MPControlSnapshot *snapshot,
+                             uint32_t id,
+                             int32_t value);
+bool mp_control_snapshot_get(const MPControlSnapshot *snapshot,
+                             uint32_t id,
+                             int32_t *value);
+
 bool mp_camera_control_try_bool(MPCamera *camera, uint32_t id, bool *v);
 bool mp_camera_control_set_bool(MPCamera *camera, uint32_t id, bool v);
 bool mp_camera_control_get_bool(MPCamera *camera, uint32_t id);
@@ -100,6 +100,10 @@ config_handle_camera_mode(const char *prefix,
         } else if (strcmp(name, "rate") == 0) {
                 mode->frame_interval.numerator = 1;
                 mode->frame_interval.denominator = strtoint(value, NULL, 10);
+        } else if (strcmp(name, "fmt") == 0 && strcmp(value, "auto") == 0 &&
+                   strcmp(prefix, "preview-") == 0) {
+                // Picked from the modes of the sensor once it's opened
+                mode->pixel_format = MP_PIXEL_FMT_UNSUPPORTED;
         } else if (strcmp(name, "fmt") == 0) {
                 mode->pixel_format = mp_pixel_format_from_str(value);
                 if (mode->pixel_format == MP_PIXEL_FMT_UNSUPPORTED) {
@@ -222,6 +226,8 @@ config_ini_handler(void *user,
                         cc->iso_min = strtod(value, NULL);
                 } else if (strcmp(name, "iso-max") == 0) {
                         cc->iso_max = strtod(value, NULL);
+                } else if (strcmp(name, "software-ae") == 0) {
+                        cc->software_ae = strcmp(value, "true") == 0;
                 } else if (strcmp(name, "flash-path") == 0) {
                         strcpy(cc->flash_path, value);
                         cc->has_flash = true;
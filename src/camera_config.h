@@ -42,6 +42,8 @@ struct mp_camera_config {
         int iso_min;
         int iso_max;
 
+        bool software_ae;
+
         char flash_path[260];
         bool flash_display;
         bool has_flash;
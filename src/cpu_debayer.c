@@ -0,0 +1,496 @@
+#include "cpu_debayer.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_BANDS 16
+
+// Colors are processed as 12-bit linear values, the matrix in 4.12 fixed point
+#define LINEAR_BITS 12
+#define LINEAR_MAX ((1 << LINEAR_BITS) - 1)
+#define MATRIX_SHIFT 12
+
+struct band {
+        CPUDebayer *self;
+        uint32_t start_row;
+        uint32_t end_row;
+};
+
+struct _CPUDebayer {
+        MPPixelFormat format;
+
+        // Position of the colors within a 2x2 cell, counting left to right and
+        // top to bottom, and their byte offsets in the source
+        int red_index;
+        int green1_index;
+        int green2_index;
+        int blue_index;
+        size_t red_offset;
+        size_t green1_offset;
+        size_t green2_offset;
+        size_t blue_offset;
+
+        // YUV is converted directly, using the first pixel of every other
+        // pair and the chroma they share
+        bool is_yuv;
+        size_t luma_offset;
+        size_t cb_offset;
+        size_t cr_offset;
+
+        uint32_t dst_width;
+        uint32_t dst_height;
+        uint32_t src_width;
+        uint32_t src_height;
+        size_t src_stride;
+        // Only every n-th cell is used when the output is smaller
+        uint32_t skip;
+        uint32_t rotation;
+        bool mirrored;
+
+        // Byte offset of the cell used for every output column within a row
+        uint32_t *cell_offsets;
+        // Output rows map to consecutive cells of a source row pair, for 8-bit
+        // sources that aren't rotated, mirrored or skipped
+        bool is_contiguous;
+
+        bool has_matrix;
+        int32_t matrix[9];
+        uint16_t linear[256];
+        // Indexed by the sum of both greens of a cell
+        uint16_t green_linear[511];
+        uint8_t gamma[LINEAR_MAX + 1];
+        // Levels and gamma in one, for when there is no matrix in between
+        uint8_t output[256];
+        uint8_t green_output[511];
+
+        GThreadPool *pool;
+        size_t num_bands;
+        struct band bands[MAX_BANDS];
+        int bands_remaining;
+        GMutex mutex;
+        GCond cond;
+
+        const uint8_t *source;
+        uint8_t *destination;
+};
+
+static void process_band(gpointer data, gpointer user_data);
+
+CPUDebayer *
+cpu_debayer_new(MPPixelFormat format)
+{
+        if (format != MP_PIXEL_FMT_BGGR8 && format != MP_PIXEL_FMT_GBRG8 &&
+            format != MP_PIXEL_FMT_GRBG8 && format != MP_PIXEL_FMT_RGGB8 &&
+            format != MP_PIXEL_FMT_BGGR10P && format != MP_PIXEL_FMT_GBRG10P &&
+            format != MP_PIXEL_FMT_GRBG10P && format != MP_PIXEL_FMT_RGGB10P &&
+            !mp_pixel_format_is_yuv(format)) {
+                return NULL;
+        }
+
+        CPUDebayer *self = calloc(1, sizeof(CPUDebayer));
+        self->format = format;
+
+        const char *cfa = mp_pixel_format_cfa(format);
+        if (mp_pixel_format_is_yuv(format)) {
+                self->is_yuv = true;
+                bool is_uyvy = format == MP_PIXEL_FMT_UYVY;
+                self->luma_offset = is_uyvy ? 1 : 0;
+                self->cb_offset = is_uyvy ? 0 : 1;
+                self->cr_offset = is_uyvy ? 2 : 3;
+        } else if (strcmp(cfa, "BGGR") == 0) {
+                self->red_index = 3;
+                self->blue_index = 0;
+        } else if (strcmp(cfa, "GBRG") == 0) {
+                self->red_index = 2;
+                self->blue_index = 1;
+        } else if (strcmp(cfa, "GRBG") == 0) {
+                self->red_index = 1;
+                self->blue_index = 2;
+        } else {
+                self->red_index = 0;
+                self->blue_index = 3;
+        }
+
+        // Green is on the other diagonal
+        self->green1_index = self->red_index ^ 1;
+        self->green2_index = self->red_index ^ 2;
+
+        self->num_bands = MIN(g_get_num_processors(), MAX_BANDS);
+        self->pool = g_thread_pool_new(
+                process_band, NULL, self->num_bands, false, NULL);
+
+        g_mutex_init(&self->mutex);
+        g_cond_init(&self->cond);
+
+        return self;
+}
+
+void
+cpu_debayer_free(CPUDebayer *self)
+{
+        g_thread_pool_free(self->pool, false, true);
+
+        g_mutex_clear(&self->mutex);
+        g_cond_clear(&self->cond);
+
+        free(self->cell_offsets);
+        free(self);
+}
+
+static size_t
+cell_index_to_offset(size_t index, size_t stride)
+{
+        // The two pixels of a cell never straddle the 5th byte of 10-bit
+        // packed data, so only the row matters
+        return (index / 2) * stride + index % 2;
+}
+
+void
+cpu_debayer_configure(CPUDebayer *self,
+                      const uint32_t dst_width,
+                      const uint32_t dst_height,
+                      const uint32_t src_width,
+                      const uint32_t src_height,
+                      const uint32_t rotation,
+                      const bool mirrored,
+                      const float *colormatrix,
+                      const int blacklevel,
+                      const int whitelevel)
+{
+        self->dst_width = dst_width;
+        self->dst_height = dst_height;
+        self->src_width = src_width;
+        self->src_height = src_height;
+        self->src_stride =
+                mp_pixel_format_width_to_bytes(self->format, src_width) +
+                mp_pixel_format_width_to_padding(self->format, src_width);
+        self->rotation = rotation;
+        self->mirrored = mirrored;
+
+        self->red_offset = cell_index_to_offset(self->red_index, self->src_stride);
+        self->green1_offset =
+                cell_index_to_offset(self->green1_index, self->src_stride);
+        self->green2_offset =
+                cell_index_to_offset(self->green2_index, self->src_stride);
+        self->blue_offset =
+                cell_index_to_offset(self->blue_index, self->src_stride);
+
+        uint32_t dst_unrotated_width =
+                (rotation == 90 || rotation == 270) ? dst_height : dst_width;
+        self->skip = MAX(1, src_width / 2 / dst_unrotated_width);
+
+        free(self->cell_offsets);
+        self->cell_offsets = malloc(dst_unrotated_width * sizeof(uint32_t));
+        for (uint32_t x = 0; x < dst_unrotated_width; ++x) {
+                uint32_t pixel = x * self->skip * 2;
+                if (mp_pixel_format_bits_per_pixel(self->format) == 10) {
+                        // Skip the byte with the low bits after every 4 pixels
+                        self->cell_offsets[x] = pixel + pixel / 4;
+                } else if (self->is_yuv) {
+                        self->cell_offsets[x] = pixel * 2;
+                } else {
+                        self->cell_offsets[x] = pixel;
+                }
+        }
+
+        self->is_contiguous = rotation == 0 && !mirrored && self->skip == 1 &&
+                              !self->is_yuv &&
+                              mp_pixel_format_bits_per_pixel(self->format) == 8;
+
+        // Only the 8 most significant bits are used, scale the levels from
+        // the sensor's bit depth
+        float max_level = (1 << mp_pixel_format_pixel_depth(self->format)) - 1;
+        float black = blacklevel / max_level;
+        float white = (whitelevel ? whitelevel : max_level) / max_level;
+        for (int i = 0; i < 256; ++i) {
+                float value = (i / 255.0f - black) / (white - black);
+                self->linear[i] = CLAMP(value, 0.0f, 1.0f) * LINEAR_MAX + 0.5f;
+        }
+        for (int i = 0; i < 511; ++i) {
+                float value = (i / 510.0f - black) / (white - black);
+                self->green_linear[i] =
+                        CLAMP(value, 0.0f, 1.0f) * LINEAR_MAX + 0.5f;
+        }
+
+        for (int i = 0; i <= LINEAR_MAX; ++i) {
+                self->gamma[i] =
+                        powf((float)i / LINEAR_MAX, 1.0f / 2.2f) * 255.0f + 0.5f;
+        }
+
+        for (int i = 0; i < 256; ++i) {
+                self->output[i] = self->gamma[self->linear[i]];
+        }
+        for (int i = 0; i < 511; ++i) {
+                self->green_output[i] = self->gamma[self->green_linear[i]];
+        }
+
+        self->has_matrix = colormatrix != NULL;
+        if (colormatrix) {
+                for (int i = 0; i < 9; ++i) {
+                        self->matrix[i] =
+                                lroundf(colormatrix[i] * (1 << MATRIX_SHIFT));
+                }
+        }
+}
+
+static inline int
+clamp_linear(int32_t value)
+{
+        return value < 0 ? 0 : (value > LINEAR_MAX ? LINEAR_MAX : value);
+}
+
+// Find the cell for the first pixel of a row and how to step to the next one,
+// the inverse of rotating and then mirroring the image
+static void
+find_row_cells(CPUDebayer *self,
+               uint32_t y,
+               int32_t *cell_x,
+               int32_t *cell_y,
+               int32_t *step_x,
+               int32_t *step_y)
+{
+        uint32_t dst_width = self->dst_width;
+        uint32_t dst_height = self->dst_height;
+        int32_t x_r = self->mirrored ? dst_width - 1 : 0;
+        int32_t step = self->mirrored ? -1 : 1;
+        switch (self->rotation) {
+        case 90:
+                *cell_x = dst_height - 1 - y;
+                *cell_y = x_r;
+                *step_x = 0;
+                *step_y = step;
+                break;
+        case 180:
+                *cell_x = dst_width - 1 - x_r;
+                *cell_y = dst_height - 1 - y;
+                *step_x = -step;
+                *step_y = 0;
+                break;
+        case 270:
+                *cell_x = y;
+                *cell_y = dst_width - 1 - x_r;
+                *step_x = 0;
+                *step_y = -step;
+                break;
+        default:
+                *cell_x = x_r;
+                *cell_y = y;
+                *step_x = step;
+                *step_y = 0;
+                break;
+        }
+}
+
+static inline uint8_t
+clamp_byte(int32_t value)
+{
+        return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+// BT.601 limited range to RGB in 8.8 fixed point. The source is already gamma
+// encoded, so the levels, color matrix and gamma curve don't apply.
+static void
+process_row_yuv(CPUDebayer *self, uint32_t y)
+{
+        uint32_t dst_width = self->dst_width;
+        size_t cell_stride = self->src_stride * 2 * self->skip;
+
+        int32_t cell_x, cell_y, step_x, step_y;
+        find_row_cells(self, y, &cell_x, &cell_y, &step_x, &step_y);
+
+        const uint8_t *source = self->source;
+        const uint32_t *cell_offsets = self->cell_offsets;
+        const size_t luma_offset = self->luma_offset;
+        const size_t cb_offset = self->cb_offset;
+        const size_t cr_offset = self->cr_offset;
+        uint8_t *out = self->destination + (size_t)y * dst_width * 3;
+
+        for (uint32_t x = 0; x < dst_width; ++x) {
+                const uint8_t *cell =
+                        source + cell_y * cell_stride + cell_offsets[cell_x];
+
+                int32_t c = 298 * (cell[luma_offset] - 16) + 128;
+                int32_t d = cell[cb_offset] - 128;
+                int32_t e = cell[cr_offset] - 128;
+
+                out[0] = clamp_byte((c + 409 * e) >> 8);
+                out[1] = clamp_byte((c - 100 * d - 208 * e) >> 8);
+                out[2] = clamp_byte((c + 516 * d) >> 8);
+                out += 3;
+
+                cell_x += step_x;
+                cell_y += step_y;
+        }
+}
+
+static void
+process_row(CPUDebayer *self, uint32_t y)
+{
+        uint32_t dst_width = self->dst_width;
+        size_t cell_stride = self->src_stride * 2 * self->skip;
+
+        int32_t cell_x, cell_y, step_x, step_y;
+        find_row_cells(self, y, &cell_x, &cell_y, &step_x, &step_y);
+
+        const uint8_t *source = self->source;
+        const uint32_t *cell_offsets = self->cell_offsets;
+        const uint16_t *linear = self->linear;
+        const uint16_t *green_linear = self->green_linear;
+        const uint8_t *gamma = self->gamma;
+        const int32_t *m = self->matrix;
+        const bool has_matrix = self->has_matrix;
+        const size_t red_offset = self->red_offset;
+        const size_t green1_offset = self->green1_offset;
+        const size_t green2_offset = self->green2_offset;
+        const size_t blue_offset = self->blue_offset;
+        uint8_t *out = self->destination + (size_t)y * dst_width * 3;
+
+        for (uint32_t x = 0; x < dst_width; ++x) {
+                const uint8_t *cell =
+                        source + cell_y * cell_stride + cell_offsets[cell_x];
+
+                int32_t r = linear[cell[red_offset]];
+                int32_t g = green_linear[cell[green1_offset] + cell[green2_offset]];
+                int32_t b = linear[cell[blue_offset]];
+
+                if (has_matrix) {
+                        int32_t mr = (m[0] * r + m[1] * g + m[2] * b) >>
+                                     MATRIX_SHIFT;
+                        int32_t mg = (m[3] * r + m[4] * g + m[5] * b) >>
+                                     MATRIX_SHIFT;
+                        int32_t mb = (m[6] * r + m[7] * g + m[8] * b) >>
+                                     MATRIX_SHIFT;
+                        r = clamp_linear(mr);
+                        g = clamp_linear(mg);
+                        b = clamp_linear(mb);
+                }
+
+                out[0] = gamma[r];
+                out[1] = gamma[g];
+                out[2] = gamma[b];
+                out += 3;
+
+                cell_x += step_x;
+                cell_y += step_y;
+        }
+}
+
+// The same as process_row without the gathers, the cells of an output row
+// are consecutive and read in order
+static void
+process_row_contiguous(CPUDebayer *self, uint32_t y)
+{
+        uint32_t dst_width = self->dst_width;
+        const uint8_t *cells = self->source + (size_t)y * self->src_stride * 2;
+        const uint8_t *restrict red = cells + self->red_offset;
+        const uint8_t *restrict green1 = cells + self->green1_offset;
+        const uint8_t *restrict green2 = cells + self->green2_offset;
+        const uint8_t *restrict blue = cells + self->blue_offset;
+        uint8_t *restrict out = self->destination + (size_t)y * dst_width * 3;
+
+        // Without a matrix every channel is a single lookup of the source
+        // values, the green one by the sum of both greens
+        if (!self->has_matrix) {
+                const uint8_t *restrict output = self->output;
+                const uint8_t *restrict green_output = self->green_output;
+                for (uint32_t x = 0; x < dst_width; ++x) {
+                        out[0] = output[red[x * 2]];
+                        out[1] = green_output[green1[x * 2] + green2[x * 2]];
+                        out[2] = output[blue[x * 2]];
+                        out += 3;
+                }
+                return;
+        }
+
+        const uint16_t *restrict linear = self->linear;
+        const uint16_t *restrict green_linear = self->green_linear;
+        const uint8_t *restrict gamma = self->gamma;
+        const int32_t *m = self->matrix;
+        for (uint32_t x = 0; x < dst_width; ++x) {
+                int32_t r = linear[red[x * 2]];
+                int32_t g = green_linear[green1[x * 2] + green2[x * 2]];
+                int32_t b = linear[blue[x * 2]];
+
+                int32_t mr = (m[0] * r + m[1] * g + m[2] * b) >> MATRIX_SHIFT;
+                int32_t mg = (m[3] * r + m[4] * g + m[5] * b) >> MATRIX_SHIFT;
+                int32_t mb = (m[6] * r + m[7] * g + m[8] * b) >> MATRIX_SHIFT;
+
+                out[0] = gamma[clamp_linear(mr)];
+                out[1] = gamma[clamp_linear(mg)];
+                out[2] = gamma[clamp_linear(mb)];
+                out += 3;
+        }
+}
+
+static void
+process_band(gpointer data, gpointer user_data)
+{
+        struct band *band = data;
+        CPUDebayer *self = band->self;
+
+        for (uint32_t y = band->start_row; y < band->end_row; ++y) {
+                if (self->is_yuv) {
+                        process_row_yuv(self, y);
+                } else if (self->is_contiguous) {
+                        process_row_contiguous(self, y);
+                } else {
+                        process_row(self, y);
+                }
+        }
+
+        g_mutex_lock(&self->mutex);
+        if (--self->bands_remaining == 0) {
+                g_cond_signal(&self->cond);
+        }
+        g_mutex_unlock(&self->mutex);
+}
+
+GdkTexture *
+cpu_debayer_process(CPUDebayer *self, const uint8_t *source)
+{
+        assert(self->cell_offsets);
+
+        size_t stride = self->dst_width * 3;
+        self->source = source;
+        self->destination = g_malloc(stride * self->dst_height);
+
+        // Split the output in bands of rows, one per core
+        uint32_t rows_per_band =
+                (self->dst_height + self->num_bands - 1) / self->num_bands;
+
+        g_mutex_lock(&self->mutex);
+        self->bands_remaining = 0;
+        for (size_t i = 0; i < self->num_bands; ++i) {
+                struct band *band = &self->bands[i];
+                band->self = self;
+                band->start_row = MIN(i * rows_per_band, self->dst_height);
+                band->end_row = MIN((i + 1) * rows_per_band, self->dst_height);
+                if (band->start_row == band->end_row) {
+                        break;
+                }
+
+                ++self->bands_remaining;
+                g_thread_pool_push(self->pool, band, NULL);
+        }
+
+        while (self->bands_remaining > 0) {
+                g_cond_wait(&self->cond, &self->mutex);
+        }
+        g_mutex_unlock(&self->mutex);
+
+        GBytes *bytes =
+                g_bytes_new_take(self->destination, stride * self->dst_height);
+        GdkTexture *texture = gdk_memory_texture_new(self->dst_width,
+                                                     self->dst_height,
+                                                     GDK_MEMORY_R8G8B8,
+                                                     bytes,
+                                                     stride);
+        g_bytes_unref(bytes);
+
+        self->destination = NULL;
+        self->source = NULL;
+
+        return texture;
+}
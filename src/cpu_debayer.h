@@ -0,0 +1,24 @@
+#pragma once
+
+#include "camera.h"
+#include <gtk/gtk.h>
+
+typedef struct _CPUDebayer CPUDebayer;
+
+// Half resolution debayer on the CPU, for when there is no usable GL context.
+// YUV sources are converted at the same resolution.
+CPUDebayer *cpu_debayer_new(MPPixelFormat format);
+void cpu_debayer_free(CPUDebayer *self);
+
+void cpu_debayer_configure(CPUDebayer *self,
+                           const uint32_t dst_width,
+                           const uint32_t dst_height,
+                           const uint32_t src_width,
+                           const uint32_t src_height,
+                           const uint32_t rotation,
+                           const bool mirrored,
+                           const float *colormatrix,
+                           const int blacklevel,
+                           const int whitelevel);
+
+GdkTexture *cpu_debayer_process(CPUDebayer *self, const uint8_t *source);
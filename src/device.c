@@ -55,6 +55,21 @@ struct _MPDevice {
         size_t num_pads;
         struct media_v2_link *links;
         size_t num_links;
+
+        // Lookup tables into the arrays above, built once when the device is
+        // opened so lookups don't need to scan the whole topology
+        GHashTable *entities_by_id;
+        GHashTable *entities_by_name;
+        GHashTable *entities_by_driver;
+        GHashTable *entities_by_function;
+        GHashTable *interfaces_by_id;
+        GHashTable *pads_by_id;
+        GHashTable *pads_by_entity;
+        GHashTable *links_by_id;
+        GHashTable *links_by_source;
+        GHashTable *links_by_sink;
+        GHashTable *links_by_endpoints;
+        uint64_t *link_endpoints;
 };
 
 static void
@@ -73,6 +88,114 @@ xioctl(int fd, int request, void *arg)
         return r;
 }
 
+static void
+index_insert(GHashTable *table, gconstpointer key, gconstpointer value)
+{
+        // Keep the first match, which is what a linear scan would have found
+        if (!g_hash_table_contains(table, key)) {
+                g_hash_table_insert(table, (gpointer)key, (gpointer)value);
+        }
+}
+
+static void
+build_indices(MPDevice *device)
+{
+        device->entities_by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+        device->entities_by_name = g_hash_table_new(g_str_hash, g_str_equal);
+        device->entities_by_driver =
+                g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        device->entities_by_function =
+                g_hash_table_new(g_direct_hash, g_direct_equal);
+        for (size_t i = 0; i < device->num_entities; ++i) {
+                const struct media_v2_entity *entity = &device->entities[i];
+
+                index_insert(device->entities_by_id,
+                             GUINT_TO_POINTER(entity->id),
+                             entity);
+                index_insert(device->entities_by_name, entity->name, entity);
+                index_insert(device->entities_by_function,
+                             GUINT_TO_POINTER(entity->function),
+                             entity);
+
+                // Entity names are usually "<driver> <bus>-<address>", the
+                // configs only refer to the driver part
+                const char *space = strchr(entity->name, ' ');
+                if (space) {
+                        char *driver =
+                                g_strndup(entity->name, space - entity->name);
+                        if (g_hash_table_contains(device->entities_by_driver,
+                                                  driver)) {
+                                g_free(driver);
+                        } else {
+                                g_hash_table_insert(device->entities_by_driver,
+                                                    driver,
+                                                    (gpointer)entity);
+                        }
+                }
+        }
+
+        device->interfaces_by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+        for (size_t i = 0; i < device->num_interfaces; ++i) {
+                index_insert(device->interfaces_by_id,
+                             GUINT_TO_POINTER(device->interfaces[i].id),
+                             &device->interfaces[i]);
+        }
+
+        device->pads_by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+        device->pads_by_entity = g_hash_table_new(g_direct_hash, g_direct_equal);
+        for (size_t i = 0; i < device->num_pads; ++i) {
+                const struct media_v2_pad *pad = &device->pads[i];
+
+                index_insert(device->pads_by_id, GUINT_TO_POINTER(pad->id), pad);
+                index_insert(device->pads_by_entity,
+                             GUINT_TO_POINTER(pad->entity_id),
+                             pad);
+        }
+
+        device->links_by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+        device->links_by_source = g_hash_table_new(g_direct_hash, g_direct_equal);
+        device->links_by_sink = g_hash_table_new(g_direct_hash, g_direct_equal);
+        device->links_by_endpoints = g_hash_table_new(g_int64_hash, g_int64_equal);
+        device->link_endpoints = calloc(device->num_links, sizeof(uint64_t));
+        for (size_t i = 0; i < device->num_links; ++i) {
+                const struct media_v2_link *link = &device->links[i];
+
+                index_insert(
+                        device->links_by_id, GUINT_TO_POINTER(link->id), link);
+                index_insert(device->links_by_source,
+                             GUINT_TO_POINTER(link->source_id),
+                             link);
+                index_insert(device->links_by_sink,
+                             GUINT_TO_POINTER(link->sink_id),
+                             link);
+
+                device->link_endpoints[i] =
+                        ((uint64_t)link->source_id << 32) | link->sink_id;
+                index_insert(device->links_by_endpoints,
+                             &device->link_endpoints[i],
+                             link);
+        }
+}
+
+static void
+destroy_indices(MPDevice *device)
+{
+        GHashTable **tables[] = {
+                &device->entities_by_id,   &device->entities_by_name,
+                &device->entities_by_driver, &device->entities_by_function,
+                &device->interfaces_by_id, &device->pads_by_id,
+                &device->pads_by_entity,   &device->links_by_id,
+                &device->links_by_source,  &device->links_by_sink,
+                &device->links_by_endpoints,
+        };
+        for (size_t i = 0; i < G_N_ELEMENTS(tables); ++i) {
+                g_clear_pointer(tables[i], g_hash_table_destroy);
+        }
+
+        free(device->link_endpoints);
+        device->link_endpoints = NULL;
+}
+
 MPDevice *
 mp_device_find(const char *driver_name, const char *dev_name)
 {
@@ -141,6 +264,8 @@ mp_device_new(int fd)
                 return NULL;
         }
 
+        build_indices(device);
+
         return device;
 }
 
@@ -148,6 +273,7 @@ void
 mp_device_close(MPDevice *device)
 {
         close(device->fd);
+        destroy_indices(device);
         free(device->entities);
         free(device->interfaces);
         free(device->pads);
@@ -240,9 +366,20 @@ mp_entity_pad_set_format(MPDevice *device,
 const struct media_v2_entity *
 mp_device_find_entity(const MPDevice *device, const char *driver_name)
 {
+        const struct media_v2_entity *entity =
+                g_hash_table_lookup(device->entities_by_name, driver_name);
+        if (entity) {
+                return entity;
+        }
+
+        entity = g_hash_table_lookup(device->entities_by_driver, driver_name);
+        if (entity) {
+                return entity;
+        }
+
         int length = strlen(driver_name);
 
-        // Find the entity from the name
+        // Fall back to matching any entity whose name starts with driver_name
         for (uint32_t i = 0; i < device->num_entities; ++i) {
                 if (strncmp(device->entities[i].name, driver_name, length) == 0) {
                         return &device->entities[i];
@@ -254,13 +391,8 @@ mp_device_find_entity(const MPDevice *device, const char *driver_name)
 const struct media_v2_entity *
 mp_device_find_entity_type(const MPDevice *device, const uint32_t type)
 {
-        // Find the entity from the entity type
-        for (uint32_t i = 0; i < device->num_entities; ++i) {
-                if (device->entities[i].function == type) {
-                        return &device->entities[i];
-                }
-        }
-        return NULL;
+        return g_hash_table_lookup(device->entities_by_function,
+                                   GUINT_TO_POINTER(type));
 }
 
 const struct media_device_info *
@@ -272,12 +404,7 @@ mp_device_get_info(const MPDevice *device)
 const struct media_v2_entity *
 mp_device_get_entity(const MPDevice *device, uint32_t id)
 {
-        for (int i = 0; i < device->num_entities; ++i) {
-                if (device->entities[i].id == id) {
-                        return &device->entities[i];
-                }
-        }
-        return NULL;
+        return g_hash_table_lookup(device->entities_by_id, GUINT_TO_POINTER(id));
 }
 
 const struct media_v2_entity *
@@ -306,12 +433,7 @@ mp_device_find_entity_interface(const MPDevice *device, uint32_t entity_id)
 const struct media_v2_interface *
 mp_device_get_interface(const MPDevice *device, uint32_t id)
 {
-        for (int i = 0; i < device->num_interfaces; ++i) {
-                if (device->interfaces[i].id == id) {
-                        return &device->interfaces[i];
-                }
-        }
-        return NULL;
+        return g_hash_table_lookup(device->interfaces_by_id, GUINT_TO_POINTER(id));
 }
 
 const struct media_v2_interface *
@@ -329,23 +451,14 @@ mp_device_get_num_interfaces(const MPDevice *device)
 const struct media_v2_pad *
 mp_device_get_pad_from_entity(const MPDevice *device, uint32_t entity_id)
 {
-        for (int i = 0; i < device->num_pads; ++i) {
-                if (device->pads[i].entity_id == entity_id) {
-                        return &device->pads[i];
-                }
-        }
-        return NULL;
+        return g_hash_table_lookup(device->pads_by_entity,
+                                   GUINT_TO_POINTER(entity_id));
 }
 
 const struct media_v2_pad *
 mp_device_get_pad(const MPDevice *device, uint32_t id)
 {
-        for (int i = 0; i < device->num_pads; ++i) {
-                if (device->pads[i].id == id) {
-                        return &device->pads[i];
-                }
-        }
-        return NULL;
+        return g_hash_table_lookup(device->pads_by_id, GUINT_TO_POINTER(id));
 }
 
 const struct media_v2_pad *
@@ -375,46 +488,27 @@ mp_device_find_entity_link(const MPDevice *device, uint32_t entity_id)
 const struct media_v2_link *
 mp_device_find_link_from(const MPDevice *device, uint32_t source)
 {
-        for (int i = 0; i < device->num_links; ++i) {
-                if (device->links[i].source_id == source) {
-                        return &device->links[i];
-                }
-        }
-        return NULL;
+        return g_hash_table_lookup(device->links_by_source,
+                                   GUINT_TO_POINTER(source));
 }
 
 const struct media_v2_link *
 mp_device_find_link_to(const MPDevice *device, uint32_t sink)
 {
-        for (int i = 0; i < device->num_links; ++i) {
-                if (device->links[i].sink_id == sink) {
-                        return &device->links[i];
-                }
-        }
-        return NULL;
+        return g_hash_table_lookup(device->links_by_sink, GUINT_TO_POINTER(sink));
 }
 
 const struct media_v2_link *
 mp_device_find_link_between(const MPDevice *device, uint32_t source, uint32_t sink)
 {
-        for (int i = 0; i < device->num_links; ++i) {
-                if (device->links[i].source_id == source &&
-                    device->links[i].sink_id == sink) {
-                        return &device->links[i];
-                }
-        }
-        return NULL;
+        uint64_t endpoints = ((uint64_t)source << 32) | sink;
+        return g_hash_table_lookup(device->links_by_endpoints, &endpoints);
 }
 
 const struct media_v2_link *
 mp_device_get_link(const MPDevice *device, uint32_t id)
 {
-        for (int i = 0; i < device->num_links; ++i) {
-                if (device->links[i].id == id) {
-                        return &device->links[i];
-                }
-        }
-        return NULL;
+        return g_hash_table_lookup(device->links_by_id, GUINT_TO_POINTER(id));
 }
 
 const struct media_v2_link *
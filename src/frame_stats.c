@@ -0,0 +1,184 @@
+#include "frame_stats.h"
+
+#include <glib.h>
+#include <string.h>
+
+// Roughly 20000 cells are enough for metering, independent of the mode
+#define GRID_WIDTH 160
+#define GRID_HEIGHT 120
+
+// The focus region is a fifth of the frame in both directions, limited to
+// keep the cost down on large modes
+#define FOCUS_REGION_FRACTION 5
+#define FOCUS_REGION_MAX 128
+
+bool
+mp_frame_stats_compute(MPFrameStats *stats,
+                       const uint8_t *image,
+                       MPPixelFormat pixel_format,
+                       uint32_t width,
+                       uint32_t height)
+{
+        const char *pattern = mp_pixel_format_cfa_pattern(pixel_format);
+        if (!pattern) {
+                return false;
+        }
+
+        memset(stats, 0, sizeof(MPFrameStats));
+
+        size_t stride = mp_pixel_format_width_to_bytes(pixel_format, width) +
+                        mp_pixel_format_width_to_padding(pixel_format, width);
+        bool is_packed = mp_pixel_format_bits_per_pixel(pixel_format) == 10;
+
+        uint32_t cells_width = width / 2;
+        uint32_t cells_height = height / 2;
+        uint32_t step_x = cells_width > GRID_WIDTH ? cells_width / GRID_WIDTH : 1;
+        uint32_t step_y =
+                cells_height > GRID_HEIGHT ? cells_height / GRID_HEIGHT : 1;
+
+        // Offsets of the four samples within a cell
+        const size_t offsets[4] = { 0, 1, stride, stride + 1 };
+
+        uint64_t sums[3] = { 0, 0, 0 };
+        uint64_t luminance_sum = 0;
+        for (uint32_t y = 0; y < cells_height; y += step_y) {
+                const uint8_t *row = image + (size_t)y * 2 * stride;
+
+                for (uint32_t x = 0; x < cells_width; x += step_x) {
+                        // Only the most significant byte of packed pixels is
+                        // used, skip the byte with the low bits
+                        uint32_t pixel = x * 2;
+                        const uint8_t *cell =
+                                row + (is_packed ? pixel + pixel / 4 : pixel);
+
+                        uint32_t colors[3] = { 0, 0, 0 };
+                        for (int i = 0; i < 4; ++i) {
+                                colors[(int)pattern[i]] += cell[offsets[i]];
+                        }
+
+                        // Two green samples per cell
+                        uint32_t luminance = (colors[0] + colors[1] + colors[2]) / 4;
+
+                        ++stats->histogram[luminance];
+                        ++stats->num_cells;
+                        luminance_sum += luminance;
+                        sums[0] += colors[0];
+                        sums[1] += colors[1];
+                        sums[2] += colors[2];
+                }
+        }
+
+        if (stats->num_cells == 0) {
+                return false;
+        }
+
+        float count = stats->num_cells * 255.0f;
+        stats->mean_red = sums[0] / count;
+        stats->mean_green = sums[1] / count / 2.0f;
+        stats->mean_blue = sums[2] / count;
+        stats->mean_luminance = luminance_sum / count;
+
+        return true;
+}
+
+// Luminance below which the given fraction of the cells are, from 0 to 1
+float
+mp_frame_stats_get_percentile(const MPFrameStats *stats, float fraction)
+{
+        uint32_t target = fraction * stats->num_cells;
+        uint32_t count = 0;
+        for (int i = 0; i < MP_FRAME_STATS_BINS; ++i) {
+                count += stats->histogram[i];
+                if (count > target) {
+                        return i / (float)(MP_FRAME_STATS_BINS - 1);
+                }
+        }
+
+        return 1.0f;
+}
+
+// Tenengrad focus measure of the region centered on x and y, which are a
+// fraction of the frame size. Normalized by the brightness so changes of the
+// exposure while focussing don't show up as changes in sharpness.
+float
+mp_frame_stats_compute_sharpness(const uint8_t *image,
+                                 MPPixelFormat pixel_format,
+                                 uint32_t width,
+                                 uint32_t height,
+                                 float x,
+                                 float y)
+{
+        bool is_yuv = mp_pixel_format_is_yuv(pixel_format);
+        if (!mp_pixel_format_cfa_pattern(pixel_format) && !is_yuv) {
+                return 0.0f;
+        }
+
+        size_t stride = mp_pixel_format_width_to_bytes(pixel_format, width) +
+                        mp_pixel_format_width_to_padding(pixel_format, width);
+        bool is_packed = mp_pixel_format_bits_per_pixel(pixel_format) == 10;
+
+        // Luma of YUV pixel pairs is every other byte
+        size_t luma_offset = pixel_format == MP_PIXEL_FMT_UYVY ? 1 : 0;
+        size_t next_sample = is_yuv ? 2 : 1;
+
+        // Work on the luminance of the CFA cells, so the color filters don't
+        // show up as edges. YUV uses cells of the same size.
+        int cells_width = width / 2;
+        int cells_height = height / 2;
+        int region_width =
+                MIN(cells_width / FOCUS_REGION_FRACTION, FOCUS_REGION_MAX);
+        int region_height =
+                MIN(cells_height / FOCUS_REGION_FRACTION, FOCUS_REGION_MAX);
+        if (region_width < 3 || region_height < 3) {
+                return 0.0f;
+        }
+
+        int left = CLAMP((int)(x * cells_width) - region_width / 2,
+                         0,
+                         cells_width - region_width);
+        int top = CLAMP((int)(y * cells_height) - region_height / 2,
+                        0,
+                        cells_height - region_height);
+
+        uint16_t cells[FOCUS_REGION_MAX * FOCUS_REGION_MAX];
+        uint32_t luminance_sum = 0;
+        for (int cy = 0; cy < region_height; ++cy) {
+                const uint8_t *row = image + (size_t)(top + cy) * 2 * stride;
+
+                for (int cx = 0; cx < region_width; ++cx) {
+                        uint32_t pixel = (left + cx) * 2;
+                        const uint8_t *cell;
+                        if (is_yuv) {
+                                cell = row + pixel * 2 + luma_offset;
+                        } else {
+                                cell = row + (is_packed ? pixel + pixel / 4 : pixel);
+                        }
+
+                        uint16_t value = cell[0] + cell[next_sample] +
+                                         cell[stride] +
+                                         cell[stride + next_sample];
+                        cells[cy * region_width + cx] = value;
+                        luminance_sum += value;
+                }
+        }
+
+        // Sum of the squared Sobel gradients
+        uint64_t gradient_sum = 0;
+        for (int cy = 1; cy < region_height - 1; ++cy) {
+                const uint16_t *above = &cells[(cy - 1) * region_width];
+                const uint16_t *row = above + region_width;
+                const uint16_t *below = row + region_width;
+
+                for (int cx = 1; cx < region_width - 1; ++cx) {
+                        int gx = (above[cx + 1] + 2 * row[cx + 1] + below[cx + 1]) -
+                                 (above[cx - 1] + 2 * row[cx - 1] + below[cx - 1]);
+                        int gy = (below[cx - 1] + 2 * below[cx] + below[cx + 1]) -
+                                 (above[cx - 1] + 2 * above[cx] + above[cx + 1]);
+                        gradient_sum += gx * gx + gy * gy;
+                }
+        }
+
+        float mean = luminance_sum / (float)(region_width * region_height);
+        float count = (region_width - 2) * (region_height - 2);
+        return gradient_sum / count / (mean * mean + 1.0f);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "mode.h"
+
+#include <stddef.h>
+
+#define MP_FRAME_STATS_BINS 256
+
+// Statistics of a raw frame, sampled from a grid of CFA cells
+typedef struct {
+        // Luminance of the sampled cells
+        uint32_t histogram[MP_FRAME_STATS_BINS];
+        uint32_t num_cells;
+
+        // Means of the raw color channels and the luminance, from 0 to 1
+        float mean_red;
+        float mean_green;
+        float mean_blue;
+        float mean_luminance;
+
+        // Focus measure of the focus region, only set while focussing
+        float sharpness;
+
+        // Index of the camera the frame came from
+        size_t camera_index;
+} MPFrameStats;
+
+bool mp_frame_stats_compute(MPFrameStats *stats,
+                            const uint8_t *image,
+                            MPPixelFormat pixel_format,
+                            uint32_t width,
+                            uint32_t height);
+
+float mp_frame_stats_get_percentile(const MPFrameStats *stats, float fraction);
+
+float mp_frame_stats_compute_sharpness(const uint8_t *image,
+                                       MPPixelFormat pixel_format,
+                                       uint32_t width,
+                                       uint32_t height,
+                                       float x,
+                                       float y);
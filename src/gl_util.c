@@ -4,9 +4,11 @@
 #include <gdk/gdk.h>
 #include <gio/gio.h>
 #include <gmodule.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 void
 gl_util_check_error(const char *file, int line)
@@ -159,6 +161,229 @@ gl_util_link_program(GLuint *shaders, size_t num_shaders)
         return program;
 }
 
+static bool
+has_program_binary_support()
+{
+        if (epoxy_is_desktop_gl()) {
+                if (epoxy_gl_version() < 41 &&
+                    !epoxy_has_gl_extension("GL_ARB_get_program_binary")) {
+                        return false;
+                }
+        } else if (epoxy_gl_version() < 30 &&
+                   !epoxy_has_gl_extension("GL_OES_get_program_binary")) {
+                return false;
+        }
+
+        // Some drivers expose the extension without supporting any format
+        GLint num_formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+        return num_formats > 0;
+}
+
+static void
+checksum_add_resource(GChecksum *checksum, const char *resource)
+{
+        GBytes *bytes = g_resources_lookup_data(resource, 0, NULL);
+        if (!bytes) {
+                return;
+        }
+
+        gsize size;
+        const guchar *data = g_bytes_get_data(bytes, &size);
+        g_checksum_update(checksum, data, size);
+
+        g_bytes_unref(bytes);
+}
+
+// The driver, the shader sources and the defines all end up in the binary, so
+// they all need to be part of the cache key
+static char *
+get_program_cache_path(const char *vertex_resource,
+                       const char *fragment_resource,
+                       const char **extra_sources,
+                       size_t num_extra)
+{
+        GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+
+        const char *strings[] = {
+                (const char *)glGetString(GL_VENDOR),
+                (const char *)glGetString(GL_RENDERER),
+                (const char *)glGetString(GL_VERSION),
+        };
+        for (size_t i = 0; i < 3; ++i) {
+                if (strings[i]) {
+                        g_checksum_update(
+                                checksum, (const guchar *)strings[i], -1);
+                }
+                g_checksum_update(checksum, (const guchar *)"\n", 1);
+        }
+
+        for (size_t i = 0; i < num_extra; ++i) {
+                g_checksum_update(checksum, (const guchar *)extra_sources[i], -1);
+        }
+
+        checksum_add_resource(checksum, vertex_resource);
+        checksum_add_resource(checksum, fragment_resource);
+
+        char *name = g_strconcat(g_checksum_get_string(checksum), ".bin", NULL);
+        char *path = g_build_filename(
+                g_get_user_cache_dir(), "megapixels", "shaders", name, NULL);
+
+        g_free(name);
+        g_checksum_free(checksum);
+
+        return path;
+}
+
+// Cache files are the binary format followed by the program binary
+static bool
+load_program_binary(GLuint program, const char *path)
+{
+        gchar *contents;
+        gsize length;
+        if (!g_file_get_contents(path, &contents, &length, NULL)) {
+                return false;
+        }
+
+        bool success = false;
+        if (length > sizeof(uint32_t)) {
+                uint32_t format;
+                memcpy(&format, contents, sizeof(uint32_t));
+
+                glProgramBinary(program,
+                                format,
+                                contents + sizeof(uint32_t),
+                                length - sizeof(uint32_t));
+
+                // Fails when the driver doesn't accept the binary anymore
+                GLint status;
+                glGetProgramiv(program, GL_LINK_STATUS, &status);
+                success = status == GL_TRUE;
+        }
+
+        // Don't leave an error behind for the next check_gl()
+        while (glGetError() != GL_NO_ERROR)
+                ;
+
+        g_free(contents);
+
+        return success;
+}
+
+static void
+store_program_binary(GLuint program, const char *path)
+{
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0) {
+                return;
+        }
+
+        char *contents = g_malloc(sizeof(uint32_t) + length);
+
+        GLenum format;
+        glGetProgramBinary(
+                program, length, &length, &format, contents + sizeof(uint32_t));
+        check_gl();
+
+        uint32_t stored_format = format;
+        memcpy(contents, &stored_format, sizeof(uint32_t));
+
+        char *dir = g_path_get_dirname(path);
+        g_mkdir_with_parents(dir, 0755);
+        g_free(dir);
+
+        GError *error = NULL;
+        if (!g_file_set_contents(
+                    path, contents, sizeof(uint32_t) + length, &error)) {
+                printf("Failed to store program binary: %s\n", error->message);
+                g_clear_error(&error);
+        }
+
+        g_free(contents);
+}
+
+GLuint
+gl_util_load_program(const char *vertex_resource,
+                     const char *fragment_resource,
+                     const char **extra_sources,
+                     size_t num_extra)
+{
+        char *cache_path = NULL;
+        if (has_program_binary_support()) {
+                cache_path = get_program_cache_path(vertex_resource,
+                                                    fragment_resource,
+                                                    extra_sources,
+                                                    num_extra);
+
+                GLuint program = glCreateProgram();
+                if (load_program_binary(program, cache_path)) {
+                        g_free(cache_path);
+                        return program;
+                }
+                glDeleteProgram(program);
+        }
+
+        GLuint shaders[] = {
+                gl_util_load_shader(vertex_resource,
+                                    GL_VERTEX_SHADER,
+                                    extra_sources,
+                                    num_extra),
+                gl_util_load_shader(fragment_resource,
+                                    GL_FRAGMENT_SHADER,
+                                    extra_sources,
+                                    num_extra),
+        };
+
+        GLuint program = glCreateProgram();
+        for (size_t i = 0; i < 2; ++i) {
+                glAttachShader(program, shaders[i]);
+        }
+
+        // Attribute locations only take effect when linking
+        glBindAttribLocation(program, GL_UTIL_VERTEX_ATTRIBUTE, "vert");
+        glBindAttribLocation(program, GL_UTIL_TEX_COORD_ATTRIBUTE, "tex_coord");
+        check_gl();
+
+        // GL_OES_get_program_binary has no retrievable hint
+        if (cache_path && (epoxy_is_desktop_gl() || epoxy_gl_version() >= 30)) {
+                glProgramParameteri(
+                        program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+                check_gl();
+        }
+
+        glLinkProgram(program);
+        check_gl();
+
+        for (size_t i = 0; i < 2; ++i) {
+                glDetachShader(program, shaders[i]);
+                glDeleteShader(shaders[i]);
+        }
+
+        GLint success;
+        glGetProgramiv(program, GL_LINK_STATUS, &success);
+        if (success == GL_FALSE) {
+                printf("Program linking failed for %s\n", fragment_resource);
+        } else if (cache_path) {
+                store_program_binary(program, cache_path);
+        }
+
+        GLint log_length;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &log_length);
+        if (log_length > 0) {
+                char *log = malloc(sizeof(char) * log_length);
+                glGetProgramInfoLog(program, log_length - 1, &log_length, log);
+
+                printf("Program log: %s\n", log);
+                free(log);
+        }
+        check_gl();
+
+        g_free(cache_path);
+
+        return program;
+}
+
 static const GLfloat quad_data[] = {
         // Vertices
         -1,
@@ -15,6 +15,14 @@ GLuint gl_util_load_shader(const char *resource,
                            size_t num_extra);
 GLuint gl_util_link_program(GLuint *shaders, size_t num_shaders);
 
+// Compile and link a program, or load it from the program binary cache when
+// it was built before with the same sources on the same driver. The extra
+// sources are prepended to both shaders.
+GLuint gl_util_load_program(const char *vertex_resource,
+                            const char *fragment_resource,
+                            const char **extra_sources,
+                            size_t num_extra);
+
 GLuint gl_util_new_quad();
 void gl_util_bind_quad(GLuint buffer);
 void gl_util_draw_quad(GLuint buffer);
@@ -4,31 +4,33 @@
 #include "gl_util.h"
 #include <stdlib.h>
 
-#define VERTEX_ATTRIBUTE 0
-#define TEX_COORD_ATTRIBUTE 1
-
 struct _GLES2Debayer {
         MPPixelFormat format;
+        MPDemosaic demosaic;
 
         GLuint frame_buffer;
         GLuint program;
         GLuint uniform_transform;
         GLuint uniform_pixel_size;
+        GLuint uniform_sample_offset;
         GLuint uniform_padding_ratio;
         GLuint uniform_texture;
         GLuint uniform_color_matrix;
         GLuint uniform_row_length;
+        GLuint uniform_black_level;
+        GLuint uniform_white_level;
 
         GLuint quad;
 };
 
 GLES2Debayer *
-gles2_debayer_new(MPPixelFormat format)
+gles2_debayer_new(MPPixelFormat format, MPDemosaic demosaic)
 {
         if (format != MP_PIXEL_FMT_BGGR8 && format != MP_PIXEL_FMT_GBRG8 &&
             format != MP_PIXEL_FMT_GRBG8 && format != MP_PIXEL_FMT_RGGB8 &&
             format != MP_PIXEL_FMT_BGGR10P && format != MP_PIXEL_FMT_GBRG10P &&
-            format != MP_PIXEL_FMT_GRBG10P && format != MP_PIXEL_FMT_RGGB10P) {
+            format != MP_PIXEL_FMT_GRBG10P && format != MP_PIXEL_FMT_RGGB10P &&
+            !mp_pixel_format_is_yuv(format)) {
                 return NULL;
         }
 
@@ -36,39 +38,59 @@ gles2_debayer_new(MPPixelFormat format)
         glGenFramebuffers(1, &frame_buffer);
         check_gl();
 
-        char format_def[64];
-        snprintf(format_def,
-                 64,
-                 "#define CFA_%s\n#define BITS_%d\n",
-                 mp_pixel_format_cfa(format),
-                 mp_pixel_format_bits_per_pixel(format));
+        char format_def[96];
+        if (mp_pixel_format_is_yuv(format)) {
+                snprintf(format_def,
+                         96,
+                         "#define YUV_%s\n",
+                         mp_pixel_format_to_str(format));
+        } else {
+                snprintf(format_def,
+                         96,
+                         "#define CFA_%s\n#define BITS_%d\n%s",
+                         mp_pixel_format_cfa(format),
+                         mp_pixel_format_bits_per_pixel(format),
+                         demosaic == MP_DEMOSAIC_BILINEAR ?
+                                 "#define DEMOSAIC_BILINEAR\n" :
+                                 "");
+        }
 
         const GLchar *def[1] = { format_def };
 
-        GLuint shaders[] = {
-                gl_util_load_shader("/org/postmarketos/Megapixels/debayer.vert",
-                                    GL_VERTEX_SHADER,
-                                    NULL,
-                                    0),
-                gl_util_load_shader("/org/postmarketos/Megapixels/debayer.frag",
-                                    GL_FRAGMENT_SHADER,
-                                    def,
-                                    1),
-        };
-
-        GLuint program = gl_util_link_program(shaders, 2);
-        glBindAttribLocation(program, VERTEX_ATTRIBUTE, "vert");
-        glBindAttribLocation(program, TEX_COORD_ATTRIBUTE, "tex_coord");
+        GLuint program;
+        if (mp_pixel_format_is_yuv(format)) {
+                // There are no colors to reconstruct, the demosaic is ignored
+                program = gl_util_load_program(
+                        "/org/postmarketos/Megapixels/yuv.vert",
+                        "/org/postmarketos/Megapixels/yuv.frag",
+                        def,
+                        1);
+        } else if (demosaic == MP_DEMOSAIC_FAST) {
+                program = gl_util_load_program(
+                        "/org/postmarketos/Megapixels/debayer.vert",
+                        "/org/postmarketos/Megapixels/debayer.frag",
+                        def,
+                        1);
+        } else {
+                program = gl_util_load_program(
+                        "/org/postmarketos/Megapixels/debayer_hq.vert",
+                        "/org/postmarketos/Megapixels/debayer_hq.frag",
+                        def,
+                        1);
+        }
         check_gl();
 
         GLES2Debayer *self = malloc(sizeof(GLES2Debayer));
         self->format = format;
+        self->demosaic = demosaic;
 
         self->frame_buffer = frame_buffer;
         self->program = program;
 
         self->uniform_transform = glGetUniformLocation(self->program, "transform");
         self->uniform_pixel_size = glGetUniformLocation(self->program, "pixel_size");
+        self->uniform_sample_offset =
+                glGetUniformLocation(self->program, "sample_offset");
         self->uniform_padding_ratio =
                 glGetUniformLocation(self->program, "padding_ratio");
         self->uniform_texture = glGetUniformLocation(self->program, "texture");
@@ -77,6 +99,11 @@ gles2_debayer_new(MPPixelFormat format)
         if (mp_pixel_format_bits_per_pixel(self->format) == 10)
                 self->uniform_row_length =
                         glGetUniformLocation(self->program, "row_length");
+        // Only used by the full resolution demosaic
+        self->uniform_black_level =
+                glGetUniformLocation(self->program, "black_level");
+        self->uniform_white_level =
+                glGetUniformLocation(self->program, "white_level");
         check_gl();
 
         self->quad = gl_util_new_quad();
@@ -112,7 +139,8 @@ gles2_debayer_configure(GLES2Debayer *self,
                         const uint32_t rotation,
                         const bool mirrored,
                         const float *colormatrix,
-                        const uint8_t blacklevel)
+                        const int blacklevel,
+                        const int whitelevel)
 {
         glViewport(0, 0, dst_width, dst_height);
         check_gl();
@@ -138,6 +166,23 @@ gles2_debayer_configure(GLES2Debayer *self,
         glUniform2f(self->uniform_pixel_size, pixel_size_x, pixel_size_y);
         check_gl();
 
+        // When the output is smaller than the demosaic produces natively, only
+        // the first CFA cell (or pixel for the full resolution paths) of each
+        // block is used. Move the samples from the center of the block there.
+        uint32_t dst_unrotated_width =
+                (rotation == 90 || rotation == 270) ? dst_height : dst_width;
+        GLfloat half_block;
+        if (self->demosaic == MP_DEMOSAIC_FAST &&
+            !mp_pixel_format_is_yuv(self->format)) {
+                half_block = MAX(1, src_width / 2 / dst_unrotated_width);
+        } else {
+                half_block = MAX(1, src_width / dst_unrotated_width) / 2.0f;
+        }
+        glUniform2f(self->uniform_sample_offset,
+                    (0.5f - half_block) * pixel_size_x,
+                    (0.5f - half_block) * pixel_size_y);
+        check_gl();
+
         if (colormatrix) {
                 GLfloat transposed[9];
                 for (int i = 0; i < 3; ++i)
@@ -170,6 +215,13 @@ gles2_debayer_configure(GLES2Debayer *self,
                 mp_pixel_format_width_to_padding(self->format, src_width);
         GLfloat padding_ratio = (float)row_length / (row_length + padding_bytes);
         glUniform1f(self->uniform_padding_ratio, padding_ratio);
+
+        // Levels are given in the sensor's bit depth
+        float max_level = (1 << mp_pixel_format_pixel_depth(self->format)) - 1;
+        glUniform1f(self->uniform_black_level, blacklevel / max_level);
+        glUniform1f(self->uniform_white_level,
+                    (whitelevel ? whitelevel : max_level) / max_level);
+        check_gl();
 }
 
 void
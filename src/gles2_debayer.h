@@ -5,7 +5,7 @@
 
 typedef struct _GLES2Debayer GLES2Debayer;
 
-GLES2Debayer *gles2_debayer_new(MPPixelFormat format);
+GLES2Debayer *gles2_debayer_new(MPPixelFormat format, MPDemosaic demosaic);
 void gles2_debayer_free(GLES2Debayer *self);
 
 void gles2_debayer_use(GLES2Debayer *self);
@@ -18,6 +18,7 @@ void gles2_debayer_configure(GLES2Debayer *self,
                              const uint32_t rotation,
                              const bool mirrored,
                              const float *colormatrix,
-                             const uint8_t blacklevel);
+                             const int blacklevel,
+                             const int whitelevel);
 
 void gles2_debayer_process(GLES2Debayer *self, GLuint dst_id, GLuint source_id);
@@ -1,13 +1,17 @@
 #include "io_pipeline.h"
 
+#include "auto_exposure.h"
+#include "auto_focus.h"
 #include "camera.h"
 #include "device.h"
 #include "flash.h"
 #include "pipeline.h"
 #include "process_pipeline.h"
+#include "startup_trace.h"
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <gio/gio.h>
 #include <glib.h>
 #include <math.h>
 #include <stdio.h>
@@ -33,12 +37,36 @@ struct camera_info {
 
         MPFlash *flash;
 
+        // The configured preview mode, or the one picked for preview-fmt=auto
+        MPMode preview_mode;
+
         int gain_ctrl;
         int gain_max;
 
+        // Values read back from the sensor. Kept up to date by control events
+        // when the sensor sends them. Volatile controls, and all of them
+        // when there are no events, are read again for every frame.
+        MPControlSnapshot controls;
+        MPControlSnapshot volatile_controls;
+        bool has_control_events;
+
+        // Exposure and gain are controlled from the frame statistics instead
+        // of by the sensor
+        bool has_software_ae;
+        MPAutoExposure auto_exposure;
+
         bool has_auto_focus_continuous;
         bool has_auto_focus_start;
 
+        // Focus is found from the sharpness of the frames, for lenses that
+        // can only be positioned
+        bool has_software_af;
+        MPAutoFocus auto_focus;
+
+        // Set once the sensor is set up, cameras other than the default one
+        // are initialized on camera_init_pool
+        bool is_initialized;
+
         // unsigned int entity_id;
         // enum v4l2_buf_type type;
 
@@ -63,6 +91,14 @@ struct device_info {
         int video_fd;
 };
 
+// Frames between changing the exposure and seeing it in the statistics
+#define AE_LATENCY 3
+// Same for moving the lens, which also needs some time to settle
+#define AF_LATENCY 3
+// Frames the exposure gets to adapt before a timelapse shot, the sensor has
+// been off since the previous one
+#define TIMELAPSE_SETTLE_FRAMES (2 * AE_LATENCY)
+
 static struct camera_info cameras[MP_MAX_CAMERAS];
 
 static struct device_info devices[MP_MAX_CAMERAS];
@@ -82,6 +118,8 @@ static int preview_height;
 
 static int device_rotation;
 
+static MPDemosaic demosaic;
+
 struct control_state {
         bool gain_is_manual;
         int gain;
@@ -96,9 +134,36 @@ static struct control_state current_controls = {};
 static bool flash_enabled = false;
 
 static bool want_focus = false;
+// Center of the region to focus on, as a fraction of the sensor image
+static float focus_x = 0.5f;
+static float focus_y = 0.5f;
+
+// Statistics of the most recently processed frame
+static MPFrameStats frame_stats;
+static bool has_frame_stats = false;
 
 static MPPipeline *pipeline;
 static GSource *capture_source;
+static GSource *event_source;
+
+// Interval mode, the stream is stopped between the shots
+static GSource *timelapse_source = NULL;
+static gint64 timelapse_start;
+static gint64 timelapse_active_time;
+static int timelapse_shots;
+// Set while a shot is taken
+static gint64 shot_start = 0;
+static int settle_frames_remaining = 0;
+
+static size_t num_cameras = 0;
+static bool preload_cameras = false;
+
+static gint64 switch_start = 0;
+static bool switch_preloaded = false;
+
+static GThreadPool *camera_init_pool = NULL;
+static GMutex camera_init_mutex;
+static GCond camera_init_cond;
 
 static void
 mp_setup_media_link_pad_formats(struct device_info *dev_info,
@@ -128,15 +193,17 @@ mp_setup_media_link_pad_formats(struct device_info *dev_info,
 }
 
 static void
-setup_camera(MPDeviceList **device_list, const struct mp_camera_config *config)
+setup_camera_device(MPDeviceList **device_list,
+                    const struct mp_camera_config *config)
 {
-        // Find device info
+        // Find device info, cameras on the same media device share it since
+        // the device list only holds one instance of every media device
         size_t device_index = 0;
         for (; device_index < num_devices; ++device_index) {
                 if ((strcmp(config->media_dev_name,
                             devices[device_index].media_dev_name) == 0) &&
-                    (strcmp(config->dev_name, devices[device_index].dev_name) ==
-                     0)) {
+                    mp_device_find_entity(devices[device_index].device,
+                                          config->dev_name)) {
                         break;
                 }
         }
@@ -186,115 +253,389 @@ setup_camera(MPDeviceList **device_list, const struct mp_camera_config *config)
                 ++num_devices;
         }
 
-        {
-                struct camera_info *info = &cameras[config->index];
-                struct device_info *dev_info = &devices[device_index];
+        struct camera_info *info = &cameras[config->index];
+        struct device_info *dev_info = &devices[device_index];
 
-                info->device_index = device_index;
+        info->device_index = device_index;
 
-                const struct media_v2_entity *entity =
-                        mp_device_find_entity(dev_info->device, config->dev_name);
-                if (!entity) {
-                        g_printerr("Could not find camera entity matching '%s'\n",
-                                   config->dev_name);
-                        exit(EXIT_FAILURE);
-                }
+        const struct media_v2_entity *entity =
+                mp_device_find_entity(dev_info->device, config->dev_name);
+        if (!entity) {
+                g_printerr("Could not find camera entity matching '%s'\n",
+                           config->dev_name);
+                exit(EXIT_FAILURE);
+        }
 
-                const struct media_v2_pad *pad =
-                        mp_device_get_pad_from_entity(dev_info->device, entity->id);
+        const struct media_v2_pad *pad =
+                mp_device_get_pad_from_entity(dev_info->device, entity->id);
 
-                info->pad_id = pad->id;
+        info->pad_id = pad->id;
 
-                // Make sure the camera starts out as disabled
-                mp_device_setup_link(dev_info->device,
-                                     info->pad_id,
-                                     dev_info->interface_pad_id,
-                                     false);
+        // Make sure the camera starts out as disabled
+        mp_device_setup_link(
+                dev_info->device, info->pad_id, dev_info->interface_pad_id, false);
 
-                const struct media_v2_interface *interface =
-                        mp_device_find_entity_interface(dev_info->device,
-                                                        entity->id);
+        const struct media_v2_interface *interface =
+                mp_device_find_entity_interface(dev_info->device, entity->id);
 
-                if (!mp_find_device_path(interface->devnode, info->dev_fname, 260)) {
-                        g_printerr("Could not find camera device path\n");
-                        exit(EXIT_FAILURE);
+        if (!mp_find_device_path(interface->devnode, info->dev_fname, 260)) {
+                g_printerr("Could not find camera device path\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+static bool
+can_preload(const struct camera_info *info)
+{
+        if (!preload_cameras) {
+                return false;
+        }
+
+        // Only cameras with a video device of their own can keep buffers
+        // allocated while another camera is streaming
+        for (size_t i = 0; i < num_cameras; ++i) {
+                if (&cameras[i] != info &&
+                    cameras[i].device_index == info->device_index) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+// Use the mode with the fewest bytes per frame that still has the configured
+// preview size and rate, usually an 8-bit format over a 10-bit one
+static void
+pick_preview_mode(struct camera_info *info,
+                  const struct mp_camera_config *config)
+{
+        const MPMode *wanted = &config->preview_mode;
+        uint64_t best_cost = UINT64_MAX;
+
+        MPModeList *modes = mp_camera_list_supported_modes(info->camera);
+        for (MPModeList *list = modes; list; list = mp_camera_mode_list_next(list)) {
+                const MPMode *m = mp_camera_mode_list_get(list);
+
+                // Only raw, YUV and MJPEG formats can be previewed
+                if ((!mp_pixel_format_cfa_pattern(m->pixel_format) &&
+                     !mp_pixel_format_is_yuv(m->pixel_format) &&
+                     m->pixel_format != MP_PIXEL_FMT_MJPEG) ||
+                    m->width < wanted->width || m->height < wanted->height) {
+                        continue;
                 }
 
-                info->fd = open(info->dev_fname, O_RDWR);
-                if (info->fd == -1) {
-                        g_printerr("Could not open %s: %s\n",
-                                   info->dev_fname,
-                                   strerror(errno));
-                        exit(EXIT_FAILURE);
+                // Compare the frame intervals without dividing
+                if ((uint64_t)m->frame_interval.numerator *
+                            wanted->frame_interval.denominator >
+                    (uint64_t)wanted->frame_interval.numerator *
+                            m->frame_interval.denominator) {
+                        continue;
+                }
+
+                // Decoding MJPEG costs more than copying any raw frame, so
+                // it's only used when nothing else reaches the size or rate
+                uint64_t cost;
+                if (m->pixel_format == MP_PIXEL_FMT_MJPEG) {
+                        cost = (uint64_t)m->width * m->height * 4;
+                } else {
+                        cost = (uint64_t)mp_pixel_format_width_to_bytes(
+                                       m->pixel_format, m->width) *
+                               m->height;
+                }
+                if (cost < best_cost) {
+                        info->preview_mode = *m;
+                        best_cost = cost;
                 }
+        }
+        mp_camera_mode_list_free(modes);
+
+        if (best_cost == UINT64_MAX) {
+                g_printerr("No preview mode for %s, using the capture format\n",
+                           config->cfg_name);
+                info->preview_mode.pixel_format =
+                        config->capture_mode.pixel_format;
+                return;
+        }
+
+        printf("Picked %dx%d %s for the preview of %s\n",
+               info->preview_mode.width,
+               info->preview_mode.height,
+               mp_pixel_format_to_str(info->preview_mode.pixel_format),
+               config->cfg_name);
+}
 
-                info->camera = mp_camera_new(dev_info->video_fd, info->fd);
+static void
+setup_camera_sensor(const struct mp_camera_config *config, bool is_default)
+{
+        struct camera_info *info = &cameras[config->index];
+        struct device_info *dev_info = &devices[info->device_index];
+
+        info->fd = open(info->dev_fname, O_RDWR);
+        if (info->fd == -1) {
+                g_printerr("Could not open %s: %s\n",
+                           info->dev_fname,
+                           strerror(errno));
+                exit(EXIT_FAILURE);
+        }
 
-                // Start with the capture format, this works around a bug with
-                // the ov5640 driver where it won't allow setting the preview
-                // format initially.
-                MPMode mode = config->capture_mode;
+        info->camera = mp_camera_new(dev_info->video_fd, info->fd);
+
+        info->preview_mode = config->preview_mode;
+        if (info->preview_mode.pixel_format == MP_PIXEL_FMT_UNSUPPORTED) {
+                pick_preview_mode(info, config);
+        }
+
+        // Start with the capture format, this works around a bug with
+        // the ov5640 driver where it won't allow setting the preview
+        // format initially.
+        MPMode mode = config->capture_mode;
+        if (is_default || can_preload(info)) {
                 if (config->num_media_links)
                         mp_setup_media_link_pad_formats(dev_info,
                                                         config->media_links,
                                                         config->num_media_links,
                                                         &mode);
                 mp_camera_set_mode(info->camera, &mode);
+        } else if (mp_camera_is_subdev(info->camera)) {
+                // The video device and media links might be in use by the
+                // default camera already, they get set up when switching to
+                // this camera.
+                mp_camera_set_subdev_mode(info->camera, &mode);
+        }
 
-                // Trigger continuous auto focus if the sensor supports it
-                if (mp_camera_query_control(
-                            info->camera, V4L2_CID_FOCUS_AUTO, NULL)) {
-                        info->has_auto_focus_continuous = true;
+        // Trigger continuous auto focus if the sensor supports it
+        if (mp_camera_query_control(info->camera, V4L2_CID_FOCUS_AUTO, NULL)) {
+                info->has_auto_focus_continuous = true;
+                if (is_default) {
                         mp_camera_control_set_bool_bg(
                                 info->camera, V4L2_CID_FOCUS_AUTO, true);
+                } else {
+                        mp_camera_control_set_bool(
+                                info->camera, V4L2_CID_FOCUS_AUTO, true);
+                }
+        }
+        if (mp_camera_query_control(info->camera, V4L2_CID_AUTO_FOCUS_START, NULL)) {
+                info->has_auto_focus_start = true;
+        }
+
+        MPControl control;
+        if (!info->has_auto_focus_continuous && !info->has_auto_focus_start &&
+            mp_camera_query_control(
+                    info->camera, V4L2_CID_FOCUS_ABSOLUTE, &control)) {
+                info->has_software_af = true;
+                mp_auto_focus_init(&info->auto_focus,
+                                   control.min,
+                                   control.max,
+                                   control.step,
+                                   AF_LATENCY);
+        }
+
+        int gain_min = 0;
+        int gain_unity = 0;
+        if (mp_camera_query_control(info->camera, V4L2_CID_GAIN, &control)) {
+                info->gain_ctrl = V4L2_CID_GAIN;
+                info->gain_max = control.max;
+                gain_min = control.min;
+                gain_unity = control.default_value;
+        } else if (mp_camera_query_control(
+                           info->camera, V4L2_CID_ANALOGUE_GAIN, &control)) {
+                info->gain_ctrl = V4L2_CID_ANALOGUE_GAIN;
+                info->gain_max = control.max;
+                gain_min = control.min;
+                gain_unity = control.default_value;
+        }
+
+        // Run our own exposure loop if the sensor doesn't have one
+        if (mp_camera_query_control(info->camera, V4L2_CID_EXPOSURE, &control) &&
+            (config->software_ae ||
+             !mp_camera_query_control(
+                     info->camera, V4L2_CID_EXPOSURE_AUTO, NULL))) {
+                info->has_software_ae = true;
+                mp_auto_exposure_init(&info->auto_exposure,
+                                      control.min,
+                                      control.max,
+                                      gain_min,
+                                      info->gain_max,
+                                      gain_unity,
+                                      AE_LATENCY);
+
+                // The auto modes of the sensor would fight our loop
+                if (mp_camera_query_control(
+                            info->camera, V4L2_CID_EXPOSURE_AUTO, NULL)) {
+                        mp_camera_control_set_int32(info->camera,
+                                                    V4L2_CID_EXPOSURE_AUTO,
+                                                    V4L2_EXPOSURE_MANUAL);
                 }
                 if (mp_camera_query_control(
-                            info->camera, V4L2_CID_AUTO_FOCUS_START, NULL)) {
-                        info->has_auto_focus_start = true;
+                            info->camera, V4L2_CID_AUTOGAIN, NULL)) {
+                        mp_camera_control_set_bool(
+                                info->camera, V4L2_CID_AUTOGAIN, false);
                 }
 
-                MPControl control;
-                if (mp_camera_query_control(info->camera, V4L2_CID_GAIN, &control)) {
-                        info->gain_ctrl = V4L2_CID_GAIN;
-                        info->gain_max = control.max;
-                } else if (mp_camera_query_control(
-                                   info->camera, V4L2_CID_ANALOGUE_GAIN, &control)) {
-                        info->gain_ctrl = V4L2_CID_ANALOGUE_GAIN;
-                        info->gain_max = control.max;
+                // Continue from what the sensor is set to
+                int gain = gain_unity;
+                if (info->gain_ctrl) {
+                        gain = mp_camera_control_get_int32(info->camera,
+                                                           info->gain_ctrl);
                 }
+                mp_auto_exposure_reset(
+                        &info->auto_exposure,
+                        mp_camera_control_get_int32(info->camera,
+                                                    V4L2_CID_EXPOSURE),
+                        gain);
+        }
 
-                // Setup flash
-                if (config->flash_path[0]) {
-                        info->flash = mp_led_flash_from_path(config->flash_path);
-                } else if (config->flash_display) {
-                        info->flash = mp_create_display_flash();
+        // Everything that is read back from the sensor
+        const uint32_t snapshot_ids[] = {
+                info->gain_ctrl,
+                V4L2_CID_EXPOSURE,
+                V4L2_CID_AUTOGAIN,
+                V4L2_CID_EXPOSURE_AUTO,
+                V4L2_CID_FOCUS_ABSOLUTE,
+        };
+
+        // Volatile controls, like the gain and exposure of a sensor running
+        // its own AE, change without sending an event
+        uint32_t event_ids[G_N_ELEMENTS(snapshot_ids)];
+        uint32_t volatile_ids[G_N_ELEMENTS(snapshot_ids)];
+        size_t num_event_ids = 0;
+        size_t num_volatile_ids = 0;
+        for (size_t i = 0; i < G_N_ELEMENTS(snapshot_ids); ++i) {
+                if (mp_camera_query_control(
+                            info->camera, snapshot_ids[i], &control) &&
+                    (control.flags & V4L2_CTRL_FLAG_VOLATILE)) {
+                        volatile_ids[num_volatile_ids++] = snapshot_ids[i];
                 } else {
-                        info->flash = NULL;
+                        event_ids[num_event_ids++] = snapshot_ids[i];
                 }
         }
+
+        mp_camera_control_snapshot_init(
+                info->camera, &info->controls, event_ids, num_event_ids);
+        info->has_control_events =
+                info->controls.count > 0 &&
+                mp_camera_subscribe_control_events(
+                        info->camera, info->controls.ids, info->controls.count);
+        if (!info->has_control_events) {
+                for (size_t i = 0; i < info->controls.count; ++i) {
+                        volatile_ids[num_volatile_ids++] = info->controls.ids[i];
+                }
+                mp_camera_control_snapshot_init(
+                        info->camera, &info->controls, NULL, 0);
+        }
+        mp_camera_control_snapshot_init(info->camera,
+                                        &info->volatile_controls,
+                                        volatile_ids,
+                                        num_volatile_ids);
+
+        // Setup flash
+        if (config->flash_path[0]) {
+                info->flash = mp_led_flash_from_path(config->flash_path);
+        } else if (config->flash_display) {
+                info->flash = mp_create_display_flash();
+        } else {
+                info->flash = NULL;
+        }
+
+        // Get the preview stream ready so switching to it only has to enable
+        // the links and start streaming
+        if (!is_default && can_preload(info)) {
+                mode = info->preview_mode;
+                if (config->num_media_links)
+                        mp_setup_media_link_pad_formats(dev_info,
+                                                        config->media_links,
+                                                        config->num_media_links,
+                                                        &mode);
+                if (mp_camera_set_mode(info->camera, &mode)) {
+                        mp_camera_prepare_capture(info->camera);
+                }
+        }
+
+        mp_startup_trace("Camera %s initialized", config->cfg_name);
+
+        g_mutex_lock(&camera_init_mutex);
+        info->is_initialized = true;
+        g_cond_broadcast(&camera_init_cond);
+        g_mutex_unlock(&camera_init_mutex);
+}
+
+static void
+setup_camera_task(gpointer data, gpointer user_data)
+{
+        setup_camera_sensor(data, false);
+}
+
+static void
+wait_for_camera(struct camera_info *info)
+{
+        g_mutex_lock(&camera_init_mutex);
+        while (!info->is_initialized) {
+                g_cond_wait(&camera_init_cond, &camera_init_mutex);
+        }
+        g_mutex_unlock(&camera_init_mutex);
 }
 
 static void
 setup(MPPipeline *pipeline, const void *data)
 {
-        for (size_t i = 0; i < MP_MAX_CAMERAS; ++i) {
-                const struct mp_camera_config *config = mp_get_camera_config(i);
+        // Enumerate the media devices once, the cameras all pick their device
+        // out of the same list
+        MPDeviceList *device_list = mp_device_list_new();
+
+        GSettings *settings = g_settings_new("org.postmarketos.Megapixels");
+        preload_cameras = g_settings_get_boolean(settings, "preload-cameras");
+        g_object_unref(settings);
+
+        num_cameras = 0;
+        for (; num_cameras < MP_MAX_CAMERAS; ++num_cameras) {
+                const struct mp_camera_config *config =
+                        mp_get_camera_config(num_cameras);
                 if (!config) {
                         break;
                 }
 
-                MPDeviceList *device_list = mp_device_list_new();
-                setup_camera(&device_list, config);
-                mp_device_list_free(device_list);
+                setup_camera_device(&device_list, config);
+        }
+
+        mp_device_list_free(device_list);
+
+        mp_startup_trace("Media devices discovered");
+
+        if (num_cameras == 0) {
+                return;
+        }
+
+        // Bring up the default camera right away so the preview can start,
+        // the other sensors are initialized in the background and only waited
+        // for when switching to them.
+        setup_camera_sensor(mp_get_camera_config(0), true);
+
+        if (num_cameras > 1) {
+                camera_init_pool = g_thread_pool_new(
+                        setup_camera_task, NULL, num_cameras - 1, false, NULL);
+                for (size_t i = 1; i < num_cameras; ++i) {
+                        g_thread_pool_push(camera_init_pool,
+                                           (gpointer)mp_get_camera_config(i),
+                                           NULL);
+                }
         }
 }
 
 static void
 clean_cameras()
 {
+        if (camera_init_pool) {
+                g_thread_pool_free(camera_init_pool, false, true);
+                camera_init_pool = NULL;
+        }
+
         for (size_t i = 0; i < MP_MAX_CAMERAS; ++i) {
                 struct camera_info *info = &cameras[i];
                 if (info->camera) {
+                        // Also releases the buffers of preloaded cameras
+                        if (mp_camera_is_capturing(info->camera)) {
+                                mp_camera_stop_capture(info->camera);
+                        }
+
                         mp_camera_free(info->camera);
                         info->camera = NULL;
                 }
@@ -314,9 +655,15 @@ mp_io_pipeline_start()
 void
 mp_io_pipeline_stop()
 {
+        if (timelapse_source) {
+                g_source_destroy(timelapse_source);
+        }
         if (capture_source) {
                 g_source_destroy(capture_source);
         }
+        if (event_source) {
+                g_source_destroy(event_source);
+        }
 
         clean_cameras();
 
@@ -325,19 +672,54 @@ mp_io_pipeline_stop()
         mp_process_pipeline_stop();
 }
 
+static MPControlSnapshot *
+snapshot_for_control(struct camera_info *info, uint32_t id)
+{
+        for (size_t i = 0; i < info->volatile_controls.count; ++i) {
+                if (info->volatile_controls.ids[i] == id) {
+                        return &info->volatile_controls;
+                }
+        }
+        return &info->controls;
+}
+
+// Read from the snapshots, so all controls read during a frame take at most
+// one ioctl. Like mp_camera_control_get_int32 this is 0 for controls the
+// sensor lacks.
+static int32_t
+get_control(struct camera_info *info, uint32_t id)
+{
+        MPControlSnapshot *snapshot = snapshot_for_control(info, id);
+
+        int32_t value = 0;
+        mp_camera_control_snapshot_update(info->camera, snapshot);
+        mp_control_snapshot_get(snapshot, id, &value);
+        return value;
+}
+
 static void
 update_process_pipeline()
 {
         struct camera_info *info = &cameras[camera->index];
 
         // Grab the latest control values
-        if (!current_controls.gain_is_manual) {
-                current_controls.gain =
-                        mp_camera_control_get_int32(info->camera, info->gain_ctrl);
-        }
-        if (!current_controls.exposure_is_manual) {
-                current_controls.exposure =
-                        mp_camera_control_get_int32(info->camera, V4L2_CID_EXPOSURE);
+        if (info->has_software_ae) {
+                // Already known, no need to ask the sensor
+                if (!current_controls.gain_is_manual) {
+                        current_controls.gain = info->auto_exposure.gain;
+                }
+                if (!current_controls.exposure_is_manual) {
+                        current_controls.exposure = info->auto_exposure.exposure;
+                }
+        } else {
+                if (!current_controls.gain_is_manual) {
+                        current_controls.gain =
+                                get_control(info, info->gain_ctrl);
+                }
+                if (!current_controls.exposure_is_manual) {
+                        current_controls.exposure =
+                                get_control(info, V4L2_CID_EXPOSURE);
+                }
         }
 
         struct mp_process_pipeline_state pipeline_state = {
@@ -347,35 +729,76 @@ update_process_pipeline()
                 .preview_width = preview_width,
                 .preview_height = preview_height,
                 .device_rotation = device_rotation,
+                .demosaic = demosaic,
                 .gain_is_manual = current_controls.gain_is_manual,
                 .gain = current_controls.gain,
                 .gain_max = info->gain_max,
                 .exposure_is_manual = current_controls.exposure_is_manual,
                 .exposure = current_controls.exposure,
                 .has_auto_focus_continuous = info->has_auto_focus_continuous,
-                .has_auto_focus_start = info->has_auto_focus_start,
+                .has_auto_focus_start =
+                        info->has_auto_focus_start || info->has_software_af,
+                .measure_sharpness = info->auto_focus.is_running,
+                .focus_x = focus_x,
+                .focus_y = focus_y,
                 .flash_enabled = flash_enabled,
         };
         mp_process_pipeline_update_state(&pipeline_state);
 }
 
 static void
-focus(MPPipeline *pipeline, const void *data)
+focus(MPPipeline *pipeline, const float *point)
 {
+        // Undo the rotation and mirroring of the preview
+        int rotation = (camera->rotate - device_rotation + 360) % 360;
+        float x = camera->mirrored ? 1.0f - point[0] : point[0];
+        float y = point[1];
+
+        if (rotation == 0) {
+                focus_x = x;
+                focus_y = y;
+        } else if (rotation == 90) {
+                focus_x = 1.0f - y;
+                focus_y = x;
+        } else if (rotation == 270) {
+                focus_x = y;
+                focus_y = 1.0f - x;
+        } else {
+                focus_x = 1.0f - x;
+                focus_y = 1.0f - y;
+        }
+
         want_focus = true;
 }
 
 void
-mp_io_pipeline_focus()
+mp_io_pipeline_focus(float x, float y)
 {
-        mp_pipeline_invoke(pipeline, focus, NULL, 0);
+        float point[2] = { x, y };
+        mp_pipeline_invoke(
+                pipeline, (MPPipelineCallback)focus, point, sizeof(point));
 }
 
 static void
-capture(MPPipeline *pipeline, const void *data)
+set_mode(struct camera_info *info, const MPMode *new_mode)
 {
-        struct camera_info *info = &cameras[camera->index];
         struct device_info *dev_info = &devices[info->device_index];
+
+        mode = *new_mode;
+        if (camera->num_media_links)
+                mp_setup_media_link_pad_formats(dev_info,
+                                                camera->media_links,
+                                                camera->num_media_links,
+                                                &mode);
+        mp_camera_set_mode(info->camera, &mode);
+        just_switched_mode = true;
+}
+
+// The burst starts with the next frame, the stream has to be in the capture
+// mode already
+static void
+start_burst(struct camera_info *info)
+{
         uint32_t gain;
         float gain_norm;
 
@@ -388,26 +811,11 @@ capture(MPPipeline *pipeline, const void *data)
         // with low gain there's 2, with the max automatic gain of the ov5640
         // the value seems to be 248 which creates a 5 frame burst
         // for manual gain you can go up to 11 frames
-        gain = mp_camera_control_get_int32(info->camera, V4L2_CID_GAIN);
+        gain = get_control(info, info->gain_ctrl);
         gain_norm = (float)gain / (float)info->gain_max;
         burst_length = (int)fmax(sqrt(gain_norm) * 10, 1) + 1;
         captures_remaining = burst_length;
 
-        // Change camera mode for capturing
-        mp_process_pipeline_sync();
-        mp_camera_stop_capture(info->camera);
-
-        mode = camera->capture_mode;
-        if (camera->num_media_links)
-                mp_setup_media_link_pad_formats(dev_info,
-                                                camera->media_links,
-                                                camera->num_media_links,
-                                                &mode);
-        mp_camera_set_mode(info->camera, &mode);
-        just_switched_mode = true;
-
-        mp_camera_start_capture(info->camera);
-
         // Enable flash
         if (info->flash && flash_enabled) {
                 mp_flash_enable(info->flash);
@@ -418,6 +826,20 @@ capture(MPPipeline *pipeline, const void *data)
         mp_process_pipeline_capture();
 }
 
+static void
+capture(MPPipeline *pipeline, const void *data)
+{
+        struct camera_info *info = &cameras[camera->index];
+
+        // Change camera mode for capturing
+        mp_process_pipeline_sync();
+        mp_camera_stop_capture(info->camera);
+        set_mode(info, &camera->capture_mode);
+        mp_camera_start_capture(info->camera);
+
+        start_burst(info);
+}
+
 void
 mp_io_pipeline_capture()
 {
@@ -441,6 +863,28 @@ mp_io_pipeline_release_buffer(uint32_t buffer_index)
                            sizeof(uint32_t));
 }
 
+static void
+set_frame_stats(MPPipeline *pipeline, const MPFrameStats *stats)
+{
+        // Frames of the previous camera can still be metered after a switch,
+        // the update is queued behind it
+        if (!camera || stats->camera_index != camera->index) {
+                return;
+        }
+
+        frame_stats = *stats;
+        has_frame_stats = true;
+}
+
+void
+mp_io_pipeline_set_frame_stats(const MPFrameStats *stats)
+{
+        mp_pipeline_invoke(pipeline,
+                           (MPPipelineCallback)set_frame_stats,
+                           stats,
+                           sizeof(MPFrameStats));
+}
+
 static pid_t focus_continuous_task = 0;
 static pid_t start_focus_task = 0;
 static void
@@ -457,6 +901,64 @@ start_focus(struct camera_info *info)
         } else if (info->has_auto_focus_start) {
                 start_focus_task = mp_camera_control_set_bool_bg(
                         info->camera, V4L2_CID_AUTO_FOCUS_START, 1);
+        } else if (info->has_software_af) {
+                mp_auto_focus_start(&info->auto_focus,
+                                    get_control(info, V4L2_CID_FOCUS_ABSOLUTE));
+
+                // Have the process pipeline measure the sharpness
+                update_process_pipeline();
+        }
+}
+
+static void
+update_software_ae(struct camera_info *info, const MPFrameStats *stats)
+{
+        MPAutoExposure *ae = &info->auto_exposure;
+
+        if (desired_controls.exposure_is_manual) {
+                return;
+        }
+
+        // Continue from the values that were set manually
+        if (current_controls.exposure_is_manual) {
+                mp_auto_exposure_reset(
+                        ae, current_controls.exposure, current_controls.gain);
+        }
+
+        ae->gain_is_locked = desired_controls.gain_is_manual || !info->gain_ctrl;
+        if (desired_controls.gain_is_manual) {
+                ae->gain = desired_controls.gain;
+        }
+
+        if (!stats || !mp_auto_exposure_update(ae, stats)) {
+                return;
+        }
+
+        const uint32_t ids[] = { V4L2_CID_EXPOSURE, info->gain_ctrl };
+        const int32_t values[] = { ae->exposure, ae->gain };
+
+        // Errors are ignored, the next frames will show if it didn't apply
+        mp_camera_control_set_int32_batch(
+                info->camera, ids, values, ae->gain_is_locked ? 1 : 2);
+}
+
+static void
+update_software_af(struct camera_info *info, const MPFrameStats *stats)
+{
+        MPAutoFocus *af = &info->auto_focus;
+
+        if (!af->is_running || !stats) {
+                return;
+        }
+
+        if (mp_auto_focus_update(af, stats->sharpness)) {
+                mp_camera_control_set_int32(
+                        info->camera, V4L2_CID_FOCUS_ABSOLUTE, af->position);
+        }
+
+        // Found it, stop measuring the sharpness
+        if (!af->is_running) {
+                update_process_pipeline();
         }
 }
 
@@ -475,7 +977,17 @@ update_controls()
                 want_focus = false;
         }
 
-        if (current_controls.gain_is_manual != desired_controls.gain_is_manual) {
+        // Every frame is only metered once
+        const MPFrameStats *stats = has_frame_stats ? &frame_stats : NULL;
+        has_frame_stats = false;
+
+        update_software_af(info, stats);
+
+        // With software AE the auto modes of the sensor stay disabled
+        if (info->has_software_ae) {
+                update_software_ae(info, stats);
+        } else if (current_controls.gain_is_manual !=
+                   desired_controls.gain_is_manual) {
                 mp_camera_control_set_bool_bg(info->camera,
                                               V4L2_CID_AUTOGAIN,
                                               !desired_controls.gain_is_manual);
@@ -487,8 +999,9 @@ update_controls()
                         info->camera, info->gain_ctrl, desired_controls.gain);
         }
 
-        if (current_controls.exposure_is_manual !=
-            desired_controls.exposure_is_manual) {
+        if (!info->has_software_ae &&
+            current_controls.exposure_is_manual !=
+                    desired_controls.exposure_is_manual) {
                 mp_camera_control_set_int32_bg(info->camera,
                                                V4L2_CID_EXPOSURE_AUTO,
                                                desired_controls.exposure_is_manual ?
@@ -505,9 +1018,27 @@ update_controls()
         current_controls = desired_controls;
 }
 
+static void
+finish_timelapse_shot()
+{
+        gint64 now = g_get_monotonic_time();
+        timelapse_active_time += now - shot_start;
+        ++timelapse_shots;
+
+        printf("Timelapse shot %d took %fms, duty cycle %.1f%%\n",
+               timelapse_shots,
+               (now - shot_start) / 1000.0,
+               100.0 * timelapse_active_time / (now - timelapse_start));
+        shot_start = 0;
+}
+
 static void
 on_frame(MPBuffer buffer, void *_data)
 {
+        // The sensor may have changed its controls for this frame, the ones
+        // without events have to be read again
+        mp_control_snapshot_invalidate(&cameras[camera->index].volatile_controls);
+
         // Only update controls right after a frame was captured
         update_controls();
 
@@ -538,6 +1069,13 @@ on_frame(MPBuffer buffer, void *_data)
                 blank_frame_count = 0;
         }
 
+        if (switch_start) {
+                printf("Switching camera took %fms%s\n",
+                       (g_get_monotonic_time() - switch_start) / 1000.0,
+                       switch_preloaded ? " (preloaded)" : "");
+                switch_start = 0;
+        }
+
         // Send the image off for processing
         mp_process_pipeline_process_image(buffer);
 
@@ -546,36 +1084,40 @@ on_frame(MPBuffer buffer, void *_data)
 
                 if (captures_remaining == 0) {
                         struct camera_info *info = &cameras[camera->index];
-                        struct device_info *dev_info = &devices[info->device_index];
 
-                        // Restore the auto exposure and gain if needed
-                        if (!current_controls.exposure_is_manual) {
+                        // Restore the auto exposure and gain if needed, the
+                        // software AE simply continues on the preview frames
+                        if (!info->has_software_ae &&
+                            !current_controls.exposure_is_manual) {
                                 mp_camera_control_set_int32_bg(
                                         info->camera,
                                         V4L2_CID_EXPOSURE_AUTO,
                                         V4L2_EXPOSURE_AUTO);
                         }
 
-                        if (!current_controls.gain_is_manual) {
+                        if (!info->has_software_ae &&
+                            !current_controls.gain_is_manual) {
                                 mp_camera_control_set_bool_bg(
                                         info->camera, V4L2_CID_AUTOGAIN, true);
                         }
 
-                        // Go back to preview mode
                         mp_process_pipeline_sync();
-                        mp_camera_stop_capture(info->camera);
-
-                        mode = camera->preview_mode;
-                        if (camera->num_media_links)
-                                mp_setup_media_link_pad_formats(
-                                        dev_info,
-                                        camera->media_links,
-                                        camera->num_media_links,
-                                        &mode);
-                        mp_camera_set_mode(info->camera, &mode);
-                        just_switched_mode = true;
+                        if (shot_start) {
+                                finish_timelapse_shot();
+                        }
 
-                        mp_camera_start_capture(info->camera);
+                        if (timelapse_source) {
+                                // Nothing is captured or processed until the
+                                // next shot
+                                g_source_destroy(capture_source);
+                                capture_source = NULL;
+                                mp_camera_stop_capture(info->camera);
+                        } else {
+                                // Go back to preview mode
+                                mp_camera_stop_capture(info->camera);
+                                set_mode(info, &info->preview_mode);
+                                mp_camera_start_capture(info->camera);
+                        }
 
                         // Disable flash
                         if (info->flash && flash_enabled) {
@@ -584,7 +1126,135 @@ on_frame(MPBuffer buffer, void *_data)
 
                         update_process_pipeline();
                 }
+        } else if (settle_frames_remaining > 0) {
+                --settle_frames_remaining;
+
+                if (settle_frames_remaining == 0) {
+                        start_burst(&cameras[camera->index]);
+                }
+        }
+}
+
+// Sent when the sensor changes a control, only then does the UI need the new
+// gain or exposure
+static void
+on_control_event(const struct v4l2_event *event, void *data)
+{
+        struct camera_info *info = data;
+
+        if (event->type != V4L2_EVENT_CTRL ||
+            !(event->u.ctrl.changes & V4L2_EVENT_CTRL_CH_VALUE)) {
+                return;
+        }
+
+        int32_t value = event->u.ctrl.value;
+        mp_control_snapshot_set(&info->controls, event->id, value);
+
+        // The software AE already knows the values and a burst updates the
+        // process pipeline once it's done
+        if (info->has_software_ae || captures_remaining > 0) {
+                return;
+        }
+
+        if ((event->id == info->gain_ctrl && !current_controls.gain_is_manual &&
+             current_controls.gain != value) ||
+            (event->id == V4L2_CID_EXPOSURE &&
+             !current_controls.exposure_is_manual &&
+             current_controls.exposure != value)) {
+                update_process_pipeline();
+        }
+}
+
+static bool
+on_timelapse_timeout(gpointer data)
+{
+        struct camera_info *info = &cameras[camera->index];
+
+        if (shot_start) {
+                printf("Timelapse shot still in progress, skipping one\n");
+                return true;
         }
+
+        shot_start = g_get_monotonic_time();
+
+        // Straight to the capture mode, the preview mode is never started
+        // between the shots
+        set_mode(info, &camera->capture_mode);
+        mp_camera_start_capture(info->camera);
+        capture_source = mp_pipeline_add_capture_source(
+                pipeline, info->camera, on_frame, NULL);
+        settle_frames_remaining = TIMELAPSE_SETTLE_FRAMES;
+
+        update_process_pipeline();
+
+        return true;
+}
+
+static void
+set_timelapse(MPPipeline *pipeline, const int *interval)
+{
+        if (!camera) {
+                return;
+        }
+
+        struct camera_info *info = &cameras[camera->index];
+
+        if (*interval > 0 && !timelapse_source) {
+                timelapse_start = g_get_monotonic_time();
+                timelapse_active_time = 0;
+                timelapse_shots = 0;
+                timelapse_source = mp_pipeline_add_timeout(
+                        pipeline,
+                        *interval * 1000,
+                        (GSourceFunc)on_timelapse_timeout,
+                        NULL);
+
+                // A capture or a shot of a timelapse that was just turned off
+                // is still running. It stops the stream when it is done and
+                // the next shot is the first one.
+                if (shot_start || captures_remaining > 0) {
+                        return;
+                }
+
+                mp_process_pipeline_sync();
+                if (capture_source) {
+                        g_source_destroy(capture_source);
+                        capture_source = NULL;
+                }
+                mp_camera_stop_capture(info->camera);
+
+                // The first shot is taken right away
+                on_timelapse_timeout(NULL);
+        } else if (*interval == 0 && timelapse_source) {
+                g_source_destroy(timelapse_source);
+                timelapse_source = NULL;
+
+                gint64 duration = g_get_monotonic_time() - timelapse_start;
+                printf("Timelapse: %d shots in %.1fs, duty cycle %.1f%%\n",
+                       timelapse_shots,
+                       duration / 1e6,
+                       100.0 * timelapse_active_time / duration);
+
+                // A shot that is still in progress returns to the preview
+                // by itself
+                if (!shot_start) {
+                        set_mode(info, &info->preview_mode);
+                        mp_camera_start_capture(info->camera);
+                        capture_source = mp_pipeline_add_capture_source(
+                                pipeline, info->camera, on_frame, NULL);
+
+                        update_process_pipeline();
+                }
+        }
+}
+
+void
+mp_io_pipeline_set_timelapse(int interval)
+{
+        mp_pipeline_invoke(pipeline,
+                           (MPPipelineCallback)set_timelapse,
+                           &interval,
+                           sizeof(int));
 }
 
 static void
@@ -620,8 +1290,16 @@ update_state(MPPipeline *pipeline, const struct mp_io_pipeline_state *state)
                         struct camera_info *info = &cameras[camera->index];
                         struct device_info *dev_info = &devices[info->device_index];
 
+                        switch_start = g_get_monotonic_time();
+
                         mp_process_pipeline_sync();
-                        mp_camera_stop_capture(info->camera);
+                        if (can_preload(info)) {
+                                // Keep the buffers and formats around so
+                                // switching back is only a STREAMON
+                                mp_camera_pause_capture(info->camera);
+                        } else {
+                                mp_camera_stop_capture(info->camera);
+                        }
                         mp_device_setup_link(dev_info->device,
                                              info->pad_id,
                                              dev_info->interface_pad_id,
@@ -637,13 +1315,24 @@ update_state(MPPipeline *pipeline, const struct mp_io_pipeline_state *state)
                         g_source_destroy(capture_source);
                         capture_source = NULL;
                 }
+                if (event_source) {
+                        g_source_destroy(event_source);
+                        event_source = NULL;
+                }
 
                 camera = state->camera;
 
+                // Don't meter the new camera with the old one's frames
+                has_frame_stats = false;
+                focus_x = 0.5f;
+                focus_y = 0.5f;
+
                 if (camera) {
                         struct camera_info *info = &cameras[camera->index];
                         struct device_info *dev_info = &devices[info->device_index];
 
+                        wait_for_camera(info);
+
                         mp_device_setup_link(dev_info->device,
                                              info->pad_id,
                                              dev_info->interface_pad_id,
@@ -654,43 +1343,73 @@ update_state(MPPipeline *pipeline, const struct mp_io_pipeline_state *state)
                                 mp_setup_media_link(
                                         dev_info, &camera->media_links[i], true);
 
-                        mode = camera->preview_mode;
-                        if (camera->num_media_links)
-                                mp_setup_media_link_pad_formats(
-                                        dev_info,
-                                        camera->media_links,
-                                        camera->num_media_links,
-                                        &mode);
-                        mp_camera_set_mode(info->camera, &mode);
+                        switch_preloaded = mp_camera_is_capturing(info->camera);
+                        if (switch_preloaded) {
+                                // The pad formats are still programmed and the
+                                // buffers allocated
+                                mode = *mp_camera_get_mode(info->camera);
+                                mp_camera_resume_capture(info->camera);
+                        } else {
+                                mode = info->preview_mode;
+                                if (camera->num_media_links)
+                                        mp_setup_media_link_pad_formats(
+                                                dev_info,
+                                                camera->media_links,
+                                                camera->num_media_links,
+                                                &mode);
+                                mp_camera_set_mode(info->camera, &mode);
+
+                                mp_camera_start_capture(info->camera);
+                        }
+                        mp_startup_trace("Stream started");
 
-                        mp_camera_start_capture(info->camera);
                         capture_source = mp_pipeline_add_capture_source(
                                 pipeline, info->camera, on_frame, NULL);
+                        if (info->has_control_events) {
+                                event_source = mp_pipeline_add_event_source(
+                                        pipeline,
+                                        info->camera,
+                                        on_control_event,
+                                        info);
+                        }
 
-                        current_controls.gain_is_manual =
-                                mp_camera_control_get_bool(info->camera,
-                                                           V4L2_CID_AUTOGAIN) == 0;
-                        current_controls.gain = mp_camera_control_get_int32(
-                                info->camera, info->gain_ctrl);
-
-                        current_controls.exposure_is_manual =
-                                mp_camera_control_get_int32(
-                                        info->camera, V4L2_CID_EXPOSURE_AUTO) ==
-                                V4L2_EXPOSURE_MANUAL;
-                        current_controls.exposure = mp_camera_control_get_int32(
-                                info->camera, V4L2_CID_EXPOSURE);
+                        // Events may have been missed while the camera wasn't
+                        // used
+                        mp_control_snapshot_invalidate(&info->controls);
+                        mp_control_snapshot_invalidate(&info->volatile_controls);
+                        current_controls.gain = get_control(info, info->gain_ctrl);
+                        current_controls.exposure =
+                                get_control(info, V4L2_CID_EXPOSURE);
+
+                        // With software AE the auto modes of the sensor are
+                        // always off, only our own loop says what is manual
+                        if (info->has_software_ae) {
+                                current_controls.gain_is_manual =
+                                        desired_controls.gain_is_manual;
+                                current_controls.exposure_is_manual =
+                                        desired_controls.exposure_is_manual;
+                        } else {
+                                current_controls.gain_is_manual =
+                                        get_control(info, V4L2_CID_AUTOGAIN) == 0;
+                                current_controls.exposure_is_manual =
+                                        get_control(info,
+                                                    V4L2_CID_EXPOSURE_AUTO) ==
+                                        V4L2_EXPOSURE_MANUAL;
+                        }
                 }
         }
 
         has_changed = has_changed || burst_length != state->burst_length ||
                       preview_width != state->preview_width ||
                       preview_height != state->preview_height ||
-                      device_rotation != state->device_rotation;
+                      device_rotation != state->device_rotation ||
+                      demosaic != state->demosaic;
 
         burst_length = state->burst_length;
         preview_width = state->preview_width;
         preview_height = state->preview_height;
         device_rotation = state->device_rotation;
+        demosaic = state->demosaic;
 
         if (camera) {
                 struct control_state previous_desired = desired_controls;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "camera_config.h"
+#include "frame_stats.h"
 
 struct mp_io_pipeline_state {
         const struct mp_camera_config *camera;
@@ -12,6 +13,8 @@ struct mp_io_pipeline_state {
 
         int device_rotation;
 
+        MPDemosaic demosaic;
+
         bool gain_is_manual;
         int gain;
 
@@ -24,9 +27,13 @@ struct mp_io_pipeline_state {
 void mp_io_pipeline_start();
 void mp_io_pipeline_stop();
 
-void mp_io_pipeline_focus();
+void mp_io_pipeline_focus(float x, float y);
 void mp_io_pipeline_capture();
+// Take a burst every interval seconds, with the camera stopped in between.
+// An interval of 0 stops it and goes back to the preview.
+void mp_io_pipeline_set_timelapse(int interval);
 
 void mp_io_pipeline_release_buffer(uint32_t buffer_index);
+void mp_io_pipeline_set_frame_stats(const MPFrameStats *stats);
 
 void mp_io_pipeline_update_state(const struct mp_io_pipeline_state *state);
@@ -0,0 +1,398 @@
+#include "jpeg.h"
+
+#include <glib.h>
+#include <jpeglib.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+
+#define EXIF_MAX_SIZE 512
+#define EXIF_MAX_STRING 64
+
+#define MARKER_DHT 0xc4
+#define MARKER_SOI 0xd8
+#define MARKER_SOS 0xda
+#define MARKER_APP0 0xe0
+#define MARKER_APP1 0xe1
+#define MARKER_APP15 0xef
+
+// The Huffman tables from the JPEG standard, which MJPEG frames leave out
+static const uint8_t std_huffman_tables[] = {
+        0xff, 0xc4, 0x01, 0xa2, 0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01,
+        0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02,
+        0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x10, 0x00, 0x02,
+        0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00, 0x00,
+        0x01, 0x7d, 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31,
+        0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91,
+        0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33,
+        0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26,
+        0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43,
+        0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57,
+        0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73,
+        0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87,
+        0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+        0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+        0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+        0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+        0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2,
+        0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0x01, 0x00, 0x03, 0x01,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a,
+        0x0b, 0x11, 0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05,
+        0x04, 0x04, 0x00, 0x01, 0x02, 0x77, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04,
+        0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22,
+        0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33,
+        0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25,
+        0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36,
+        0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a,
+        0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66,
+        0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a,
+        0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94,
+        0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+        0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba,
+        0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+        0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7,
+        0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+};
+
+struct error_manager {
+        struct jpeg_error_mgr parent;
+        jmp_buf jump;
+};
+
+// The default handler exits the process, return to the caller instead
+static void
+error_exit(j_common_ptr cinfo)
+{
+        struct error_manager *err = (struct error_manager *)cinfo->err;
+
+        char message[JMSG_LENGTH_MAX];
+        cinfo->err->format_message(cinfo, message);
+        g_printerr("JPEG error: %s\n", message);
+
+        longjmp(err->jump, 1);
+}
+
+static void
+put_u16(uint8_t *dst, uint16_t value)
+{
+        dst[0] = value >> 8;
+        dst[1] = value & 0xff;
+}
+
+static void
+put_u32(uint8_t *dst, uint32_t value)
+{
+        put_u16(dst, value >> 16);
+        put_u16(dst + 2, value & 0xffff);
+}
+
+// Add an IFD entry, values that don't fit the entry go to the data area
+static void
+put_ascii_entry(uint8_t *tiff,
+                size_t *entry,
+                size_t *data,
+                uint16_t tag,
+                const char *value)
+{
+        size_t length = strnlen(value, EXIF_MAX_STRING - 1);
+
+        put_u16(tiff + *entry, tag);
+        put_u16(tiff + *entry + 2, 2);
+        put_u32(tiff + *entry + 4, length + 1);
+        if (length + 1 <= 4) {
+                memset(tiff + *entry + 8, 0, 4);
+                memcpy(tiff + *entry + 8, value, length);
+        } else {
+                put_u32(tiff + *entry + 8, *data);
+                memcpy(tiff + *data, value, length);
+                tiff[*data + length] = '\0';
+                *data += length + 1;
+        }
+        *entry += 12;
+}
+
+static void
+put_short_entry(uint8_t *tiff, size_t *entry, uint16_t tag, uint16_t value)
+{
+        put_u16(tiff + *entry, tag);
+        put_u16(tiff + *entry + 2, 3);
+        put_u32(tiff + *entry + 4, 1);
+        put_u16(tiff + *entry + 8, value);
+        put_u16(tiff + *entry + 10, 0);
+        *entry += 12;
+}
+
+// A minimal big endian EXIF block with a single IFD, the entries sorted by tag.
+// Returns the size of the APP1 payload.
+static size_t
+build_exif(uint8_t *exif, const MPJpegMetadata *metadata)
+{
+        memcpy(exif, "Exif\0\0MM\0\x2a\0\0\0\x08", 14);
+        uint8_t *tiff = exif + 6;
+
+        const int num_entries = 5;
+        size_t entry = 8 + 2;
+        size_t data = entry + num_entries * 12 + 4;
+        put_u16(tiff + 8, num_entries);
+
+        put_ascii_entry(tiff, &entry, &data, 0x010f, metadata->make);
+        put_ascii_entry(tiff, &entry, &data, 0x0110, metadata->model);
+        put_short_entry(tiff, &entry, 0x0112, metadata->orientation);
+        put_ascii_entry(tiff, &entry, &data, 0x0131, "Megapixels");
+        put_ascii_entry(tiff, &entry, &data, 0x0132, metadata->datetime);
+
+        // No next IFD
+        put_u32(tiff + entry, 0);
+
+        return 6 + data;
+}
+
+static void
+write_exif(j_compress_ptr cinfo, const MPJpegMetadata *metadata)
+{
+        uint8_t exif[EXIF_MAX_SIZE];
+        size_t size = build_exif(exif, metadata);
+        jpeg_write_marker(cinfo, MARKER_APP1, exif, size);
+}
+
+// Encode an interleaved 4:2:2 frame. The chroma is handed to libjpeg at full
+// resolution and subsampled again horizontally only, so nothing is lost.
+bool
+mp_jpeg_write_yuv(const char *path,
+                  const uint8_t *image,
+                  MPPixelFormat pixel_format,
+                  uint32_t width,
+                  uint32_t height,
+                  int quality,
+                  const MPJpegMetadata *metadata)
+{
+        g_return_val_if_fail(mp_pixel_format_is_yuv(pixel_format), false);
+
+        FILE *file = fopen(path, "wb");
+        if (!file) {
+                g_printerr("Could not open %s\n", path);
+                return false;
+        }
+
+        bool is_uyvy = pixel_format == MP_PIXEL_FMT_UYVY;
+        size_t luma_offset = is_uyvy ? 1 : 0;
+        size_t cb_offset = is_uyvy ? 0 : 1;
+        size_t cr_offset = is_uyvy ? 2 : 3;
+        size_t stride = mp_pixel_format_width_to_bytes(pixel_format, width) +
+                        mp_pixel_format_width_to_padding(pixel_format, width);
+
+        // Sensors output limited range, JFIF expects the full range
+        uint8_t luma[256];
+        uint8_t chroma[256];
+        for (int i = 0; i < 256; ++i) {
+                luma[i] = CLAMP((i - 16) * 255 / 219, 0, 255);
+                chroma[i] = CLAMP((i - 128) * 255 / 224 + 128, 0, 255);
+        }
+
+        struct jpeg_compress_struct cinfo;
+        struct error_manager err;
+        cinfo.err = jpeg_std_error(&err.parent);
+        err.parent.error_exit = error_exit;
+
+        uint8_t *row = g_malloc(width * 3);
+
+        if (setjmp(err.jump)) {
+                jpeg_destroy_compress(&cinfo);
+                g_free(row);
+                fclose(file);
+                return false;
+        }
+
+        jpeg_create_compress(&cinfo);
+        jpeg_stdio_dest(&cinfo, file);
+
+        cinfo.image_width = width;
+        cinfo.image_height = height;
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_YCbCr;
+        jpeg_set_defaults(&cinfo);
+        jpeg_set_quality(&cinfo, quality, TRUE);
+        cinfo.comp_info[0].v_samp_factor = 1;
+
+        jpeg_start_compress(&cinfo, TRUE);
+        write_exif(&cinfo, metadata);
+
+        while (cinfo.next_scanline < height) {
+                const uint8_t *src = image + cinfo.next_scanline * stride;
+                uint8_t *dst = row;
+                for (uint32_t x = 0; x < width / 2; ++x) {
+                        uint8_t cb = chroma[src[cb_offset]];
+                        uint8_t cr = chroma[src[cr_offset]];
+                        dst[0] = luma[src[luma_offset]];
+                        dst[1] = cb;
+                        dst[2] = cr;
+                        dst[3] = luma[src[luma_offset + 2]];
+                        dst[4] = cb;
+                        dst[5] = cr;
+                        src += 4;
+                        dst += 6;
+                }
+
+                JSAMPROW rows[1] = { row };
+                jpeg_write_scanlines(&cinfo, rows, 1);
+        }
+
+        jpeg_finish_compress(&cinfo);
+        jpeg_destroy_compress(&cinfo);
+        g_free(row);
+
+        return fclose(file) == 0;
+}
+
+// Save an MJPEG frame without decoding it. The EXIF block goes after the
+// APPn segments at the start, and the standard Huffman tables are added in
+// front of the scan when the frame relies on them.
+bool
+mp_jpeg_write_mjpeg(const char *path,
+                    const uint8_t *data,
+                    size_t size,
+                    const MPJpegMetadata *metadata)
+{
+        if (size < 4 || data[0] != 0xff || data[1] != MARKER_SOI) {
+                g_printerr("Not a JPEG frame\n");
+                return false;
+        }
+
+        size_t exif_pos = 0;
+        size_t sos_pos = 0;
+        bool has_exif = false;
+        bool has_huffman_tables = false;
+        for (size_t pos = 2; pos + 4 <= size;) {
+                if (data[pos] != 0xff) {
+                        break;
+                }
+
+                uint8_t marker = data[pos + 1];
+                if (marker == MARKER_SOS) {
+                        sos_pos = pos;
+                        break;
+                }
+
+                if (!exif_pos && (marker < MARKER_APP0 || marker > MARKER_APP15)) {
+                        exif_pos = pos;
+                }
+                has_exif |= marker == MARKER_APP1;
+                has_huffman_tables |= marker == MARKER_DHT;
+
+                pos += 2 + ((data[pos + 2] << 8) | data[pos + 3]);
+        }
+
+        if (!sos_pos || !exif_pos) {
+                g_printerr("Could not find the scan of the JPEG frame\n");
+                return false;
+        }
+
+        FILE *file = fopen(path, "wb");
+        if (!file) {
+                g_printerr("Could not open %s\n", path);
+                return false;
+        }
+
+        fwrite(data, 1, exif_pos, file);
+        if (!has_exif) {
+                uint8_t header[4] = { 0xff, MARKER_APP1 };
+                uint8_t exif[EXIF_MAX_SIZE];
+                size_t exif_size = build_exif(exif, metadata);
+                put_u16(header + 2, exif_size + 2);
+                fwrite(header, 1, sizeof(header), file);
+                fwrite(exif, 1, exif_size, file);
+        }
+        fwrite(data + exif_pos, 1, sos_pos - exif_pos, file);
+        if (!has_huffman_tables) {
+                fwrite(std_huffman_tables, 1, sizeof(std_huffman_tables), file);
+        }
+        fwrite(data + sos_pos, 1, size - sos_pos, file);
+
+        bool ok = !ferror(file);
+        return fclose(file) == 0 && ok;
+}
+
+// Decode to the layout of a YUYV frame in limited range, so the preview and
+// zbar treat it like any other YUV camera. Chroma is not interpolated, which
+// is exact for the 4:2:2 most cameras send.
+bool
+mp_jpeg_decode_yuv(const uint8_t *data,
+                   size_t size,
+                   int scale,
+                   uint8_t *dst,
+                   uint32_t width,
+                   uint32_t height)
+{
+        size_t stride = mp_pixel_format_width_to_bytes(MP_PIXEL_FMT_YUYV, width) +
+                        mp_pixel_format_width_to_padding(MP_PIXEL_FMT_YUYV, width);
+
+        uint8_t luma[256];
+        uint8_t chroma[256];
+        for (int i = 0; i < 256; ++i) {
+                luma[i] = 16 + i * 219 / 255;
+                chroma[i] = 128 + (i - 128) * 224 / 255;
+        }
+
+        struct jpeg_decompress_struct cinfo;
+        struct error_manager err;
+        cinfo.err = jpeg_std_error(&err.parent);
+        err.parent.error_exit = error_exit;
+
+        if (setjmp(err.jump)) {
+                jpeg_destroy_decompress(&cinfo);
+                return false;
+        }
+
+        jpeg_create_decompress(&cinfo);
+        jpeg_mem_src(&cinfo, data, size);
+        jpeg_read_header(&cinfo, TRUE);
+
+        if (cinfo.jpeg_color_space != JCS_YCbCr) {
+                g_printerr("Unsupported JPEG color space %d\n",
+                           cinfo.jpeg_color_space);
+                jpeg_destroy_decompress(&cinfo);
+                return false;
+        }
+
+        // Speed over accuracy, this is for the preview and for metering
+        cinfo.out_color_space = JCS_YCbCr;
+        cinfo.scale_num = 1;
+        cinfo.scale_denom = scale;
+        cinfo.dct_method = JDCT_IFAST;
+        cinfo.do_fancy_upsampling = FALSE;
+        jpeg_start_decompress(&cinfo);
+
+        if (cinfo.output_width < width || cinfo.output_height < height) {
+                g_printerr("JPEG frame is %dx%d, expected %dx%d\n",
+                           cinfo.output_width,
+                           cinfo.output_height,
+                           width,
+                           height);
+                jpeg_destroy_decompress(&cinfo);
+                return false;
+        }
+
+        JSAMPARRAY rows = (*cinfo.mem->alloc_sarray)(
+                (j_common_ptr)&cinfo, JPOOL_IMAGE, cinfo.output_width * 3, 1);
+
+        while (cinfo.output_scanline < height) {
+                uint8_t *out = dst + cinfo.output_scanline * stride;
+                jpeg_read_scanlines(&cinfo, rows, 1);
+
+                const uint8_t *src = rows[0];
+                for (uint32_t x = 0; x < width / 2; ++x) {
+                        out[0] = luma[src[0]];
+                        out[1] = chroma[src[1]];
+                        out[2] = luma[src[3]];
+                        out[3] = chroma[src[2]];
+                        src += 6;
+                        out += 4;
+                }
+        }
+
+        // The rows past the requested height are not needed
+        jpeg_destroy_decompress(&cinfo);
+
+        return true;
+}
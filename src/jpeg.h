@@ -0,0 +1,34 @@
+#pragma once
+
+#include "mode.h"
+
+#include <stddef.h>
+
+// Tags written to the EXIF block of the JPEG, the orientation uses the same
+// values as TIFF
+typedef struct {
+        const char *make;
+        const char *model;
+        const char *datetime;
+        uint16_t orientation;
+} MPJpegMetadata;
+
+bool mp_jpeg_write_yuv(const char *path,
+                       const uint8_t *image,
+                       MPPixelFormat pixel_format,
+                       uint32_t width,
+                       uint32_t height,
+                       int quality,
+                       const MPJpegMetadata *metadata);
+
+bool mp_jpeg_write_mjpeg(const char *path,
+                         const uint8_t *data,
+                         size_t size,
+                         const MPJpegMetadata *metadata);
+
+bool mp_jpeg_decode_yuv(const uint8_t *data,
+                        size_t size,
+                        int scale,
+                        uint8_t *dst,
+                        uint32_t width,
+                        uint32_t height);
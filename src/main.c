@@ -5,6 +5,7 @@
 #include "gl_util.h"
 #include "io_pipeline.h"
 #include "process_pipeline.h"
+#include "startup_trace.h"
 #include <asm/errno.h>
 #include <assert.h>
 #include <errno.h>
@@ -56,6 +57,8 @@ static int preview_height = -1;
 
 static int device_rotation = 0;
 
+static MPDemosaic demosaic = MP_DEMOSAIC_FAST;
+
 static bool gain_is_manual = false;
 static int gain;
 static int gain_max;
@@ -80,6 +83,7 @@ static int burst_length = 0;
 
 // Widgets
 GtkWidget *preview;
+GtkWidget *preview_fallback;
 GtkWidget *main_stack;
 GtkWidget *open_last_stack;
 GtkWidget *thumb_last;
@@ -90,6 +94,11 @@ GtkWidget *preview_bottom_box;
 GtkWidget *flash_button;
 LfbEvent *capture_event;
 
+GSimpleAction *record_action;
+GSimpleAction *timelapse_action;
+GSimpleAction *capture_action;
+GSimpleAction *switch_camera_action;
+
 GSettings *settings;
 GSettings *fb_settings;
 
@@ -119,6 +128,7 @@ update_io_pipeline()
                 .preview_width = preview_width,
                 .preview_height = preview_height,
                 .device_rotation = device_rotation,
+                .demosaic = demosaic,
                 .gain_is_manual = gain_is_manual,
                 .gain = gain,
                 .exposure_is_manual = exposure_is_manual,
@@ -221,6 +231,28 @@ mp_main_set_preview(MPProcessPipelineBuffer *buffer)
                                    NULL);
 }
 
+static bool
+set_preview_texture(GdkTexture *texture)
+{
+        gtk_picture_set_paintable(GTK_PICTURE(preview_fallback),
+                                  GDK_PAINTABLE(texture));
+        gtk_widget_set_visible(preview_fallback, true);
+        g_object_unref(texture);
+
+        mp_startup_trace_finish("First frame drawn");
+        return false;
+}
+
+void
+mp_main_set_preview_texture(GdkTexture *texture)
+{
+        g_main_context_invoke_full(g_main_context_default(),
+                                   G_PRIORITY_DEFAULT_IDLE,
+                                   (GSourceFunc)set_preview_texture,
+                                   texture,
+                                   NULL);
+}
+
 struct capture_completed_args {
         GdkTexture *thumb;
         char *fname;
@@ -257,6 +289,23 @@ mp_main_capture_completed(GdkTexture *thumb, const char *fname)
                                    free);
 }
 
+static bool
+recording_stopped(gpointer data)
+{
+        g_simple_action_set_state(record_action, g_variant_new_boolean(false));
+        return false;
+}
+
+void
+mp_main_recording_stopped()
+{
+        g_main_context_invoke_full(g_main_context_default(),
+                                   G_PRIORITY_DEFAULT_IDLE,
+                                   (GSourceFunc)recording_stopped,
+                                   NULL,
+                                   NULL);
+}
+
 static GLuint blit_program;
 static GLuint blit_uniform_transform;
 static GLuint blit_uniform_texture;
@@ -281,43 +330,28 @@ preview_realize(GtkGLArea *area)
                 check_gl();
         }
 
-        GLuint blit_shaders[] = {
-                gl_util_load_shader("/org/postmarketos/Megapixels/blit.vert",
-                                    GL_VERTEX_SHADER,
-                                    NULL,
-                                    0),
-                gl_util_load_shader("/org/postmarketos/Megapixels/blit.frag",
-                                    GL_FRAGMENT_SHADER,
-                                    NULL,
-                                    0),
-        };
-
-        blit_program = gl_util_link_program(blit_shaders, 2);
-        glBindAttribLocation(blit_program, GL_UTIL_VERTEX_ATTRIBUTE, "vert");
-        glBindAttribLocation(blit_program, GL_UTIL_TEX_COORD_ATTRIBUTE, "tex_coord");
+        blit_program =
+                gl_util_load_program("/org/postmarketos/Megapixels/blit.vert",
+                                     "/org/postmarketos/Megapixels/blit.frag",
+                                     NULL,
+                                     0);
         check_gl();
 
         blit_uniform_transform = glGetUniformLocation(blit_program, "transform");
         blit_uniform_texture = glGetUniformLocation(blit_program, "texture");
 
-        GLuint solid_shaders[] = {
-                gl_util_load_shader("/org/postmarketos/Megapixels/solid.vert",
-                                    GL_VERTEX_SHADER,
-                                    NULL,
-                                    0),
-                gl_util_load_shader("/org/postmarketos/Megapixels/solid.frag",
-                                    GL_FRAGMENT_SHADER,
-                                    NULL,
-                                    0),
-        };
-
-        solid_program = gl_util_link_program(solid_shaders, 2);
-        glBindAttribLocation(solid_program, GL_UTIL_VERTEX_ATTRIBUTE, "vert");
+        solid_program =
+                gl_util_load_program("/org/postmarketos/Megapixels/solid.vert",
+                                     "/org/postmarketos/Megapixels/solid.frag",
+                                     NULL,
+                                     0);
         check_gl();
 
         solid_uniform_color = glGetUniformLocation(solid_program, "color");
 
         quad = gl_util_new_quad();
+
+        mp_startup_trace("Preview shaders loaded");
 }
 
 static void
@@ -405,6 +439,8 @@ preview_draw(GtkGLArea *area, GdkGLContext *ctx, gpointer data)
 
                 gl_util_bind_quad(quad);
                 gl_util_draw_quad(quad);
+
+                mp_startup_trace_finish("First frame drawn");
         }
 
         if (zbar_result) {
@@ -433,11 +469,11 @@ preview_draw(GtkGLArea *area, GdkGLContext *ctx, gpointer data)
 
                         for (int i = 0; i < 4; ++i) {
                                 vertices[i * 2] =
-                                        2 * vertices[i * 2] / preview_buffer_width -
+                                        2 * vertices[i * 2] / zbar_result->width -
                                         1.0;
                                 vertices[i * 2 + 1] =
                                         1.0 - 2 * vertices[i * 2 + 1] /
-                                                      preview_buffer_height;
+                                                      zbar_result->height;
                         }
 
                         if (gtk_gl_area_get_use_es(area)) {
@@ -537,6 +573,32 @@ run_capture_action(GSimpleAction *action, GVariant *param, gpointer user_data)
         mp_io_pipeline_capture();
 }
 
+static void
+run_record_action(GSimpleAction *action, GVariant *state, gpointer user_data)
+{
+        g_simple_action_set_state(action, state);
+        mp_process_pipeline_set_recording(g_variant_get_boolean(state));
+}
+
+static void
+run_timelapse_action(GSimpleAction *action, GVariant *state, gpointer user_data)
+{
+        bool enabled = g_variant_get_boolean(state);
+        g_simple_action_set_state(action, state);
+
+        // The camera only streams for the shots, so nothing else can use it
+        if (enabled) {
+                g_action_change_state(G_ACTION(record_action),
+                                      g_variant_new_boolean(false));
+        }
+        g_simple_action_set_enabled(record_action, !enabled);
+        g_simple_action_set_enabled(capture_action, !enabled);
+        g_simple_action_set_enabled(switch_camera_action, !enabled);
+
+        int interval = g_settings_get_int(settings, "timelapse-interval");
+        mp_io_pipeline_set_timelapse(enabled ? interval : 0);
+}
+
 void
 run_about_action(GSimpleAction *action, GVariant *param, GApplication *app)
 {
@@ -660,16 +722,17 @@ preview_pressed(GtkGestureClick *gesture, int n_press, double x, double y)
                 gtk_event_controller_get_widget(GTK_EVENT_CONTROLLER(gesture));
         int scale_factor = gtk_widget_get_scale_factor(widget);
 
+        // Transform the event coordinates to the image
+        float offset_x, offset_y, size_x, size_y;
+        position_preview(&offset_x, &offset_y, &size_x, &size_y);
+
+        float image_x = (x - offset_x) * scale_factor / size_x;
+        float image_y = (y - offset_y) * scale_factor / size_y;
+
         // Tapped zbar result
         if (zbar_result) {
-                // Transform the event coordinates to the image
-                float offset_x, offset_y, size_x, size_y;
-                position_preview(&offset_x, &offset_y, &size_x, &size_y);
-
-                int zbar_x = (x - offset_x) * scale_factor / size_x *
-                             preview_buffer_width;
-                int zbar_y = (y - offset_y) * scale_factor / size_y *
-                             preview_buffer_height;
+                int zbar_x = image_x * zbar_result->width;
+                int zbar_y = image_y * zbar_result->height;
 
                 for (uint8_t i = 0; i < zbar_result->size; ++i) {
                         MPZBarCode *code = &zbar_result->codes[i];
@@ -684,9 +747,10 @@ preview_pressed(GtkGestureClick *gesture, int n_press, double x, double y)
                 }
         }
 
-        // Tapped preview image itself, try focussing
-        if (has_auto_focus_start) {
-                mp_io_pipeline_focus();
+        // Tapped preview image itself, try focussing there
+        if (has_auto_focus_start && image_x >= 0 && image_x <= 1 &&
+            image_y >= 0 && image_y <= 1) {
+                mp_io_pipeline_focus(image_x, image_y);
         }
 }
 
@@ -868,6 +932,22 @@ flash_button_clicked(GtkWidget *button, gpointer user_data)
         gtk_button_set_icon_name(GTK_BUTTON(button), icon_name);
 }
 
+static void
+on_demosaic_changed(GSettings *changed_settings, gchar *key, gpointer data)
+{
+        MPDemosaic new_demosaic = g_settings_get_enum(changed_settings, key);
+        if (new_demosaic == demosaic) {
+                return;
+        }
+
+        demosaic = new_demosaic;
+
+        // Before the window is realized the first state update includes it
+        if (camera) {
+                update_io_pipeline();
+        }
+}
+
 static void
 on_realize(GtkWidget *window, gpointer *data)
 {
@@ -1151,11 +1231,19 @@ activate(GtkApplication *app, gpointer data)
                 GTK_WIDGET(gtk_builder_get_object(builder, "flash-controls-button"));
         GtkWidget *setting_dng_button =
                 GTK_WIDGET(gtk_builder_get_object(builder, "setting-raw"));
+        GtkWidget *setting_record_raw_button =
+                GTK_WIDGET(gtk_builder_get_object(builder, "setting-record-raw"));
+        GtkWidget *setting_timelapse_spin = GTK_WIDGET(
+                gtk_builder_get_object(builder, "setting-timelapse-interval"));
         GtkWidget *setting_postprocessor_combo =
                 GTK_WIDGET(gtk_builder_get_object(builder, "setting-processor"));
         GtkListStore *setting_postprocessor_list = GTK_LIST_STORE(
                 gtk_builder_get_object(builder, "list-postprocessors"));
+        GtkWidget *setting_demosaic_combo =
+                GTK_WIDGET(gtk_builder_get_object(builder, "setting-demosaic"));
         preview = GTK_WIDGET(gtk_builder_get_object(builder, "preview"));
+        preview_fallback =
+                GTK_WIDGET(gtk_builder_get_object(builder, "preview-fallback"));
         main_stack = GTK_WIDGET(gtk_builder_get_object(builder, "main_stack"));
         open_last_stack =
                 GTK_WIDGET(gtk_builder_get_object(builder, "open_last_stack"));
@@ -1167,6 +1255,8 @@ activate(GtkApplication *app, gpointer data)
         preview_bottom_box =
                 GTK_WIDGET(gtk_builder_get_object(builder, "bottom-box"));
 
+        mp_startup_trace("UI built");
+
         g_signal_connect(window, "realize", G_CALLBACK(on_realize), NULL);
 
         g_signal_connect(preview, "realize", G_CALLBACK(preview_realize), NULL);
@@ -1185,8 +1275,9 @@ activate(GtkApplication *app, gpointer data)
         setup_fb_switch(builder);
 
         // Setup actions
-        create_simple_action(app, "capture", G_CALLBACK(run_capture_action));
-        create_simple_action(
+        capture_action = create_simple_action(
+                app, "capture", G_CALLBACK(run_capture_action));
+        switch_camera_action = create_simple_action(
                 app, "switch-camera", G_CALLBACK(run_camera_switch_action));
         create_simple_action(
                 app, "open-settings", G_CALLBACK(run_open_settings_action));
@@ -1197,6 +1288,21 @@ activate(GtkApplication *app, gpointer data)
         create_simple_action(app, "about", G_CALLBACK(run_about_action));
         create_simple_action(app, "quit", G_CALLBACK(run_quit_action));
 
+        // Toggled by the button, and reset when the recording ends by itself
+        record_action = g_simple_action_new_stateful(
+                "record", NULL, g_variant_new_boolean(false));
+        g_signal_connect(
+                record_action, "change-state", G_CALLBACK(run_record_action), app);
+        g_action_map_add_action(G_ACTION_MAP(app), G_ACTION(record_action));
+
+        timelapse_action = g_simple_action_new_stateful(
+                "timelapse", NULL, g_variant_new_boolean(false));
+        g_signal_connect(timelapse_action,
+                         "change-state",
+                         G_CALLBACK(run_timelapse_action),
+                         app);
+        g_action_map_add_action(G_ACTION_MAP(app), G_ACTION(timelapse_action));
+
         // Setup shortcuts
         const char *capture_accels[] = { "space", NULL };
         gtk_application_set_accels_for_action(app, "app.capture", capture_accels);
@@ -1230,11 +1336,32 @@ activate(GtkApplication *app, gpointer data)
                         setting_dng_button,
                         "active",
                         G_SETTINGS_BIND_DEFAULT);
+        g_settings_bind(settings,
+                        "record-raw",
+                        setting_record_raw_button,
+                        "active",
+                        G_SETTINGS_BIND_DEFAULT);
+        g_settings_bind(settings,
+                        "timelapse-interval",
+                        setting_timelapse_spin,
+                        "value",
+                        G_SETTINGS_BIND_DEFAULT);
         g_settings_bind(settings,
                         "postprocessor",
                         setting_postprocessor_combo,
                         "active-id",
                         G_SETTINGS_BIND_DEFAULT);
+        g_settings_bind(settings,
+                        "preview-demosaic",
+                        setting_demosaic_combo,
+                        "active-id",
+                        G_SETTINGS_BIND_DEFAULT);
+
+        demosaic = g_settings_get_enum(settings, "preview-demosaic");
+        g_signal_connect(settings,
+                         "changed::preview-demosaic",
+                         G_CALLBACK(on_demosaic_changed),
+                         NULL);
 
 #ifdef GDK_WINDOWING_WAYLAND
         // Listen for Wayland rotation
@@ -1290,10 +1417,20 @@ activate(GtkApplication *app, gpointer data)
                 g_application_get_dbus_connection(G_APPLICATION(app));
         mp_flash_gtk_init(conn);
 
-        mp_io_pipeline_start();
-
         gtk_application_add_window(app, GTK_WINDOW(window));
         gtk_widget_show(window);
+
+        mp_startup_trace("Window shown");
+}
+
+static GThread *config_thread = NULL;
+
+static gpointer
+load_config_thread(gpointer data)
+{
+        bool result = mp_load_config();
+        mp_startup_trace("Config loaded");
+        return GINT_TO_POINTER(result);
 }
 
 static void
@@ -1301,6 +1438,16 @@ startup(GApplication *app, gpointer data)
 {
         g_autoptr(GError) err = NULL;
 
+        mp_startup_trace("GTK initialized");
+
+        // The config was parsed while GTK was initializing
+        if (!GPOINTER_TO_INT(g_thread_join(config_thread)))
+                exit(EXIT_FAILURE);
+
+        // Start discovering and initializing the cameras now, so it happens
+        // while the UI is being built
+        mp_io_pipeline_start();
+
         if (lfb_init(APP_ID, &err))
                 capture_event = lfb_event_new("camera-shutter");
         else
@@ -1339,11 +1486,12 @@ main(int argc, char *argv[])
         }
 #endif
 
-        if (!mp_load_config())
-                return 1;
+        mp_startup_trace_init();
 
         setenv("LC_NUMERIC", "C", 1);
 
+        config_thread = g_thread_new("config", load_config_thread, NULL);
+
         GtkApplication *app = gtk_application_new(APP_ID, 0);
 
         g_signal_connect(app, "startup", G_CALLBACK(startup), NULL);
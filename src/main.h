@@ -26,7 +26,11 @@ struct mp_main_state {
 void mp_main_update_state(const struct mp_main_state *state);
 
 void mp_main_set_preview(MPProcessPipelineBuffer *buffer);
+// Preview rendered without GL, already rotated for the display
+void mp_main_set_preview_texture(GdkTexture *texture);
 void mp_main_capture_completed(GdkTexture *thumb, const char *fname);
+// The recording ended, because it was stopped or the camera changed
+void mp_main_recording_stopped();
 
 void mp_main_set_zbar_result(MPZBarScanResult *result);
 
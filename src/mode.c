@@ -4,10 +4,11 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 static const char *pixel_format_names[MP_PIXEL_FMT_MAX] = {
         "unsupported", "BGGR8",   "GBRG8",   "GRBG8", "RGGB8", "BGGR10P",
-        "GBRG10P",     "GRBG10P", "RGGB10P", "UYVY",  "YUYV",
+        "GBRG10P",     "GRBG10P", "RGGB10P", "UYVY",  "YUYV",  "MJPEG",
 };
 
 const char *
@@ -40,6 +41,7 @@ static const uint32_t pixel_format_v4l_pixel_formats[MP_PIXEL_FMT_MAX] = {
         V4L2_PIX_FMT_SRGGB10P,
         V4L2_PIX_FMT_UYVY,
         V4L2_PIX_FMT_YUYV,
+        V4L2_PIX_FMT_MJPEG,
 };
 
 uint32_t
@@ -72,6 +74,7 @@ static const uint32_t pixel_format_v4l_bus_codes[MP_PIXEL_FMT_MAX] = {
         MEDIA_BUS_FMT_SRGGB10_1X10,
         MEDIA_BUS_FMT_UYVY8_2X8,
         MEDIA_BUS_FMT_YUYV8_2X8,
+        MEDIA_BUS_FMT_JPEG_1X8,
 };
 
 uint32_t
@@ -110,6 +113,9 @@ mp_pixel_format_bits_per_pixel(MPPixelFormat pixel_format)
         case MP_PIXEL_FMT_UYVY:
         case MP_PIXEL_FMT_YUYV:
                 return 16;
+        case MP_PIXEL_FMT_MJPEG:
+                // Compressed, the size of every frame is different
+                return 0;
         default:
                 return 0;
         }
@@ -126,6 +132,7 @@ mp_pixel_format_pixel_depth(MPPixelFormat pixel_format)
         case MP_PIXEL_FMT_RGGB8:
         case MP_PIXEL_FMT_UYVY:
         case MP_PIXEL_FMT_YUYV:
+        case MP_PIXEL_FMT_MJPEG:
                 return 8;
         case MP_PIXEL_FMT_GBRG10P:
         case MP_PIXEL_FMT_GRBG10P:
@@ -266,6 +273,102 @@ mp_pixel_format_height_to_colors(MPPixelFormat pixel_format, uint32_t height)
         }
 }
 
+// Interleaved 4:2:2, every pair of pixels shares its chroma samples
+bool
+mp_pixel_format_is_yuv(MPPixelFormat pixel_format)
+{
+        return pixel_format == MP_PIXEL_FMT_UYVY ||
+               pixel_format == MP_PIXEL_FMT_YUYV;
+}
+
+// Format with the same CFA but 8 bits per sample
+MPPixelFormat
+mp_pixel_format_to_8bit(MPPixelFormat pixel_format)
+{
+        g_return_val_if_fail(pixel_format < MP_PIXEL_FMT_MAX, 0);
+        switch (pixel_format) {
+        case MP_PIXEL_FMT_BGGR10P:
+                return MP_PIXEL_FMT_BGGR8;
+        case MP_PIXEL_FMT_GBRG10P:
+                return MP_PIXEL_FMT_GBRG8;
+        case MP_PIXEL_FMT_GRBG10P:
+                return MP_PIXEL_FMT_GRBG8;
+        case MP_PIXEL_FMT_RGGB10P:
+                return MP_PIXEL_FMT_RGGB8;
+        default:
+                return pixel_format;
+        }
+}
+
+// Keep the most significant byte of every sample of a packed 10-bit image,
+// the rows of dst are laid out as the V4L2 buffers of the 8-bit format
+void
+mp_pixel_format_unpack_to_8bit(MPPixelFormat pixel_format,
+                               uint32_t width,
+                               uint32_t height,
+                               const uint8_t *src,
+                               uint8_t *dst)
+{
+        MPPixelFormat dst_format = mp_pixel_format_to_8bit(pixel_format);
+        size_t src_stride = mp_pixel_format_width_to_bytes(pixel_format, width) +
+                            mp_pixel_format_width_to_padding(pixel_format, width);
+        size_t dst_stride = mp_pixel_format_width_to_bytes(dst_format, width) +
+                            mp_pixel_format_width_to_padding(dst_format, width);
+
+        // Groups of 4 samples are stored as their high bytes followed by one
+        // byte with the low bits
+        for (uint32_t y = 0; y < height; ++y) {
+                const uint8_t *src_row = src + y * src_stride;
+                uint8_t *dst_row = dst + y * dst_stride;
+
+                for (uint32_t x = 0; x < width / 4; ++x) {
+                        memcpy(dst_row + x * 4, src_row + x * 5, 4);
+                }
+        }
+}
+
+// Strip the row padding and reorder 10-bit samples from the MIPI layout to
+// the sequential big endian bit order of DNG
+void
+mp_pixel_format_pack_for_dng(MPPixelFormat pixel_format,
+                             uint32_t width,
+                             uint32_t height,
+                             const uint8_t *src,
+                             uint8_t *dst)
+{
+        size_t row_length = mp_pixel_format_width_to_bytes(pixel_format, width);
+        size_t src_stride =
+                row_length + mp_pixel_format_width_to_padding(pixel_format, width);
+        bool is_packed = mp_pixel_format_bits_per_pixel(pixel_format) == 10;
+
+        for (uint32_t y = 0; y < height; ++y) {
+                const uint8_t *src_row = src + y * src_stride;
+                uint8_t *dst_row = dst + y * row_length;
+
+                if (!is_packed) {
+                        memcpy(dst_row, src_row, row_length);
+                        continue;
+                }
+
+                // 11111111 22222222 33333333 44444444 11223344 becomes
+                // 11111111 11222222 22223333 33333344 44444444
+                for (size_t x = 0; x < row_length; x += 5) {
+                        const uint8_t *in = src_row + x;
+                        uint16_t p0 = (in[0] << 2) | (in[4] >> 6);
+                        uint16_t p1 = (in[1] << 2) | (in[4] >> 4 & 0x03);
+                        uint16_t p2 = (in[2] << 2) | (in[4] >> 2 & 0x03);
+                        uint16_t p3 = (in[3] << 2) | (in[4] & 0x03);
+
+                        uint8_t *out = dst_row + x;
+                        out[0] = p0 >> 2;
+                        out[1] = (p0 << 6 & 0xff) | (p1 >> 4);
+                        out[2] = (p1 << 4 & 0xff) | (p2 >> 6);
+                        out[3] = (p2 << 2 & 0xff) | (p3 >> 8);
+                        out[4] = p3 & 0xff;
+                }
+        }
+}
+
 bool
 mp_mode_is_equivalent(const MPMode *m1, const MPMode *m2)
 {
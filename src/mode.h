@@ -16,10 +16,19 @@ typedef enum {
         MP_PIXEL_FMT_RGGB10P,
         MP_PIXEL_FMT_UYVY,
         MP_PIXEL_FMT_YUYV,
+        MP_PIXEL_FMT_MJPEG,
 
         MP_PIXEL_FMT_MAX,
 } MPPixelFormat;
 
+// How the preview reconstructs the colors from the CFA
+typedef enum {
+        // Half resolution, one output pixel per 2x2 cell
+        MP_DEMOSAIC_FAST,
+        MP_DEMOSAIC_BILINEAR,
+        MP_DEMOSAIC_MALVAR,
+} MPDemosaic;
+
 const char *mp_pixel_format_to_str(MPPixelFormat pixel_format);
 MPPixelFormat mp_pixel_format_from_str(const char *str);
 
@@ -39,6 +48,20 @@ uint32_t mp_pixel_format_width_to_colors(MPPixelFormat pixel_format, uint32_t wi
 uint32_t mp_pixel_format_height_to_colors(MPPixelFormat pixel_format,
                                           uint32_t height);
 
+bool mp_pixel_format_is_yuv(MPPixelFormat pixel_format);
+
+MPPixelFormat mp_pixel_format_to_8bit(MPPixelFormat pixel_format);
+void mp_pixel_format_unpack_to_8bit(MPPixelFormat pixel_format,
+                                    uint32_t width,
+                                    uint32_t height,
+                                    const uint8_t *src,
+                                    uint8_t *dst);
+void mp_pixel_format_pack_for_dng(MPPixelFormat pixel_format,
+                                  uint32_t width,
+                                  uint32_t height,
+                                  const uint8_t *src,
+                                  uint8_t *dst);
+
 typedef struct {
         MPPixelFormat pixel_format;
 
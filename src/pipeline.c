@@ -142,3 +142,51 @@ mp_pipeline_add_capture_source(MPPipeline *pipeline,
         g_source_attach(video_source, pipeline->main_context);
         return video_source;
 }
+
+struct event_source_args {
+        MPCamera *camera;
+        void (*callback)(const struct v4l2_event *, void *);
+        void *user_data;
+};
+
+static bool
+on_event(int fd, GIOCondition condition, struct event_source_args *args)
+{
+        struct v4l2_event event;
+        while (mp_camera_dequeue_event(args->camera, &event)) {
+                args->callback(&event, args->user_data);
+        }
+        return true;
+}
+
+// Not thread safe
+GSource *
+mp_pipeline_add_event_source(MPPipeline *pipeline,
+                             MPCamera *camera,
+                             void (*callback)(const struct v4l2_event *, void *),
+                             void *user_data)
+{
+        int control_fd = mp_camera_get_control_fd(camera);
+        GSource *event_source = g_unix_fd_source_new(control_fd, G_IO_PRI);
+
+        struct event_source_args *args = malloc(sizeof(struct event_source_args));
+        args->camera = camera;
+        args->callback = callback;
+        args->user_data = user_data;
+        g_source_set_callback(event_source, (GSourceFunc)on_event, args, free);
+        g_source_attach(event_source, pipeline->main_context);
+        return event_source;
+}
+
+// Not thread safe
+GSource *
+mp_pipeline_add_timeout(MPPipeline *pipeline,
+                        guint interval_ms,
+                        GSourceFunc callback,
+                        void *user_data)
+{
+        GSource *timeout_source = g_timeout_source_new(interval_ms);
+        g_source_set_callback(timeout_source, callback, user_data, NULL);
+        g_source_attach(timeout_source, pipeline->main_context);
+        return timeout_source;
+}
@@ -21,3 +21,15 @@ GSource *mp_pipeline_add_capture_source(MPPipeline *pipeline,
                                         MPCamera *camera,
                                         void (*callback)(MPBuffer, void *),
                                         void *user_data);
+// Calls callback for every event pending on the control fd of the camera
+GSource *mp_pipeline_add_event_source(MPPipeline *pipeline,
+                                      MPCamera *camera,
+                                      void (*callback)(const struct v4l2_event *,
+                                                       void *),
+                                      void *user_data);
+// Calls callback every interval_ms on the pipeline thread for as long as it
+// returns true. Not thread safe.
+GSource *mp_pipeline_add_timeout(MPPipeline *pipeline,
+                                 guint interval_ms,
+                                 GSourceFunc callback,
+                                 void *user_data);
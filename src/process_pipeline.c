@@ -1,12 +1,19 @@
 #include "process_pipeline.h"
 
 #include "config.h"
+#include "cpu_debayer.h"
+#include "frame_stats.h"
 #include "gles2_debayer.h"
 #include "io_pipeline.h"
+#include "jpeg.h"
 #include "main.h"
 #include "pipeline.h"
+#include "raw_recorder.h"
+#include "startup_trace.h"
+#include "video_recorder.h"
 #include "zbar_pipeline.h"
 #include <assert.h>
+#include <errno.h>
 #include <gtk/gtk.h>
 #include <math.h>
 #include <tiffio.h>
@@ -16,6 +23,10 @@
 
 #define TIFFTAG_FORWARDMATRIX1 50964
 
+// Cameras that only output YUV are saved as JPEG instead of DNG, MJPEG frames
+// are saved as they are
+#define JPEG_QUALITY 92
+
 static const float colormatrix_srgb[] = { 3.2409, -1.5373, -0.4986, -0.9692, 1.8759,
                                           0.0415, 0.0556,  -0.2039, 1.0569 };
 
@@ -40,6 +51,8 @@ static int preview_height;
 
 static int device_rotation;
 
+static MPDemosaic demosaic;
+
 static int output_buffer_width = -1;
 static int output_buffer_height = -1;
 
@@ -52,8 +65,46 @@ static int exposure;
 
 static bool flash_enabled;
 
+static bool measure_sharpness;
+static float focus_x;
+static float focus_y;
+
 static char capture_fname[255];
 
+// While recording, the preview frames are encoded as well. They are rendered
+// at the resolution of the mode then instead of the screen, up to 720p.
+#define MAX_RECORDING_WIDTH 1280
+#define MAX_RECORDING_HEIGHT 720
+
+static MPVideoRecorder *video_recorder = NULL;
+static bool is_recording = false;
+static char video_fname[255];
+
+// Raw recordings write the sensor frames as they are, the preview is left
+// alone
+static MPRawRecorder *raw_recorder = NULL;
+static bool record_raw = false;
+
+static void stop_recording();
+
+// The sharpest frame of the burst is swapped with the one postprocessing
+// uses, scored on a separate thread while the DNG is being written
+#define MAX_BURST_LENGTH 16
+#define PRIMARY_FRAME 1
+
+static float burst_sharpness[MAX_BURST_LENGTH];
+
+static GThreadPool *sharpness_pool = NULL;
+static GMutex sharpness_mutex;
+static GCond sharpness_cond;
+static bool is_scoring = false;
+
+struct sharpness_task {
+        const uint8_t *image;
+        size_t size;
+        int index;
+};
+
 static GSettings *settings;
 
 static void
@@ -202,6 +253,21 @@ mp_process_pipeline_stop()
 {
         mp_pipeline_free(pipeline);
 
+        // Finish the file, the process thread is gone by now
+        if (video_recorder) {
+                mp_video_recorder_stop(video_recorder);
+                video_recorder = NULL;
+        }
+        if (raw_recorder) {
+                mp_raw_recorder_stop(raw_recorder);
+                raw_recorder = NULL;
+        }
+
+        if (sharpness_pool) {
+                g_thread_pool_free(sharpness_pool, false, true);
+                sharpness_pool = NULL;
+        }
+
         mp_zbar_pipeline_stop();
 }
 
@@ -238,51 +304,26 @@ mp_process_pipeline_buffer_get_texture_id(MPProcessPipelineBuffer *buf)
         return buf->texture_id;
 }
 
-static void
-repack_image_sequencial(const uint8_t *src_buf, uint8_t *dst_buf, MPMode *mode)
-{
-        uint16_t pixels[4];
-        uint32_t row_length =
-                mp_pixel_format_width_to_bytes(mode->pixel_format, mode->width);
-        uint32_t padding_bytes =
-                mp_pixel_format_width_to_padding(mode->pixel_format, mode->width);
-        size_t si = 0;
-
-        // Image data must be 10-bit packed
-        assert(mp_pixel_format_bits_per_pixel(mode->pixel_format) == 10);
-
-        /*
-         * Repack 40 bits stored in sensor format into sequencial format
-         *
-         * src_buf: 11111111 22222222 33333333 44444444 11223344 ...
-         * dst_buf: 11111111 11222222 22223333 33333344 44444444 ...
-         */
-        for (size_t i = 0; i < row_length * mode->height; i += 5) {
-                // Skip padding bytes in source buffer
-                if (i && i % row_length == 0)
-                        si += padding_bytes;
-
-                /* Extract pixels from packed sensor format */
-                pixels[0] = (src_buf[si] << 2) | (src_buf[si + 4] >> 6);
-                pixels[1] = (src_buf[si + 1] << 2) | (src_buf[si + 4] >> 4 & 0x03);
-                pixels[2] = (src_buf[si + 2] << 2) | (src_buf[si + 4] >> 2 & 0x03);
-                pixels[3] = (src_buf[si + 3] << 2) | (src_buf[si + 4] & 0x03);
-
-                /* Pack pixels into sequencial format */
-                dst_buf[i] = (pixels[0] >> 2 & 0xff);
-                dst_buf[i + 1] = (pixels[0] << 6 & 0xff) | (pixels[1] >> 4 & 0x3f);
-                dst_buf[i + 2] = (pixels[1] << 4 & 0xff) | (pixels[2] >> 6 & 0x0f);
-                dst_buf[i + 3] = (pixels[2] << 2 & 0xff) | (pixels[3] >> 8 & 0x03);
-                dst_buf[i + 4] = (pixels[3] & 0xff);
-
-                si += 5;
-        }
-}
-
 static GLES2Debayer *gles2_debayer = NULL;
+static MPPixelFormat debayer_format = MP_PIXEL_FMT_UNSUPPORTED;
+static MPDemosaic debayer_demosaic;
 
 static GdkGLContext *context;
 
+// Used instead of the GLES2 debayer when there is no GL context
+static CPUDebayer *cpu_debayer = NULL;
+
+// 10-bit frames unpacked to 8-bit for the preview
+static uint8_t *unpacked_image = NULL;
+static size_t unpacked_size = 0;
+
+// The frames as the preview sees them. 10-bit is unpacked to 8-bit, MJPEG is
+// decoded to YUYV and scaled down when the preview is much smaller.
+static MPPixelFormat preview_image_format;
+static uint32_t preview_image_width;
+static uint32_t preview_image_height;
+static int decode_scale = 1;
+
 // #define RENDERDOC
 
 #ifdef RENDERDOC
@@ -290,6 +331,21 @@ static GdkGLContext *context;
 extern RENDERDOC_API_1_1_2 *rdoc_api;
 #endif
 
+static void
+create_debayer(MPPixelFormat format, MPDemosaic demosaic)
+{
+        if (gles2_debayer)
+                gles2_debayer_free(gles2_debayer);
+
+        gles2_debayer = gles2_debayer_new(format, demosaic);
+        check_gl();
+
+        gles2_debayer_use(gles2_debayer);
+
+        debayer_format = format;
+        debayer_demosaic = demosaic;
+}
+
 static void
 init_gl(MPPipeline *pipeline, GdkSurface **surface)
 {
@@ -297,6 +353,7 @@ init_gl(MPPipeline *pipeline, GdkSurface **surface)
         context = gdk_surface_create_gl_context(*surface, &error);
         if (context == NULL) {
                 printf("Failed to initialize OpenGL context: %s\n", error->message);
+                printf("Falling back to debayering on the CPU\n");
                 g_clear_error(&error);
                 return;
         }
@@ -313,6 +370,7 @@ init_gl(MPPipeline *pipeline, GdkSurface **surface)
         gdk_gl_context_realize(context, &error);
         if (error != NULL) {
                 printf("Failed to create OpenGL context: %s\n", error->message);
+                printf("Falling back to debayering on the CPU\n");
                 g_clear_object(&context);
                 g_clear_error(&error);
                 return;
@@ -349,6 +407,26 @@ init_gl(MPPipeline *pipeline, GdkSurface **surface)
                is_es ? "OpenGL ES" : "OpenGL",
                major,
                minor);
+        mp_startup_trace("GL context created");
+
+        // Compile the shader for the default camera now, while the main thread
+        // is still busy with its own shaders and the camera is being set up
+        const struct mp_camera_config *default_camera = mp_get_camera_config(0);
+        MPPixelFormat default_format =
+                default_camera ? default_camera->preview_mode.pixel_format :
+                                 MP_PIXEL_FMT_UNSUPPORTED;
+
+        // MJPEG reaches the preview decoded
+        if (default_format == MP_PIXEL_FMT_MJPEG) {
+                default_format = MP_PIXEL_FMT_YUYV;
+        }
+
+        // Unless the format is picked once the sensor is known
+        if (default_format != MP_PIXEL_FMT_UNSUPPORTED) {
+                create_debayer(mp_pixel_format_to_8bit(default_format),
+                               g_settings_get_enum(settings, "preview-demosaic"));
+                mp_startup_trace("Debayer shader loaded");
+        }
 }
 
 void
@@ -361,8 +439,92 @@ mp_process_pipeline_init_gl(GdkSurface *surface)
 }
 
 static GdkTexture *
-process_image_for_preview(const uint8_t *image)
+process_image_for_preview_cpu(const uint8_t *image, int64_t timestamp)
 {
+        if (!cpu_debayer) {
+                return NULL;
+        }
+
+#ifdef PROFILE_DEBAYER
+        gint64 t1 = g_get_monotonic_time();
+#endif
+
+        GdkTexture *texture = cpu_debayer_process(cpu_debayer, image);
+
+#ifdef PROFILE_DEBAYER
+        gint64 t2 = g_get_monotonic_time();
+        printf("process_image_for_preview_cpu %fms (%dx%d)\n",
+               (t2 - t1) / 1000.0,
+               output_buffer_width,
+               output_buffer_height);
+#endif
+
+        if (video_recorder) {
+                uint8_t *frame = mp_video_recorder_get_frame(video_recorder);
+                if (frame) {
+                        gdk_texture_download(
+                                texture, frame, output_buffer_width * 4);
+                        mp_video_recorder_push_frame(
+                                video_recorder, frame, timestamp);
+                }
+        }
+
+        // The preview is already a texture, it doubles as the thumbnail
+        GdkTexture *thumb = NULL;
+        if (captures_remaining == 1) {
+                thumb = g_object_ref(texture);
+        }
+
+        mp_main_set_preview_texture(texture);
+
+        return thumb;
+}
+
+// The preview only uses the 8 most significant bits of each sample. Unpacking
+// 10-bit frames up front is cheaper than having the shader skip every fifth
+// byte for each of its samples, and makes the texture upload smaller.
+static const uint8_t *
+get_preview_image(const uint8_t *image)
+{
+        MPPixelFormat format = mp_pixel_format_to_8bit(mode.pixel_format);
+        if (format == mode.pixel_format) {
+                return image;
+        }
+
+        size_t size = (mp_pixel_format_width_to_bytes(format, mode.width) +
+                       mp_pixel_format_width_to_padding(format, mode.width)) *
+                      mode.height;
+        if (size != unpacked_size) {
+                unpacked_image = g_realloc(unpacked_image, size);
+                unpacked_size = size;
+        }
+
+        mp_pixel_format_unpack_to_8bit(
+                mode.pixel_format, mode.width, mode.height, image, unpacked_image);
+        return unpacked_image;
+}
+
+static GdkTexture *
+process_image_for_preview(const uint8_t *image, int64_t timestamp)
+{
+#ifdef PROFILE_DEBAYER
+        gint64 t0 = g_get_monotonic_time();
+#endif
+
+        image = get_preview_image(image);
+
+#ifdef PROFILE_DEBAYER
+        if (image == unpacked_image) {
+                printf("unpack to 8-bit %fms (%s)\n",
+                       (g_get_monotonic_time() - t0) / 1000.0,
+                       mp_pixel_format_to_str(mode.pixel_format));
+        }
+#endif
+
+        if (!context) {
+                return process_image_for_preview_cpu(image, timestamp);
+        }
+
 #ifdef PROFILE_DEBAYER
         clock_t t1 = clock();
 #endif
@@ -394,15 +556,21 @@ process_image_for_preview(const uint8_t *image)
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        uint32_t stride = mp_pixel_format_width_to_bytes(preview_image_format,
+                                                         preview_image_width) +
+                          mp_pixel_format_width_to_padding(preview_image_format,
+                                                           preview_image_width);
+        // YUV is uploaded as is, with a pair of pixels in every RGBA texel
+        GLenum texture_format = mp_pixel_format_is_yuv(preview_image_format) ?
+                                        GL_RGBA :
+                                        GL_LUMINANCE;
         glTexImage2D(GL_TEXTURE_2D,
                      0,
-                     GL_LUMINANCE,
-                     mp_pixel_format_width_to_bytes(mode.pixel_format, mode.width) +
-                             mp_pixel_format_width_to_padding(mode.pixel_format,
-                                                              mode.width),
-                     mode.height,
+                     texture_format,
+                     texture_format == GL_RGBA ? stride / 4 : stride,
+                     preview_image_height,
                      0,
-                     GL_LUMINANCE,
+                     texture_format,
                      GL_UNSIGNED_BYTE,
                      image);
         check_gl();
@@ -415,10 +583,36 @@ process_image_for_preview(const uint8_t *image)
 
         glDeleteTextures(1, &input_texture);
 
+        // Read back from the framebuffer the debayer rendered to, upside down
+        if (video_recorder) {
+                uint8_t *frame = mp_video_recorder_get_frame(video_recorder);
+                if (frame) {
+                        glReadPixels(0,
+                                     0,
+                                     output_buffer_width,
+                                     output_buffer_height,
+                                     GL_RGBA,
+                                     GL_UNSIGNED_BYTE,
+                                     frame);
+                        check_gl();
+                        mp_video_recorder_push_frame(
+                                video_recorder, frame, timestamp);
+                }
+        }
+
+        static bool is_first_frame = true;
+        if (is_first_frame) {
+                mp_startup_trace("First frame debayered");
+                is_first_frame = false;
+        }
+
 #ifdef PROFILE_DEBAYER
         clock_t t2 = clock();
-        printf("process_image_for_preview %fms\n",
-               (float)(t2 - t1) / CLOCKS_PER_SEC * 1000);
+        printf("process_image_for_preview %fms (%dx%d, demosaic %d)\n",
+               (float)(t2 - t1) / CLOCKS_PER_SEC * 1000,
+               output_buffer_width,
+               output_buffer_height,
+               demosaic);
 #endif
 
 #ifdef RENDERDOC
@@ -473,8 +667,62 @@ process_image_for_preview(const uint8_t *image)
         return thumb;
 }
 
+static uint16_t
+get_orientation()
+{
+        if (camera_rotation == 0) {
+                return camera->mirrored ? ORIENTATION_TOPRIGHT :
+                                          ORIENTATION_TOPLEFT;
+        } else if (camera_rotation == 90) {
+                return camera->mirrored ? ORIENTATION_RIGHTBOT :
+                                          ORIENTATION_LEFTBOT;
+        } else if (camera_rotation == 180) {
+                return camera->mirrored ? ORIENTATION_BOTLEFT :
+                                          ORIENTATION_BOTRIGHT;
+        } else {
+                return camera->mirrored ? ORIENTATION_LEFTTOP :
+                                          ORIENTATION_RIGHTTOP;
+        }
+}
+
+static float
+get_exposure_time()
+{
+        return (mode.frame_interval.numerator /
+                (float)mode.frame_interval.denominator) /
+               ((float)mode.height / (float)exposure);
+}
+
+static uint16_t
+get_iso()
+{
+        if (!camera->iso_min || !camera->iso_max) {
+                return 0;
+        }
+        return remap(gain - 1, 0, gain_max, camera->iso_min, camera->iso_max);
+}
+
+static int
+get_whitelevel()
+{
+        if (camera->whitelevel) {
+                return camera->whitelevel;
+        }
+        return (1 << mp_pixel_format_pixel_depth(mode.pixel_format)) - 1;
+}
+
+static const char *
+get_capture_extension()
+{
+        if (mp_pixel_format_is_yuv(mode.pixel_format) ||
+            mode.pixel_format == MP_PIXEL_FMT_MJPEG) {
+                return "jpg";
+        }
+        return "dng";
+}
+
 static void
-process_image_for_capture(const uint8_t *image, int count)
+process_image_for_capture_jpeg(const uint8_t *image, size_t size, int count)
 {
         time_t rawtime;
         time(&rawtime);
@@ -483,6 +731,50 @@ process_image_for_capture(const uint8_t *image, int count)
         char datetime[20] = { 0 };
         strftime(datetime, 20, "%Y:%m:%d %H:%M:%S", &tim);
 
+        char fname[255];
+        sprintf(fname, "%s/%d.jpg", burst_dir, count);
+        printf("Writing frame to %s\n", fname);
+
+        MPJpegMetadata metadata = {
+                .make = mp_get_device_make(),
+                .model = mp_get_device_model(),
+                .datetime = datetime,
+                .orientation = get_orientation(),
+        };
+
+        bool ok;
+        if (mode.pixel_format == MP_PIXEL_FMT_MJPEG) {
+                ok = mp_jpeg_write_mjpeg(fname, image, size, &metadata);
+        } else {
+                ok = mp_jpeg_write_yuv(fname,
+                                       image,
+                                       mode.pixel_format,
+                                       mode.width,
+                                       mode.height,
+                                       JPEG_QUALITY,
+                                       &metadata);
+        }
+        if (!ok) {
+                g_printerr("Could not write %s\n", fname);
+        }
+}
+
+static void
+process_image_for_capture(const uint8_t *image, size_t size, int count)
+{
+        if (mp_pixel_format_is_yuv(mode.pixel_format) ||
+            mode.pixel_format == MP_PIXEL_FMT_MJPEG) {
+                process_image_for_capture_jpeg(image, size, count);
+                return;
+        }
+
+        time_t rawtime;
+        time(&rawtime);
+        struct tm tim = *(localtime(&rawtime));
+
+        char datetime[20] = { 0 };
+        strftime(datetime, 20, "%Y:%m:%d %H:%M:%S", &tim);
+
         char fname[255];
         sprintf(fname, "%s/%d.dng", burst_dir, count);
 
@@ -500,21 +792,7 @@ process_image_for_capture(const uint8_t *image, int count)
         TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
         TIFFSetField(tif, TIFFTAG_MAKE, mp_get_device_make());
         TIFFSetField(tif, TIFFTAG_MODEL, mp_get_device_model());
-        uint16_t orientation;
-        if (camera_rotation == 0) {
-                orientation = camera->mirrored ? ORIENTATION_TOPRIGHT :
-                                                 ORIENTATION_TOPLEFT;
-        } else if (camera_rotation == 90) {
-                orientation = camera->mirrored ? ORIENTATION_RIGHTBOT :
-                                                 ORIENTATION_LEFTBOT;
-        } else if (camera_rotation == 180) {
-                orientation = camera->mirrored ? ORIENTATION_BOTLEFT :
-                                                 ORIENTATION_BOTRIGHT;
-        } else {
-                orientation = camera->mirrored ? ORIENTATION_LEFTTOP :
-                                                 ORIENTATION_RIGHTTOP;
-        }
-        TIFFSetField(tif, TIFFTAG_ORIENTATION, orientation);
+        TIFFSetField(tif, TIFFTAG_ORIENTATION, get_orientation());
         TIFFSetField(tif, TIFFTAG_DATETIME, datetime);
         TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 3);
         TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
@@ -574,11 +852,7 @@ process_image_for_capture(const uint8_t *image, int count)
                      mp_pixel_format_cfa_pattern(mode.pixel_format));
 #endif
         printf("TIFF version %d\n", TIFFLIB_VERSION);
-        int whitelevel = camera->whitelevel;
-        if (!whitelevel) {
-                whitelevel =
-                        (1 << mp_pixel_format_pixel_depth(mode.pixel_format)) - 1;
-        }
+        int whitelevel = get_whitelevel();
         TIFFSetField(tif, TIFFTAG_WHITELEVEL, 1, &whitelevel);
         if (camera->blacklevel) {
                 const float blacklevel = camera->blacklevel;
@@ -595,7 +869,11 @@ process_image_for_capture(const uint8_t *image, int count)
                                               mode.pixel_format, mode.width) *
                                       mode.height);
 
-                repack_image_sequencial(image, output_image, &mode);
+                mp_pixel_format_pack_for_dng(mode.pixel_format,
+                                             mode.width,
+                                             mode.height,
+                                             image,
+                                             output_image);
         }
 
         for (int row = 0; row < mode.height; row++) {
@@ -621,14 +899,9 @@ process_image_for_capture(const uint8_t *image, int count)
                 TIFFSetField(tif, EXIFTAG_EXPOSUREPROGRAM, 1);
         }
 
-        TIFFSetField(tif,
-                     EXIFTAG_EXPOSURETIME,
-                     (mode.frame_interval.numerator /
-                      (float)mode.frame_interval.denominator) /
-                             ((float)mode.height / (float)exposure));
-        if (camera->iso_min && camera->iso_max) {
-                uint16_t isospeed = remap(
-                        gain - 1, 0, gain_max, camera->iso_min, camera->iso_max);
+        TIFFSetField(tif, EXIFTAG_EXPOSURETIME, get_exposure_time());
+        uint16_t isospeed = get_iso();
+        if (isospeed) {
                 TIFFSetField(tif, EXIFTAG_ISOSPEEDRATINGS, 1, &isospeed);
         }
         if (!camera->has_flash) {
@@ -667,6 +940,122 @@ process_image_for_capture(const uint8_t *image, int count)
         TIFFClose(tif);
 }
 
+static void
+score_burst_frame(gpointer data, gpointer user_data)
+{
+        struct sharpness_task *task = data;
+
+        const uint8_t *image = task->image;
+        MPPixelFormat format = mode.pixel_format;
+        uint32_t width = mode.width;
+
+        // MJPEG frames are decoded here at full resolution, while the process
+        // pipeline saves the bitstream
+        uint8_t *decoded = NULL;
+        if (format == MP_PIXEL_FMT_MJPEG) {
+                format = MP_PIXEL_FMT_YUYV;
+                width = mode.width & ~1;
+                decoded = malloc(
+                        (mp_pixel_format_width_to_bytes(format, width) +
+                         mp_pixel_format_width_to_padding(format, width)) *
+                        mode.height);
+                if (!mp_jpeg_decode_yuv(task->image,
+                                        task->size,
+                                        1,
+                                        decoded,
+                                        width,
+                                        mode.height)) {
+                        format = MP_PIXEL_FMT_UNSUPPORTED;
+                }
+                image = decoded;
+        }
+
+        float sharpness = mp_frame_stats_compute_sharpness(
+                image, format, width, mode.height, 0.5f, 0.5f);
+        free(decoded);
+
+        g_mutex_lock(&sharpness_mutex);
+        burst_sharpness[task->index] = sharpness;
+        is_scoring = false;
+        g_cond_signal(&sharpness_cond);
+        g_mutex_unlock(&sharpness_mutex);
+
+        free(task);
+}
+
+static void
+start_scoring_frame(const uint8_t *image, size_t size, int index)
+{
+        if (index >= MAX_BURST_LENGTH) {
+                return;
+        }
+
+        if (!sharpness_pool) {
+                sharpness_pool = g_thread_pool_new(
+                        score_burst_frame, NULL, 1, false, NULL);
+        }
+
+        struct sharpness_task *task = malloc(sizeof(struct sharpness_task));
+        task->image = image;
+        task->size = size;
+        task->index = index;
+
+        g_mutex_lock(&sharpness_mutex);
+        is_scoring = true;
+        g_mutex_unlock(&sharpness_mutex);
+
+        g_thread_pool_push(sharpness_pool, task, NULL);
+}
+
+static void
+wait_for_scoring()
+{
+        g_mutex_lock(&sharpness_mutex);
+        while (is_scoring) {
+                g_cond_wait(&sharpness_cond, &sharpness_mutex);
+        }
+        g_mutex_unlock(&sharpness_mutex);
+}
+
+static void
+select_sharpest_frame()
+{
+        int num_frames = MIN(burst_length, MAX_BURST_LENGTH);
+        if (num_frames <= PRIMARY_FRAME) {
+                return;
+        }
+
+        int sharpest = PRIMARY_FRAME;
+        for (int i = 0; i < num_frames; ++i) {
+                if (burst_sharpness[i] > burst_sharpness[sharpest]) {
+                        sharpest = i;
+                }
+        }
+
+        printf("Sharpest frame of the burst is %d (%f, primary %f)\n",
+               sharpest,
+               burst_sharpness[sharpest],
+               burst_sharpness[PRIMARY_FRAME]);
+
+        if (sharpest == PRIMARY_FRAME) {
+                return;
+        }
+
+        char primary_fname[255];
+        char sharpest_fname[255];
+        char swap_fname[255];
+        const char *ext = get_capture_extension();
+        sprintf(primary_fname, "%s/%d.%s", burst_dir, PRIMARY_FRAME, ext);
+        sprintf(sharpest_fname, "%s/%d.%s", burst_dir, sharpest, ext);
+        sprintf(swap_fname, "%s/swap.%s", burst_dir, ext);
+
+        if (rename(primary_fname, swap_fname) != 0 ||
+            rename(sharpest_fname, primary_fname) != 0 ||
+            rename(swap_fname, sharpest_fname) != 0) {
+                g_printerr("Could not reorder the burst: %s\n", strerror(errno));
+        }
+}
+
 static void
 post_process_finished(GSubprocess *proc, GAsyncResult *res, GdkTexture *thumb)
 {
@@ -756,18 +1145,81 @@ process_image(MPPipeline *pipeline, const MPBuffer *buffer)
         clock_t t1 = clock();
 #endif
 
-        size_t size =
-                (mp_pixel_format_width_to_bytes(mode.pixel_format, mode.width) +
-                 mp_pixel_format_width_to_padding(mode.pixel_format, mode.width)) *
-                mode.height;
+        size_t size;
+        if (mode.pixel_format == MP_PIXEL_FMT_MJPEG) {
+                size = buffer->bytesused;
+        } else {
+                size = (mp_pixel_format_width_to_bytes(mode.pixel_format,
+                                                       mode.width) +
+                        mp_pixel_format_width_to_padding(mode.pixel_format,
+                                                         mode.width)) *
+                       mode.height;
+        }
         uint8_t *image = malloc(size);
         memcpy(image, buffer->data, size);
         mp_io_pipeline_release_buffer(buffer->index);
 
-        MPZBarImage *zbar_image = mp_zbar_image_new(image,
-                                                    mode.pixel_format,
-                                                    mode.width,
-                                                    mode.height,
+        if (raw_recorder) {
+                mp_raw_recorder_push_frame(raw_recorder, image, buffer->timestamp);
+
+                // Ends like a stopped recording, which also tells the UI
+                if (mp_raw_recorder_is_full(raw_recorder)) {
+                        g_printerr("Disk full, stopping the raw recording\n");
+                        stop_recording();
+                }
+        }
+
+        // MJPEG is decoded once for everything that looks at the pixels, the
+        // bitstream itself is what gets saved
+        uint8_t *frame = image;
+        MPPixelFormat frame_format = mode.pixel_format;
+        uint32_t frame_width = mode.width;
+        uint32_t frame_height = mode.height;
+        if (mode.pixel_format == MP_PIXEL_FMT_MJPEG) {
+                frame_format = preview_image_format;
+                frame_width = preview_image_width;
+                frame_height = preview_image_height;
+                size_t frame_size =
+                        (mp_pixel_format_width_to_bytes(frame_format,
+                                                        frame_width) +
+                         mp_pixel_format_width_to_padding(frame_format,
+                                                          frame_width)) *
+                        frame_height;
+                frame = malloc(frame_size);
+
+                // Show corrupt frames as grey instead of dropping them, so a
+                // burst always gets its thumbnail
+                if (!mp_jpeg_decode_yuv(image,
+                                        size,
+                                        decode_scale,
+                                        frame,
+                                        frame_width,
+                                        frame_height)) {
+                        memset(frame, 128, frame_size);
+                }
+        }
+
+        // Meter every frame for the software 3A loops in the io pipeline
+        MPFrameStats stats;
+        if (mp_frame_stats_compute(
+                    &stats, frame, frame_format, frame_width, frame_height)) {
+                if (measure_sharpness) {
+                        stats.sharpness =
+                                mp_frame_stats_compute_sharpness(frame,
+                                                                 frame_format,
+                                                                 frame_width,
+                                                                 frame_height,
+                                                                 focus_x,
+                                                                 focus_y);
+                }
+                stats.camera_index = camera->index;
+                mp_io_pipeline_set_frame_stats(&stats);
+        }
+
+        MPZBarImage *zbar_image = mp_zbar_image_new(frame,
+                                                    frame_format,
+                                                    frame_width,
+                                                    frame_height,
                                                     camera_rotation,
                                                     camera->mirrored);
         mp_zbar_pipeline_process_image(mp_zbar_image_ref(zbar_image));
@@ -776,16 +1228,19 @@ process_image(MPPipeline *pipeline, const MPBuffer *buffer)
         clock_t t2 = clock();
 #endif
 
-        GdkTexture *thumb = process_image_for_preview(image);
+        GdkTexture *thumb = process_image_for_preview(frame, buffer->timestamp);
 
         if (captures_remaining > 0) {
                 int count = burst_length - captures_remaining;
                 --captures_remaining;
 
-                process_image_for_capture(image, count);
+                start_scoring_frame(image, size, count);
+                process_image_for_capture(image, size, count);
+                wait_for_scoring();
 
                 if (captures_remaining == 0) {
                         assert(thumb);
+                        select_sharpest_frame();
                         process_capture_burst(thumb);
                 } else {
                         assert(!thumb);
@@ -794,7 +1249,11 @@ process_image(MPPipeline *pipeline, const MPBuffer *buffer)
                 assert(!thumb);
         }
 
+        // A decoded MJPEG frame is freed by zbar, the bitstream here
         mp_zbar_image_unref(zbar_image);
+        if (frame != image) {
+                free(image);
+        }
 
         ++frames_processed;
         if (captures_remaining == 0) {
@@ -842,6 +1301,7 @@ capture()
         strcpy(burst_dir, tempdir);
 
         captures_remaining = burst_length;
+        memset(burst_sharpness, 0, sizeof(burst_sharpness));
 }
 
 void
@@ -852,18 +1312,153 @@ mp_process_pipeline_capture()
         mp_pipeline_invoke(pipeline, capture, NULL, 0);
 }
 
+// Largest factor the image can be shrunk by without getting smaller than it
+// is shown on screen. Only factors that divide the image evenly are used, so
+// the skipped samples stay aligned to the CFA.
+static int
+get_output_skip(int width, int height)
+{
+        if (preview_width <= 0 || preview_height <= 0) {
+                return 1;
+        }
+
+        // The preview is shown rotated by the camera and device rotation
+        int shown_width = preview_width;
+        int shown_height = preview_height;
+        if (camera_rotation == 90 || camera_rotation == 270) {
+                shown_width = preview_height;
+                shown_height = preview_width;
+        }
+
+        float scale = MIN((float)shown_width / width, (float)shown_height / height);
+        int skip = MAX(1, (int)(1.0f / scale));
+        while (skip > 1 && (width % skip != 0 || height % skip != 0)) {
+                --skip;
+        }
+
+        return skip;
+}
+
+// Smallest factor that brings the image down to the recording size, again
+// only factors that divide the image evenly
+static int
+get_recording_skip(int width, int height)
+{
+        int skip = 1;
+        while (skip < 8 &&
+               (MAX(width, height) / skip > MAX_RECORDING_WIDTH ||
+                MIN(width, height) / skip > MAX_RECORDING_HEIGHT ||
+                width % skip != 0 || height % skip != 0)) {
+                ++skip;
+        }
+
+        return skip;
+}
+
+static void
+update_preview_image_format()
+{
+        if (mode.pixel_format != MP_PIXEL_FMT_MJPEG) {
+                decode_scale = 1;
+                preview_image_format = mp_pixel_format_to_8bit(mode.pixel_format);
+                preview_image_width = mode.width;
+                preview_image_height = mode.height;
+                return;
+        }
+
+        // libjpeg decodes at 1/2, 1/4 and 1/8 of the size for little more
+        // than the cost of the smaller image
+        int skip = get_output_skip(mode.width, mode.height);
+        decode_scale = 1;
+        while (decode_scale < 8 && decode_scale * 2 <= skip) {
+                decode_scale *= 2;
+        }
+
+        preview_image_format = MP_PIXEL_FMT_YUYV;
+        preview_image_width = (mode.width / decode_scale) & ~1;
+        preview_image_height = mode.height / decode_scale;
+}
+
 static void
-on_output_changed(bool format_changed)
+on_output_changed()
 {
-        output_buffer_width = mode.width / 2;
-        output_buffer_height = mode.height / 2;
+        update_preview_image_format();
+
+        // Recordings don't use the fast path to keep the resolution
+        bool is_recording_video = is_recording && !record_raw;
+        MPDemosaic output_demosaic = demosaic;
+        if (is_recording_video && demosaic == MP_DEMOSAIC_FAST) {
+                output_demosaic = MP_DEMOSAIC_BILINEAR;
+        }
+
+        // The fast path renders one pixel per CFA cell, YUV needs no demosaic
+        // and is always shown at full resolution on the GPU
+        bool is_yuv = mp_pixel_format_is_yuv(preview_image_format);
+        if ((output_demosaic == MP_DEMOSAIC_FAST && !is_yuv) || !context) {
+                output_buffer_width = preview_image_width / 2;
+                output_buffer_height = preview_image_height / 2;
+        } else {
+                output_buffer_width = preview_image_width;
+                output_buffer_height = preview_image_height;
+        }
+
+        // Don't debayer more pixels than fit on the screen
+        int skip = is_recording_video ?
+                           get_recording_skip(output_buffer_width,
+                                              output_buffer_height) :
+                           get_output_skip(output_buffer_width,
+                                           output_buffer_height);
+        output_buffer_width /= skip;
+        output_buffer_height /= skip;
+
+        // The encoder needs an even size
+        if (is_recording_video) {
+                output_buffer_width &= ~1;
+                output_buffer_height &= ~1;
+        }
 
-        if (camera->rotate != 0 || camera->rotate != 180) {
+        // Without GL the preview can't be rotated when drawing it, so the
+        // device rotation is applied here as well
+        int rotation = context ? camera->rotate : camera_rotation;
+        if (rotation == 90 || rotation == 270) {
                 int tmp = output_buffer_width;
                 output_buffer_width = output_buffer_height;
                 output_buffer_height = tmp;
         }
 
+        // 10-bit frames are debayered as 8-bit, scale the levels to match
+        MPPixelFormat format = preview_image_format;
+        int level_shift = mp_pixel_format_pixel_depth(mode.pixel_format) -
+                          mp_pixel_format_pixel_depth(format);
+        int blacklevel = camera->blacklevel >> level_shift;
+        int whitelevel = camera->whitelevel >> level_shift;
+
+        if (!context) {
+                if (debayer_format != format) {
+                        if (cpu_debayer)
+                                cpu_debayer_free(cpu_debayer);
+
+                        cpu_debayer = cpu_debayer_new(format);
+                        debayer_format = format;
+                }
+
+                if (cpu_debayer) {
+                        cpu_debayer_configure(cpu_debayer,
+                                              output_buffer_width,
+                                              output_buffer_height,
+                                              preview_image_width,
+                                              preview_image_height,
+                                              rotation,
+                                              camera->mirrored,
+                                              camera->previewmatrix[0] == 0 ?
+                                                      NULL :
+                                                      camera->previewmatrix,
+                                              blacklevel,
+                                              whitelevel);
+                }
+                return;
+        }
+
         for (size_t i = 0; i < NUM_BUFFERS; ++i) {
                 glBindTexture(GL_TEXTURE_2D, output_buffers[i].texture_id);
                 glTexImage2D(GL_TEXTURE_2D,
@@ -879,27 +1474,157 @@ on_output_changed(bool format_changed)
 
         glBindTexture(GL_TEXTURE_2D, 0);
 
-        // Create new gles2_debayer on format change
-        if (format_changed) {
-                if (gles2_debayer)
-                        gles2_debayer_free(gles2_debayer);
-
-                gles2_debayer = gles2_debayer_new(mode.pixel_format);
-                check_gl();
-
-                gles2_debayer_use(gles2_debayer);
+        // Create new gles2_debayer on format change, the one for the default
+        // camera was already compiled during startup
+        if (debayer_format != format || debayer_demosaic != output_demosaic) {
+                create_debayer(format, output_demosaic);
         }
 
         gles2_debayer_configure(
                 gles2_debayer,
                 output_buffer_width,
                 output_buffer_height,
-                mode.width,
-                mode.height,
+                preview_image_width,
+                preview_image_height,
                 camera->rotate,
                 camera->mirrored,
                 camera->previewmatrix[0] == 0 ? NULL : camera->previewmatrix,
-                camera->blacklevel);
+                blacklevel,
+                whitelevel);
+}
+
+static void
+stop_recording()
+{
+        if (video_recorder) {
+                mp_video_recorder_stop(video_recorder);
+                video_recorder = NULL;
+        }
+        if (raw_recorder) {
+                mp_raw_recorder_stop(raw_recorder);
+                raw_recorder = NULL;
+        }
+        is_recording = false;
+
+        mp_main_recording_stopped();
+}
+
+static void
+start_recording()
+{
+        time_t rawtime;
+        time(&rawtime);
+        struct tm tim = *(localtime(&rawtime));
+
+        char timestamp[30];
+        strftime(timestamp, 30, "%Y%m%d%H%M%S", &tim);
+
+        // Only sensors with a CFA have raw frames to record
+        record_raw = g_settings_get_boolean(settings, "record-raw") &&
+                     mp_pixel_format_bits_per_pixel(mode.pixel_format) != 0 &&
+                     !mp_pixel_format_is_yuv(mode.pixel_format);
+
+        // Raw recordings are a directory of DNG files
+        const char *prefix = record_raw ? "RAW" : "VID";
+        const char *extension = record_raw ? "" : ".mp4";
+        if (g_get_user_special_dir(G_USER_DIRECTORY_VIDEOS) != NULL) {
+                sprintf(video_fname,
+                        "%s/%s%s%s",
+                        g_get_user_special_dir(G_USER_DIRECTORY_VIDEOS),
+                        prefix,
+                        timestamp,
+                        extension);
+        } else if (getenv("XDG_VIDEOS_DIR") != NULL) {
+                sprintf(video_fname,
+                        "%s/%s%s%s",
+                        getenv("XDG_VIDEOS_DIR"),
+                        prefix,
+                        timestamp,
+                        extension);
+        } else {
+                sprintf(video_fname,
+                        "%s/Videos/%s%s%s",
+                        getenv("HOME"),
+                        prefix,
+                        timestamp,
+                        extension);
+        }
+
+        is_recording = true;
+
+        uint32_t fps = 30;
+        if (mode.frame_interval.numerator != 0) {
+                fps = mode.frame_interval.denominator /
+                      mode.frame_interval.numerator;
+        }
+
+        if (record_raw) {
+                char datetime[20] = { 0 };
+                strftime(datetime, 20, "%Y:%m:%d %H:%M:%S", &tim);
+
+                MPRawMetadata metadata = {
+                        .make = mp_get_device_make(),
+                        .model = mp_get_device_model(),
+                        .datetime = datetime,
+                        .orientation = get_orientation(),
+                        .color_matrix = camera->colormatrix[0] ?
+                                                camera->colormatrix :
+                                                colormatrix_srgb,
+                        .forward_matrix = camera->forwardmatrix[0] ?
+                                                  camera->forwardmatrix :
+                                                  NULL,
+                        .black_level = camera->blacklevel,
+                        .white_level = get_whitelevel(),
+                        .exposure_time = get_exposure_time(),
+                        .iso = get_iso(),
+                };
+                raw_recorder = mp_raw_recorder_new(video_fname,
+                                                   mode.pixel_format,
+                                                   mode.width,
+                                                   mode.height,
+                                                   fps,
+                                                   &metadata);
+                if (!raw_recorder) {
+                        stop_recording();
+                }
+                return;
+        }
+
+        on_output_changed();
+
+        // Without GL the frames come from a GdkTexture
+        video_recorder = mp_video_recorder_new(video_fname,
+                                               context ? "RGBx" : "BGRx",
+                                               output_buffer_width,
+                                               output_buffer_height,
+                                               fps,
+                                               context != NULL);
+        if (!video_recorder) {
+                stop_recording();
+                on_output_changed();
+        }
+}
+
+static void
+set_recording(MPPipeline *pipeline, const bool *enabled)
+{
+        if (*enabled == is_recording || !camera) {
+                return;
+        }
+
+        if (*enabled) {
+                start_recording();
+        } else {
+                stop_recording();
+                on_output_changed();
+        }
+}
+
+void
+mp_process_pipeline_set_recording(bool enabled)
+{
+        mp_pipeline_invoke(
+                pipeline, (MPPipelineCallback)set_recording, &enabled, sizeof(bool));
 }
 
 static int
@@ -912,12 +1637,16 @@ mod(int a, int b)
 static void
 update_state(MPPipeline *pipeline, const struct mp_process_pipeline_state *state)
 {
-        const bool output_changed = !mp_mode_is_equivalent(&mode, &state->mode) ||
+        // The size of a recording only depends on the camera, which also
+        // decides the mirroring, the mode and the rotation
+        const bool recording_changed =
+                camera != state->camera ||
+                !mp_mode_is_equivalent(&mode, &state->mode) ||
+                device_rotation != state->device_rotation;
+        const bool output_changed = recording_changed ||
                                     preview_width != state->preview_width ||
                                     preview_height != state->preview_height ||
-                                    device_rotation != state->device_rotation;
-
-        const bool format_changed = mode.pixel_format != state->mode.pixel_format;
+                                    demosaic != state->demosaic;
 
         camera = state->camera;
         mode = state->mode;
@@ -927,6 +1656,8 @@ update_state(MPPipeline *pipeline, const struct mp_process_pipeline_state *state
 
         device_rotation = state->device_rotation;
 
+        demosaic = state->demosaic;
+
         burst_length = state->burst_length;
 
         // gain_is_manual = state->gain_is_manual;
@@ -936,10 +1667,20 @@ update_state(MPPipeline *pipeline, const struct mp_process_pipeline_state *state
         exposure_is_manual = state->exposure_is_manual;
         exposure = state->exposure;
 
+        measure_sharpness = state->measure_sharpness;
+        focus_x = state->focus_x;
+        focus_y = state->focus_y;
+
         if (output_changed) {
+                // The size of a recording is fixed, resizing the preview or
+                // changing its demosaic leaves it alone
+                if (is_recording && recording_changed) {
+                        stop_recording();
+                }
+
                 camera_rotation = mod(camera->rotate - device_rotation, 360);
 
-                on_output_changed(format_changed);
+                on_output_changed();
         }
 
         struct mp_main_state main_state = {
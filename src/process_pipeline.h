@@ -17,6 +17,8 @@ struct mp_process_pipeline_state {
 
         int device_rotation;
 
+        MPDemosaic demosaic;
+
         bool gain_is_manual;
         int gain;
         int gain_max;
@@ -27,6 +29,12 @@ struct mp_process_pipeline_state {
         bool has_auto_focus_continuous;
         bool has_auto_focus_start;
 
+        // Center of the region to measure the sharpness of, as a fraction of
+        // the sensor image
+        bool measure_sharpness;
+        float focus_x;
+        float focus_y;
+
         bool flash_enabled;
 };
 
@@ -41,6 +49,8 @@ void mp_process_pipeline_init_gl(GdkSurface *window);
 
 void mp_process_pipeline_process_image(MPBuffer buffer);
 void mp_process_pipeline_capture();
+// Encode the preview frames to a video
+void mp_process_pipeline_set_recording(bool enabled);
 void mp_process_pipeline_update_state(const struct mp_process_pipeline_state *state);
 
 typedef struct _MPProcessPipelineBuffer MPProcessPipelineBuffer;
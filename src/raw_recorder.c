@@ -0,0 +1,612 @@
+#define _GNU_SOURCE
+#include "raw_recorder.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The header of every file is padded to a block, so the image data after it
+// can be written with O_DIRECT straight from the frame buffers
+#define BLOCK_SIZE 4096
+#define HEADER_SIZE BLOCK_SIZE
+
+// The IFD entries start at offset 8, the values that don't fit in them follow
+#define MAX_ENTRIES 40
+#define VALUES_OFFSET 512
+
+// Memory for frames waiting to be written. When all of them are in use new
+// frames are dropped, so a slow disk never stalls the process pipeline.
+#define QUEUE_MEMORY (64 * 1024 * 1024)
+#define MIN_FRAMES 2
+#define MAX_FRAMES 16
+
+#define STATS_INTERVAL 5000000
+
+#define TYPE_BYTE 1
+#define TYPE_ASCII 2
+#define TYPE_SHORT 3
+#define TYPE_LONG 4
+#define TYPE_RATIONAL 5
+#define TYPE_SRATIONAL 10
+
+#define TIFFTAG_CINEMADNG_TIMECODES 51043
+#define TIFFTAG_CINEMADNG_FRAMERATE 51044
+
+struct frame {
+        uint8_t *data;
+        int index;
+        bool in_use;
+};
+
+struct _MPRawRecorder {
+        char *dir;
+        MPPixelFormat pixel_format;
+        uint32_t width;
+        uint32_t height;
+        uint32_t fps;
+
+        // Size of the files, and the size written to them rounded up to a
+        // block. The padding is truncated after the write.
+        size_t file_size;
+        size_t write_size;
+        size_t timecode_offset;
+
+        int open_flags;
+
+        pthread_t thread;
+        GAsyncQueue *queue;
+
+        GMutex lock;
+        struct frame *frames;
+        int num_frames;
+
+        int64_t first_timestamp;
+        int64_t last_timestamp;
+
+        int frames_queued;
+        int frames_missed;
+        _Atomic(int) frames_dropped;
+        _Atomic(int) queue_depth_max;
+
+        // Set by the writer thread when the disk is full
+        _Atomic(bool) is_full;
+
+        // Only used by the writer thread
+        int frames_written;
+        int64_t bytes_written;
+        int64_t write_time;
+};
+
+// Pushed after the last frame to have the writer thread exit
+static struct frame end_of_stream;
+
+struct header {
+        uint8_t *data;
+        int num_entries;
+        size_t values_offset;
+};
+
+static void
+put_u16(uint8_t *p, uint16_t value)
+{
+        p[0] = value & 0xff;
+        p[1] = value >> 8;
+}
+
+static void
+put_u32(uint8_t *p, uint32_t value)
+{
+        p[0] = value & 0xff;
+        p[1] = (value >> 8) & 0xff;
+        p[2] = (value >> 16) & 0xff;
+        p[3] = value >> 24;
+}
+
+static size_t
+type_size(uint16_t type)
+{
+        switch (type) {
+        case TYPE_SHORT:
+                return 2;
+        case TYPE_LONG:
+                return 4;
+        case TYPE_RATIONAL:
+        case TYPE_SRATIONAL:
+                return 8;
+        default:
+                return 1;
+        }
+}
+
+// Entries have to be added in the order of their tags. Returns where the
+// value ended up in the header.
+static size_t
+add_entry(struct header *header,
+          uint16_t tag,
+          uint16_t type,
+          uint32_t count,
+          const uint8_t *value)
+{
+        assert(header->num_entries < MAX_ENTRIES);
+        uint8_t *entry = header->data + 10 + header->num_entries * 12;
+        ++header->num_entries;
+
+        put_u16(entry, tag);
+        put_u16(entry + 2, type);
+        put_u32(entry + 4, count);
+
+        size_t size = count * type_size(type);
+        size_t offset;
+        if (size <= 4) {
+                offset = entry + 8 - header->data;
+        } else {
+                // Values start on a word boundary
+                offset = header->values_offset;
+                header->values_offset = (offset + size + 1) & ~1;
+                assert(header->values_offset <= HEADER_SIZE);
+                put_u32(entry + 8, offset);
+        }
+
+        memcpy(header->data + offset, value, size);
+        return offset;
+}
+
+static void
+add_short(struct header *header, uint16_t tag, uint16_t value)
+{
+        uint8_t data[2];
+        put_u16(data, value);
+        add_entry(header, tag, TYPE_SHORT, 1, data);
+}
+
+static void
+add_long(struct header *header, uint16_t tag, uint32_t value)
+{
+        uint8_t data[4];
+        put_u32(data, value);
+        add_entry(header, tag, TYPE_LONG, 1, data);
+}
+
+static void
+add_ascii(struct header *header, uint16_t tag, const char *value)
+{
+        add_entry(
+                header, tag, TYPE_ASCII, strlen(value) + 1, (const uint8_t *)value);
+}
+
+static void
+add_rationals(struct header *header,
+              uint16_t tag,
+              uint16_t type,
+              const float *values,
+              uint32_t count,
+              int32_t denominator)
+{
+        uint8_t data[9 * 8];
+        assert(count <= 9);
+
+        for (uint32_t i = 0; i < count; ++i) {
+                put_u32(data + i * 8, (int32_t)lroundf(values[i] * denominator));
+                put_u32(data + i * 8 + 4, denominator);
+        }
+        add_entry(header, tag, type, count, data);
+}
+
+// Single IFD with the uncompressed CFA data right after the header
+static void
+build_header(MPRawRecorder *self, const MPRawMetadata *metadata, uint8_t *data)
+{
+        struct header header = {
+                .data = data,
+                .values_offset = VALUES_OFFSET,
+        };
+
+        memset(data, 0, HEADER_SIZE);
+        data[0] = 'I';
+        data[1] = 'I';
+        put_u16(data + 2, 42);
+        put_u32(data + 4, 8);
+
+        uint32_t image_size =
+                mp_pixel_format_width_to_bytes(self->pixel_format, self->width) *
+                self->height;
+
+        add_long(&header, 254, 0);
+        add_long(&header, 256, self->width);
+        add_long(&header, 257, self->height);
+        add_short(&header, 258, mp_pixel_format_bits_per_pixel(self->pixel_format));
+        add_short(&header, 259, 1);
+        add_short(&header, 262, 32803);
+        add_ascii(&header, 271, metadata->make);
+        add_ascii(&header, 272, metadata->model);
+        add_long(&header, 273, HEADER_SIZE);
+        add_short(&header, 274, metadata->orientation);
+        add_short(&header, 277, 1);
+        add_long(&header, 278, self->height);
+        add_long(&header, 279, image_size);
+        add_short(&header, 284, 1);
+        add_ascii(&header, 305, "Megapixels");
+        add_ascii(&header, 306, metadata->datetime);
+
+        uint8_t cfa_repeat_pattern_dim[4];
+        put_u16(cfa_repeat_pattern_dim, 2);
+        put_u16(cfa_repeat_pattern_dim + 2, 2);
+        add_entry(&header, 33421, TYPE_SHORT, 2, cfa_repeat_pattern_dim);
+        add_entry(&header,
+                  33422,
+                  TYPE_BYTE,
+                  4,
+                  (const uint8_t *)mp_pixel_format_cfa_pattern(
+                          self->pixel_format));
+
+        add_rationals(&header,
+                      33434,
+                      TYPE_RATIONAL,
+                      &metadata->exposure_time,
+                      1,
+                      1000000);
+        if (metadata->iso) {
+                add_short(&header, 34855, metadata->iso);
+        }
+
+        static const uint8_t dng_version[] = { 1, 4, 0, 0 };
+        static const uint8_t dng_backward_version[] = { 1, 1, 0, 0 };
+        add_entry(&header, 50706, TYPE_BYTE, 4, dng_version);
+        add_entry(&header, 50707, TYPE_BYTE, 4, dng_backward_version);
+
+        char unique_camera_model[255];
+        snprintf(unique_camera_model,
+                 sizeof(unique_camera_model),
+                 "%s %s",
+                 metadata->make,
+                 metadata->model);
+        add_ascii(&header, 50708, unique_camera_model);
+
+        if (metadata->black_level) {
+                add_long(&header, 50714, metadata->black_level);
+        }
+        add_long(&header, 50717, metadata->white_level);
+        add_rationals(&header,
+                      50721,
+                      TYPE_SRATIONAL,
+                      metadata->color_matrix,
+                      9,
+                      10000);
+
+        static const float neutral[] = { 1.0f, 1.0f, 1.0f };
+        add_rationals(&header, 50728, TYPE_RATIONAL, neutral, 3, 10000);
+        add_short(&header, 50778, 21);
+        if (metadata->forward_matrix) {
+                add_rationals(&header,
+                              50964,
+                              TYPE_SRATIONAL,
+                              metadata->forward_matrix,
+                              9,
+                              10000);
+        }
+
+        // Filled in for every frame
+        static const uint8_t timecode[8] = { 0 };
+        self->timecode_offset = add_entry(
+                &header, TIFFTAG_CINEMADNG_TIMECODES, TYPE_BYTE, 8, timecode);
+
+        float frame_rate = self->fps;
+        add_rationals(&header,
+                      TIFFTAG_CINEMADNG_FRAMERATE,
+                      TYPE_SRATIONAL,
+                      &frame_rate,
+                      1,
+                      1);
+
+        put_u16(data + 8, header.num_entries);
+}
+
+static uint8_t
+to_bcd(int value)
+{
+        return (value / 10) << 4 | (value % 10);
+}
+
+// SMPTE 12M time code, frames, seconds, minutes and hours in BCD
+static void
+put_timecode(uint8_t *p, int64_t frame, uint32_t fps)
+{
+        int64_t seconds = frame / fps;
+        p[0] = to_bcd(frame % fps % 100);
+        p[1] = to_bcd(seconds % 60);
+        p[2] = to_bcd(seconds / 60 % 60);
+        p[3] = to_bcd(seconds / 3600 % 24);
+}
+
+// A partial file would be a corrupt DNG, so it is removed and the frame counts
+// as dropped
+static void
+discard_frame(MPRawRecorder *self, int fd, const char *path, const char *action)
+{
+        int error = errno;
+        g_printerr("Could not %s %s: %s\n", action, path, strerror(error));
+
+        close(fd);
+        unlink(path);
+        ++self->frames_dropped;
+
+        if (error == ENOSPC || error == EDQUOT) {
+                self->is_full = true;
+        }
+}
+
+static void
+write_frame(MPRawRecorder *self, struct frame *frame)
+{
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%06d.dng", self->dir, frame->index);
+
+        int64_t start = g_get_monotonic_time();
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | self->open_flags, 0644);
+        if (fd == -1 && errno == EINVAL && self->open_flags) {
+                // Not every filesystem supports O_DIRECT
+                self->open_flags = 0;
+                fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if (fd == -1) {
+                g_printerr("Could not open %s: %s\n", path, strerror(errno));
+                ++self->frames_dropped;
+                return;
+        }
+
+        // Allocate the whole file up front instead of block by block, which
+        // also finds out right away whether it fits
+        if (fallocate(fd, 0, 0, self->write_size) == -1 && errno != EOPNOTSUPP) {
+                discard_frame(self, fd, path, "allocate");
+                return;
+        }
+
+        size_t written = 0;
+        while (written < self->write_size) {
+                ssize_t ret = write(
+                        fd, frame->data + written, self->write_size - written);
+                if (ret == -1 && errno == EINTR) {
+                        continue;
+                }
+                if (ret == -1 && errno == EINVAL && self->open_flags) {
+                        self->open_flags = 0;
+                        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                        continue;
+                }
+                if (ret == -1) {
+                        discard_frame(self, fd, path, "write");
+                        return;
+                }
+                written += ret;
+        }
+
+        if (ftruncate(fd, self->file_size) == -1) {
+                discard_frame(self, fd, path, "truncate");
+                return;
+        }
+        close(fd);
+
+        ++self->frames_written;
+        self->bytes_written += self->file_size;
+        self->write_time += g_get_monotonic_time() - start;
+}
+
+static void
+print_stats(MPRawRecorder *self, float mb_per_second)
+{
+        printf("Raw recording: %d frames, %.1f MB/s, queue max %d, %d dropped, "
+               "%d missed\n",
+               self->frames_written,
+               mb_per_second,
+               self->queue_depth_max,
+               self->frames_dropped,
+               self->frames_missed);
+}
+
+static void *
+writer_thread(void *arg)
+{
+        MPRawRecorder *self = arg;
+
+        int64_t start = g_get_monotonic_time();
+        int64_t stats_time = start;
+        int64_t stats_bytes = 0;
+
+        while (true) {
+                struct frame *frame =
+                        g_async_queue_timeout_pop(self->queue, STATS_INTERVAL / 10);
+
+                int64_t now = g_get_monotonic_time();
+                if (now - stats_time >= STATS_INTERVAL) {
+                        print_stats(self,
+                                    (float)(self->bytes_written - stats_bytes) /
+                                            (now - stats_time));
+                        stats_time = now;
+                        stats_bytes = self->bytes_written;
+                }
+
+                if (!frame) {
+                        continue;
+                }
+                if (frame == &end_of_stream) {
+                        break;
+                }
+
+                // Nothing fits anymore once the disk is full
+                if (self->is_full) {
+                        ++self->frames_dropped;
+                } else {
+                        write_frame(self, frame);
+                }
+
+                g_mutex_lock(&self->lock);
+                frame->in_use = false;
+                g_mutex_unlock(&self->lock);
+        }
+
+        // Bytes per microsecond is MB/s
+        int64_t duration = g_get_monotonic_time() - start;
+        printf("Recorded %d frames to %s, %.1f MB/s (%.1f MB/s while writing), "
+               "%d dropped, %d missed\n",
+               self->frames_written,
+               self->dir,
+               duration > 0 ? (float)self->bytes_written / duration : 0,
+               self->write_time > 0 ? (float)self->bytes_written / self->write_time :
+                                      0,
+               self->frames_dropped,
+               self->frames_missed);
+
+        return NULL;
+}
+
+MPRawRecorder *
+mp_raw_recorder_new(const char *dir,
+                    MPPixelFormat pixel_format,
+                    uint32_t width,
+                    uint32_t height,
+                    uint32_t fps,
+                    const MPRawMetadata *metadata)
+{
+        if (g_mkdir_with_parents(dir, 0755) == -1) {
+                g_printerr("Could not create %s: %s\n", dir, strerror(errno));
+                return NULL;
+        }
+
+        MPRawRecorder *self = calloc(1, sizeof(MPRawRecorder));
+        self->dir = strdup(dir);
+        self->pixel_format = pixel_format;
+        self->width = width;
+        self->height = height;
+        self->fps = MAX(fps, 1);
+        self->file_size =
+                HEADER_SIZE +
+                mp_pixel_format_width_to_bytes(pixel_format, width) * height;
+        self->write_size = (self->file_size + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1);
+        self->open_flags = O_DIRECT;
+        self->first_timestamp = -1;
+
+        uint8_t header[HEADER_SIZE];
+        build_header(self, metadata, header);
+
+        self->num_frames =
+                CLAMP(QUEUE_MEMORY / self->write_size, MIN_FRAMES, MAX_FRAMES);
+        self->frames = calloc(self->num_frames, sizeof(struct frame));
+        for (int i = 0; i < self->num_frames; ++i) {
+                // O_DIRECT needs the memory aligned to the block size as well
+                void *data;
+                int res = posix_memalign(&data, BLOCK_SIZE, self->write_size);
+                assert(res == 0);
+
+                memcpy(data, header, HEADER_SIZE);
+                memset(data + self->file_size,
+                       0,
+                       self->write_size - self->file_size);
+                self->frames[i].data = data;
+        }
+
+        g_mutex_init(&self->lock);
+        self->queue = g_async_queue_new();
+
+        int res = pthread_create(&self->thread, NULL, writer_thread, self);
+        assert(res == 0);
+
+        printf("Recording %dx%d %s DNG sequence to %s (%d frame queue)\n",
+               width,
+               height,
+               mp_pixel_format_to_str(pixel_format),
+               dir,
+               self->num_frames);
+        return self;
+}
+
+bool
+mp_raw_recorder_is_full(MPRawRecorder *self)
+{
+        return self->is_full;
+}
+
+void
+mp_raw_recorder_stop(MPRawRecorder *self)
+{
+        g_async_queue_push(self->queue, &end_of_stream);
+
+        void *r;
+        pthread_join(self->thread, &r);
+
+        g_async_queue_unref(self->queue);
+        g_mutex_clear(&self->lock);
+        for (int i = 0; i < self->num_frames; ++i) {
+                free(self->frames[i].data);
+        }
+        free(self->frames);
+        free(self->dir);
+        free(self);
+}
+
+bool
+mp_raw_recorder_push_frame(MPRawRecorder *self,
+                           const uint8_t *image,
+                           int64_t timestamp)
+{
+        if (self->first_timestamp < 0) {
+                self->first_timestamp = timestamp;
+                self->last_timestamp = timestamp;
+        }
+
+        // Frames that never reached the process pipeline show up as gaps
+        int64_t frame_duration = 1000000 / self->fps;
+        int64_t gap = timestamp - self->last_timestamp;
+        if (gap > frame_duration * 3 / 2) {
+                self->frames_missed +=
+                        (gap + frame_duration / 2) / frame_duration - 1;
+        }
+        self->last_timestamp = timestamp;
+
+        struct frame *frame = NULL;
+        int queue_depth = 0;
+
+        g_mutex_lock(&self->lock);
+        for (int i = 0; i < self->num_frames; ++i) {
+                if (self->frames[i].in_use) {
+                        ++queue_depth;
+                } else if (!frame) {
+                        frame = &self->frames[i];
+                        frame->in_use = true;
+                }
+        }
+        g_mutex_unlock(&self->lock);
+
+        if (queue_depth > self->queue_depth_max) {
+                self->queue_depth_max = queue_depth;
+        }
+
+        if (!frame) {
+                ++self->frames_dropped;
+                return false;
+        }
+
+        // The time code follows the capture time, so it skips over frames
+        // that are missing
+        int64_t index = (timestamp - self->first_timestamp + frame_duration / 2) /
+                        frame_duration;
+        put_timecode(frame->data + self->timecode_offset, index, self->fps);
+
+        mp_pixel_format_pack_for_dng(self->pixel_format,
+                                     self->width,
+                                     self->height,
+                                     image,
+                                     frame->data + HEADER_SIZE);
+
+        frame->index = self->frames_queued++;
+        g_async_queue_push(self->queue, frame);
+        return true;
+}
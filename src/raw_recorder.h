@@ -0,0 +1,45 @@
+#pragma once
+
+#include "mode.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+        const char *make;
+        const char *model;
+        const char *datetime;
+        uint16_t orientation;
+
+        // Row major 3x3 matrices, the forward matrix is optional
+        const float *color_matrix;
+        const float *forward_matrix;
+
+        uint32_t black_level;
+        uint32_t white_level;
+
+        float exposure_time;
+        // 0 when unknown
+        uint16_t iso;
+} MPRawMetadata;
+
+typedef struct _MPRawRecorder MPRawRecorder;
+
+// Writes every frame as a DNG file in dir, together forming a CinemaDNG
+// sequence
+MPRawRecorder *mp_raw_recorder_new(const char *dir,
+                                   MPPixelFormat pixel_format,
+                                   uint32_t width,
+                                   uint32_t height,
+                                   uint32_t fps,
+                                   const MPRawMetadata *metadata);
+// Writes the frames still queued and frees the recorder
+void mp_raw_recorder_stop(MPRawRecorder *self);
+// The disk filled up, frames are only dropped from then on
+bool mp_raw_recorder_is_full(MPRawRecorder *self);
+
+// Queue a frame as it came from the sensor, the timestamp is the time it was
+// captured in microseconds. Returns false when the frame had to be dropped.
+bool mp_raw_recorder_push_frame(MPRawRecorder *self,
+                                const uint8_t *image,
+                                int64_t timestamp);
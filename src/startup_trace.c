@@ -0,0 +1,65 @@
+#include "startup_trace.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+static gint64 start_time = 0;
+static gint is_finished = true;
+
+static GMutex trace_mutex;
+
+void
+mp_startup_trace_init()
+{
+        // Without it every trace call returns right away
+#ifdef PROFILE_STARTUP
+        start_time = g_get_monotonic_time();
+        g_atomic_int_set(&is_finished, false);
+#endif
+}
+
+static void
+trace_phase(const char *phase, bool finish)
+{
+        g_mutex_lock(&trace_mutex);
+
+        // Phases finishing on other threads after the first frame are not
+        // part of the startup anymore
+        if (!is_finished) {
+                printf("Startup: %-36s %8.1fms\n",
+                       phase,
+                       (g_get_monotonic_time() - start_time) / 1000.0);
+
+                if (finish) {
+                        g_atomic_int_set(&is_finished, true);
+                }
+        }
+
+        g_mutex_unlock(&trace_mutex);
+}
+
+void
+mp_startup_trace(const char *format, ...)
+{
+        if (g_atomic_int_get(&is_finished)) {
+                return;
+        }
+
+        char phase[128];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(phase, sizeof(phase), format, args);
+        va_end(args);
+
+        trace_phase(phase, false);
+}
+
+void
+mp_startup_trace_finish(const char *phase)
+{
+        if (g_atomic_int_get(&is_finished)) {
+                return;
+        }
+
+        trace_phase(phase, true);
+}
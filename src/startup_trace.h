@@ -0,0 +1,11 @@
+#pragma once
+
+#include <glib.h>
+#include <stdbool.h>
+
+// Logs how long after process start each startup phase completed, until the
+// first preview frame is on screen. Safe to call from any thread. Only built
+// with PROFILE_STARTUP, like the other profiling output.
+void mp_startup_trace_init();
+void mp_startup_trace(const char *format, ...) G_GNUC_PRINTF(1, 2);
+void mp_startup_trace_finish(const char *phase);
@@ -0,0 +1,339 @@
+#include "video_recorder.h"
+
+#include <assert.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/gst.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Frames that can be waiting for the encoder. When all of them are in use new
+// frames are dropped, so a slow encoder never stalls the process pipeline.
+#define NUM_FRAMES 4
+
+#define STATS_INTERVAL 5000000
+
+struct frame {
+        MPVideoRecorder *recorder;
+        uint8_t *data;
+        int64_t timestamp;
+        bool in_use;
+};
+
+struct _MPVideoRecorder {
+        char *path;
+        size_t frame_size;
+
+        GstElement *pipeline;
+        GstElement *source;
+
+        pthread_t thread;
+        GAsyncQueue *queue;
+
+        GMutex lock;
+        struct frame frames[NUM_FRAMES];
+
+        int64_t first_timestamp;
+        int64_t last_timestamp;
+
+        _Atomic(int) frames_queued;
+        _Atomic(int) frames_dropped;
+        _Atomic(int) frames_encoded;
+        _Atomic(int) queue_depth_max;
+};
+
+// Pushed after the last frame to have the encoder thread finish the file
+static struct frame end_of_stream;
+
+static void
+release_frame(gpointer data)
+{
+        struct frame *frame = data;
+        MPVideoRecorder *self = frame->recorder;
+
+        g_mutex_lock(&self->lock);
+        frame->in_use = false;
+        g_mutex_unlock(&self->lock);
+}
+
+static GstPadProbeReturn
+on_encoded(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+        MPVideoRecorder *self = user_data;
+        ++self->frames_encoded;
+        return GST_PAD_PROBE_OK;
+}
+
+static void
+print_stats(MPVideoRecorder *self, float encode_fps)
+{
+        printf("Recording: %d frames, %.1f fps encoded, queue max %d, %d dropped\n",
+               self->frames_queued,
+               encode_fps,
+               self->queue_depth_max,
+               self->frames_dropped);
+}
+
+static void
+finish_stream(MPVideoRecorder *self)
+{
+        gst_app_src_end_of_stream(GST_APP_SRC(self->source));
+
+        // The muxer writes the index once everything before EOS is encoded
+        GstBus *bus = gst_element_get_bus(self->pipeline);
+        GstMessage *message =
+                gst_bus_timed_pop_filtered(bus,
+                                           GST_CLOCK_TIME_NONE,
+                                           GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+        if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR) {
+                GError *error = NULL;
+                gst_message_parse_error(message, &error, NULL);
+                g_printerr("Failed to record %s: %s\n", self->path, error->message);
+                g_clear_error(&error);
+        }
+        gst_message_unref(message);
+        gst_object_unref(bus);
+
+        gst_element_set_state(self->pipeline, GST_STATE_NULL);
+}
+
+static void *
+encoder_thread(void *arg)
+{
+        MPVideoRecorder *self = arg;
+
+        int64_t stats_time = g_get_monotonic_time();
+        int stats_frames = 0;
+
+        while (true) {
+                struct frame *frame =
+                        g_async_queue_timeout_pop(self->queue, STATS_INTERVAL / 10);
+
+                int64_t now = g_get_monotonic_time();
+                if (now - stats_time >= STATS_INTERVAL) {
+                        int frames_encoded = self->frames_encoded;
+                        print_stats(self,
+                                    (frames_encoded - stats_frames) * 1000000.0f /
+                                            (now - stats_time));
+                        stats_time = now;
+                        stats_frames = frames_encoded;
+                }
+
+                if (!frame) {
+                        continue;
+                }
+                if (frame == &end_of_stream) {
+                        break;
+                }
+
+                // The frame goes back to the recorder once the encoder is done
+                // with it, no copy is made
+                GstBuffer *buffer =
+                        gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY,
+                                                    frame->data,
+                                                    self->frame_size,
+                                                    0,
+                                                    self->frame_size,
+                                                    frame,
+                                                    release_frame);
+                GST_BUFFER_PTS(buffer) =
+                        (frame->timestamp - self->first_timestamp) * GST_USECOND;
+
+                GstFlowReturn ret =
+                        gst_app_src_push_buffer(GST_APP_SRC(self->source), buffer);
+                if (ret != GST_FLOW_OK && ret != GST_FLOW_FLUSHING) {
+                        g_printerr("Failed to encode frame: %s\n",
+                                   gst_flow_get_name(ret));
+                }
+        }
+
+        finish_stream(self);
+
+        float duration = (self->last_timestamp - self->first_timestamp) / 1e6f;
+        printf("Recorded %s: %d frames in %.1fs (%.1f fps), %d dropped\n",
+               self->path,
+               self->frames_encoded,
+               duration,
+               duration > 0 ? self->frames_encoded / duration : 0,
+               self->frames_dropped);
+
+        return NULL;
+}
+
+static void
+free_recorder(MPVideoRecorder *self)
+{
+        gst_object_unref(self->source);
+        gst_object_unref(self->pipeline);
+
+        g_async_queue_unref(self->queue);
+        g_mutex_clear(&self->lock);
+        for (int i = 0; i < NUM_FRAMES; ++i) {
+                free(self->frames[i].data);
+        }
+        free(self->path);
+        free(self);
+}
+
+MPVideoRecorder *
+mp_video_recorder_new(const char *path,
+                      const char *format,
+                      uint32_t width,
+                      uint32_t height,
+                      uint32_t fps,
+                      bool flip)
+{
+        gst_init(NULL, NULL);
+
+        // Frames from GL are read back bottom row first. The bitrate is about
+        // 0.1 bits per pixel, 2.8Mbit/s at 720p30.
+        char *description = g_strdup_printf(
+                "appsrc name=source is-live=true format=time ! "
+                "%s"
+                "videoconvert ! "
+                "x264enc name=encoder tune=zerolatency speed-preset=ultrafast "
+                "bitrate=%d ! "
+                "h264parse ! mp4mux ! filesink name=sink",
+                flip ? "videoflip method=vertical-flip ! " : "",
+                width * height * fps / 10000);
+
+        GError *error = NULL;
+        GstElement *pipeline = gst_parse_launch(description, &error);
+        g_free(description);
+
+        // Missing elements still give a partial pipeline
+        if (error) {
+                g_printerr("Failed to create encoder: %s\n", error->message);
+                g_clear_error(&error);
+                if (pipeline) {
+                        gst_object_unref(pipeline);
+                }
+                return NULL;
+        }
+
+        MPVideoRecorder *self = calloc(1, sizeof(MPVideoRecorder));
+        self->path = strdup(path);
+        self->frame_size = width * height * 4;
+        self->pipeline = pipeline;
+        self->source = gst_bin_get_by_name(GST_BIN(pipeline), "source");
+        self->first_timestamp = -1;
+
+        GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                            "format",
+                                            G_TYPE_STRING,
+                                            format,
+                                            "width",
+                                            G_TYPE_INT,
+                                            width,
+                                            "height",
+                                            G_TYPE_INT,
+                                            height,
+                                            "framerate",
+                                            GST_TYPE_FRACTION,
+                                            fps,
+                                            1,
+                                            NULL);
+        gst_app_src_set_caps(GST_APP_SRC(self->source), caps);
+        gst_caps_unref(caps);
+
+        GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+        g_object_set(sink, "location", path, NULL);
+        gst_object_unref(sink);
+
+        GstElement *encoder = gst_bin_get_by_name(GST_BIN(pipeline), "encoder");
+        GstPad *pad = gst_element_get_static_pad(encoder, "src");
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_encoded, self, NULL);
+        gst_object_unref(pad);
+        gst_object_unref(encoder);
+
+        for (int i = 0; i < NUM_FRAMES; ++i) {
+                self->frames[i].recorder = self;
+                self->frames[i].data = malloc(self->frame_size);
+        }
+        g_mutex_init(&self->lock);
+        self->queue = g_async_queue_new();
+
+        if (gst_element_set_state(pipeline, GST_STATE_PLAYING) ==
+            GST_STATE_CHANGE_FAILURE) {
+                g_printerr("Failed to start encoder for %s\n", path);
+                gst_element_set_state(pipeline, GST_STATE_NULL);
+                free_recorder(self);
+                return NULL;
+        }
+
+        int res = pthread_create(&self->thread, NULL, encoder_thread, self);
+        assert(res == 0);
+
+        printf("Recording %dx%d %s to %s\n", width, height, format, path);
+        return self;
+}
+
+void
+mp_video_recorder_stop(MPVideoRecorder *self)
+{
+        g_async_queue_push(self->queue, &end_of_stream);
+
+        void *r;
+        pthread_join(self->thread, &r);
+
+        free_recorder(self);
+}
+
+uint8_t *
+mp_video_recorder_get_frame(MPVideoRecorder *self)
+{
+        struct frame *frame = NULL;
+        int queue_depth = 0;
+
+        g_mutex_lock(&self->lock);
+        for (int i = 0; i < NUM_FRAMES; ++i) {
+                if (self->frames[i].in_use) {
+                        ++queue_depth;
+                } else if (!frame) {
+                        frame = &self->frames[i];
+                        frame->in_use = true;
+                }
+        }
+        g_mutex_unlock(&self->lock);
+
+        if (queue_depth > self->queue_depth_max) {
+                self->queue_depth_max = queue_depth;
+        }
+
+        if (!frame) {
+                ++self->frames_dropped;
+                return NULL;
+        }
+
+        return frame->data;
+}
+
+void
+mp_video_recorder_push_frame(MPVideoRecorder *self,
+                             uint8_t *data,
+                             int64_t timestamp)
+{
+        struct frame *frame = NULL;
+        for (int i = 0; i < NUM_FRAMES; ++i) {
+                if (self->frames[i].data == data) {
+                        frame = &self->frames[i];
+                }
+        }
+        assert(frame && frame->in_use);
+
+        if (self->first_timestamp < 0) {
+                self->first_timestamp = timestamp;
+                self->last_timestamp = timestamp;
+        }
+
+        // The muxer needs increasing timestamps
+        if (timestamp <= self->last_timestamp && self->frames_queued > 0) {
+                timestamp = self->last_timestamp + 1;
+        }
+        self->last_timestamp = timestamp;
+
+        frame->timestamp = timestamp;
+        ++self->frames_queued;
+        g_async_queue_push(self->queue, frame);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct _MPVideoRecorder MPVideoRecorder;
+
+// Encodes frames of packed 32-bit pixels to H.264 in an mp4 file. The format
+// is the GStreamer name of the pixel layout, like RGBx.
+MPVideoRecorder *mp_video_recorder_new(const char *path,
+                                       const char *format,
+                                       uint32_t width,
+                                       uint32_t height,
+                                       uint32_t fps,
+                                       bool flip);
+// Encodes the frames still queued, finishes the file and frees the recorder
+void mp_video_recorder_stop(MPVideoRecorder *self);
+
+// A frame of width * height * 4 bytes to fill in, or NULL when the encoder
+// is behind and the frame has to be dropped
+uint8_t *mp_video_recorder_get_frame(MPVideoRecorder *self);
+// Queue a frame from mp_video_recorder_get_frame, the timestamp is the time
+// it was captured in microseconds
+void mp_video_recorder_push_frame(MPVideoRecorder *self,
+                                  uint8_t *frame,
+                                  int64_t timestamp);
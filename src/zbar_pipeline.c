@@ -4,6 +4,10 @@
 #include "main.h"
 #include "pipeline.h"
 #include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <zbar.h>
 
 struct _MPZBarImage {
@@ -14,21 +18,151 @@ struct _MPZBarImage {
         int rotation;
         bool mirrored;
 
+        // When it was handed to the pipeline
+        int64_t received;
+
         _Atomic int ref_count;
 };
 
+// Grayscale images below this width are always scanned entirely
+#define MIN_PYRAMID_WIDTH 640
+// Frames between scanning the entire image at a quarter resolution
+#define FULL_SCAN_INTERVAL 4
+// How long a code stays on the overlay, and is looked for where it was last
+// seen, after it was lost
+#define CODE_TTL 500000
+#define MAX_CODES 8
+// How far the shown corners move towards the found ones every frame
+#define SMOOTHING 0.5f
+// Pixels a corner has to move before the overlay is updated
+#define MOVE_THRESHOLD 2
+// Samples compared between frames to find out if anything moved
+#define MOTION_GRID_WIDTH 64
+#define MOTION_GRID_HEIGHT 48
+#define MOTION_GRID_SIZE (MOTION_GRID_WIDTH * MOTION_GRID_HEIGHT)
+// Mean difference of the samples above which the scene changed
+#define MOTION_THRESHOLD 4
+// Frames between scans of a scene that doesn't change
+#define STATIC_SCAN_INTERVAL 10
+// The center, the known codes and the quarter resolution image
+#define MAX_SCAN_TASKS (MAX_CODES + 2)
+#define MAX_SCAN_WORKERS 4
+
+struct region {
+        int x;
+        int y;
+        int width;
+        int height;
+};
+
+// A code as one of the workers found it. The data belongs to the zbar image
+// of the task.
+struct found_code {
+        zbar_symbol_type_t type;
+        const char *data;
+        unsigned int data_size;
+        uint32_t hash;
+
+        // In the half resolution image, before rotating
+        int corners_x[4];
+        int corners_y[4];
+        struct region bounds;
+};
+
+// A code on the overlay, identified by its type and data
+struct cached_code {
+        zbar_symbol_type_t type;
+        char *data;
+        unsigned int data_size;
+        uint32_t hash;
+
+        // Smoothed, in the half resolution image before rotating
+        float corners_x[4];
+        float corners_y[4];
+        // Where it was last found, unsmoothed
+        struct region bounds;
+
+        // The corners the main thread has
+        int posted_x[4];
+        int posted_y[4];
+
+        int last_seen_frame;
+        int64_t last_seen;
+};
+
+// A region scanned by one of the workers
+struct scan_task {
+        const uint8_t *src;
+        int src_width;
+        struct region region;
+        int scale;
+
+        // Kept between frames
+        uint8_t *crop;
+        size_t crop_size;
+        zbar_image_t *zbar_image;
+
+        struct found_code found[MAX_CODES];
+        int num_found;
+
+#ifdef PROFILE_ZBAR
+        double cpu_time;
+#endif
+};
+
 static MPPipeline *pipeline;
 
 static volatile int frames_processed = 0;
 static volatile int frames_received = 0;
 
-static zbar_image_scanner_t *scanner;
+// Every worker takes a scanner of its own from the queue for each region
+static GThreadPool *scan_pool = NULL;
+static GAsyncQueue *idle_scanners = NULL;
+static int num_scanners = 0;
+
+static struct scan_task tasks[MAX_SCAN_TASKS];
+static int num_tasks = 0;
+static int tasks_remaining = 0;
+static GMutex scan_mutex;
+static GCond scan_cond;
+
+// The grayscale pyramid, kept around between frames
+static uint8_t *gray = NULL;
+static int gray_width = 0;
+static int gray_height = 0;
+static uint8_t *small = NULL;
+static int small_width = 0;
+static int small_height = 0;
+
+static int frame_count = 0;
+
+static struct cached_code codes[MAX_CODES];
+static int num_codes = 0;
+// Whether the overlay needs to be updated
+static bool codes_changed = false;
+static int posted_rotation = 0;
+static bool posted_mirrored = false;
+
+// Samples of the frame that was last scanned
+static uint8_t scanned_grid[MOTION_GRID_SIZE];
+static bool has_scanned_grid = false;
+static int static_frames = 0;
+
+static void scan_region(gpointer data, gpointer user_data);
 
 static void
 setup(MPPipeline *pipeline, const void *data)
 {
-        scanner = zbar_image_scanner_create();
-        zbar_image_scanner_set_config(scanner, 0, ZBAR_CFG_ENABLE, 1);
+        num_scanners = CLAMP(g_get_num_processors(), 1, MAX_SCAN_WORKERS);
+
+        idle_scanners = g_async_queue_new();
+        for (int i = 0; i < num_scanners; ++i) {
+                zbar_image_scanner_t *scanner = zbar_image_scanner_create();
+                zbar_image_scanner_set_config(scanner, 0, ZBAR_CFG_ENABLE, 1);
+                g_async_queue_push(idle_scanners, scanner);
+        }
+
+        scan_pool = g_thread_pool_new(scan_region, NULL, num_scanners, false, NULL);
 }
 
 void
@@ -43,6 +177,24 @@ void
 mp_zbar_pipeline_stop()
 {
         mp_pipeline_free(pipeline);
+
+        g_thread_pool_free(scan_pool, false, true);
+        for (int i = 0; i < num_scanners; ++i) {
+                zbar_image_scanner_destroy(g_async_queue_pop(idle_scanners));
+        }
+        g_async_queue_unref(idle_scanners);
+
+        for (int i = 0; i < MAX_SCAN_TASKS; ++i) {
+                free(tasks[i].crop);
+                if (tasks[i].zbar_image) {
+                        zbar_image_destroy(tasks[i].zbar_image);
+                }
+        }
+        for (int i = 0; i < num_codes; ++i) {
+                free(codes[i].data);
+        }
+        free(gray);
+        free(small);
 }
 
 static bool
@@ -101,91 +253,398 @@ map_coords(int *x, int *y, int width, int height, int rotation, bool mirrored)
         *y = y_r;
 }
 
-static MPZBarCode
-process_symbol(const MPZBarImage *image,
-               int width,
-               int height,
-               const zbar_symbol_t *symbol)
+// Bounds of the code in the image the symbol was found in, before rotating
+static struct region
+get_symbol_bounds(const zbar_symbol_t *symbol)
 {
-        if (image->rotation == 90 || image->rotation == 270) {
-                int tmp = width;
-                width = height;
-                height = tmp;
+        unsigned loc_size = zbar_symbol_get_loc_size(symbol);
+        assert(loc_size > 0);
+
+        int min_x = zbar_symbol_get_loc_x(symbol, 0);
+        int min_y = zbar_symbol_get_loc_y(symbol, 0);
+        int max_x = min_x, max_y = min_y;
+        for (unsigned i = 1; i < loc_size; ++i) {
+                int x = zbar_symbol_get_loc_x(symbol, i);
+                int y = zbar_symbol_get_loc_y(symbol, i);
+                min_x = MIN(min_x, x);
+                min_y = MIN(min_y, y);
+                max_x = MAX(max_x, x);
+                max_y = MAX(max_y, y);
         }
 
-        MPZBarCode code;
+        struct region bounds = {
+                .x = min_x,
+                .y = min_y,
+                .width = max_x - min_x + 1,
+                .height = max_y - min_y + 1,
+        };
+        return bounds;
+}
 
+// The symbol was found in region of an image scale times smaller than the
+// half resolution one
+static void
+get_found_code(const zbar_symbol_t *symbol,
+               const struct region *region,
+               int scale,
+               struct found_code *found)
+{
         unsigned loc_size = zbar_symbol_get_loc_size(symbol);
-        assert(loc_size > 0);
-
         zbar_symbol_type_t type = zbar_symbol_get_type(symbol);
 
+        struct region bounds = get_symbol_bounds(symbol);
         if (is_3d_code(type) && loc_size == 4) {
                 for (unsigned i = 0; i < loc_size; ++i) {
-                        code.bounds_x[i] = zbar_symbol_get_loc_x(symbol, i);
-                        code.bounds_y[i] = zbar_symbol_get_loc_y(symbol, i);
+                        found->corners_x[i] = zbar_symbol_get_loc_x(symbol, i);
+                        found->corners_y[i] = zbar_symbol_get_loc_y(symbol, i);
                 }
         } else {
-                int min_x = zbar_symbol_get_loc_x(symbol, 0);
-                int min_y = zbar_symbol_get_loc_y(symbol, 0);
-                int max_x = min_x, max_y = min_y;
-                for (unsigned i = 1; i < loc_size; ++i) {
-                        int x = zbar_symbol_get_loc_x(symbol, i);
-                        int y = zbar_symbol_get_loc_y(symbol, i);
-                        min_x = MIN(min_x, x);
-                        min_y = MIN(min_y, y);
-                        max_x = MAX(max_x, x);
-                        max_y = MAX(max_y, y);
-                }
+                int max_x = bounds.x + bounds.width - 1;
+                int max_y = bounds.y + bounds.height - 1;
+
+                found->corners_x[0] = bounds.x;
+                found->corners_y[0] = bounds.y;
+                found->corners_x[1] = max_x;
+                found->corners_y[1] = bounds.y;
+                found->corners_x[2] = max_x;
+                found->corners_y[2] = max_y;
+                found->corners_x[3] = bounds.x;
+                found->corners_y[3] = max_y;
+        }
+
+        for (uint8_t i = 0; i < 4; ++i) {
+                found->corners_x[i] = (found->corners_x[i] + region->x) * scale;
+                found->corners_y[i] = (found->corners_y[i] + region->y) * scale;
+        }
+
+        found->bounds.x = (bounds.x + region->x) * scale;
+        found->bounds.y = (bounds.y + region->y) * scale;
+        found->bounds.width = bounds.width * scale;
+        found->bounds.height = bounds.height * scale;
+
+        found->type = type;
+        found->data = zbar_symbol_get_data(symbol);
+        found->data_size = zbar_symbol_get_data_length(symbol);
 
-                code.bounds_x[0] = min_x;
-                code.bounds_y[0] = min_y;
-                code.bounds_x[1] = max_x;
-                code.bounds_y[1] = min_y;
-                code.bounds_x[2] = max_x;
-                code.bounds_y[2] = max_y;
-                code.bounds_x[3] = min_x;
-                code.bounds_y[3] = max_y;
+        // FNV-1a
+        found->hash = 2166136261u;
+        for (unsigned int i = 0; i < found->data_size; ++i) {
+                found->hash ^= (uint8_t)found->data[i];
+                found->hash *= 16777619u;
+        }
+}
+
+static MPZBarCode
+make_code(const struct cached_code *cached,
+          int width,
+          int height,
+          int rotation,
+          bool mirrored)
+{
+        if (rotation == 90 || rotation == 270) {
+                int tmp = width;
+                width = height;
+                height = tmp;
         }
 
+        MPZBarCode code;
         for (uint8_t i = 0; i < 4; ++i) {
+                code.bounds_x[i] = cached->posted_x[i];
+                code.bounds_y[i] = cached->posted_y[i];
+
                 map_coords(&code.bounds_x[i],
                            &code.bounds_y[i],
                            width,
                            height,
-                           image->rotation,
-                           image->mirrored);
+                           rotation,
+                           mirrored);
         }
 
-        const char *data = zbar_symbol_get_data(symbol);
-        unsigned int data_size = zbar_symbol_get_data_length(symbol);
-        code.type = zbar_get_symbol_name(type);
-        code.data = strndup(data, data_size + 1);
-        code.data[data_size] = 0;
+        code.type = zbar_get_symbol_name(cached->type);
+        code.data = strndup(cached->data, cached->data_size);
 
         return code;
 }
 
+static bool
+region_contains(const struct region *a, const struct region *b)
+{
+        return b->x >= a->x && b->y >= a->y &&
+               b->x + b->width <= a->x + a->width &&
+               b->y + b->height <= a->y + a->height;
+}
+
+static struct cached_code *
+find_code(const struct found_code *found)
+{
+        for (int i = 0; i < num_codes; ++i) {
+                struct cached_code *code = &codes[i];
+                if (code->type == found->type && code->hash == found->hash &&
+                    code->data_size == found->data_size &&
+                    memcmp(code->data, found->data, found->data_size) == 0) {
+                        return code;
+                }
+        }
+        return NULL;
+}
+
+// Add a newly found code to the overlay or move the existing one towards
+// where it was found
 static void
-process_image(MPPipeline *pipeline, MPZBarImage **_image)
+update_code(const struct found_code *found, int64_t now)
 {
-        MPZBarImage *image = *_image;
+        struct cached_code *code = find_code(found);
+
+        if (!code) {
+                if (num_codes < MAX_CODES) {
+                        code = &codes[num_codes++];
+                } else {
+                        // Replace the one that was seen the longest ago
+                        code = &codes[0];
+                        for (int i = 1; i < num_codes; ++i) {
+                                if (codes[i].last_seen < code->last_seen) {
+                                        code = &codes[i];
+                                }
+                        }
+                        free(code->data);
+                }
 
-        assert(image->pixel_format == MP_PIXEL_FMT_BGGR8 ||
-               image->pixel_format == MP_PIXEL_FMT_GBRG8 ||
-               image->pixel_format == MP_PIXEL_FMT_GRBG8 ||
-               image->pixel_format == MP_PIXEL_FMT_RGGB8 ||
-               image->pixel_format == MP_PIXEL_FMT_BGGR10P ||
-               image->pixel_format == MP_PIXEL_FMT_GBRG10P ||
-               image->pixel_format == MP_PIXEL_FMT_GRBG10P ||
-               image->pixel_format == MP_PIXEL_FMT_RGGB10P);
+                code->type = found->type;
+                code->hash = found->hash;
+                code->data_size = found->data_size;
+                code->data = malloc(found->data_size);
+                memcpy(code->data, found->data, found->data_size);
+                for (int i = 0; i < 4; ++i) {
+                        code->corners_x[i] = found->corners_x[i];
+                        code->corners_y[i] = found->corners_y[i];
+                        code->posted_x[i] = found->corners_x[i];
+                        code->posted_y[i] = found->corners_y[i];
+                }
+                codes_changed = true;
+        } else if (code->last_seen_frame != frame_count) {
+                for (int i = 0; i < 4; ++i) {
+                        code->corners_x[i] +=
+                                (found->corners_x[i] - code->corners_x[i]) *
+                                SMOOTHING;
+                        code->corners_y[i] +=
+                                (found->corners_y[i] - code->corners_y[i]) *
+                                SMOOTHING;
+                }
+        } else {
+                // Also found by another region in this frame
+                return;
+        }
 
-        // Create a grayscale image for scanning from the current preview.
-        // Rotate/mirror correctly.
+        code->bounds = found->bounds;
+        code->last_seen_frame = frame_count;
+        code->last_seen = now;
+}
+
+static void
+expire_codes(int64_t now)
+{
+        int n = 0;
+        for (int i = 0; i < num_codes; ++i) {
+                if (now - codes[i].last_seen <= CODE_TTL) {
+                        codes[n++] = codes[i];
+                } else {
+                        free(codes[i].data);
+                        codes_changed = true;
+                }
+        }
+        num_codes = n;
+}
+
+static void
+clear_codes()
+{
+        for (int i = 0; i < num_codes; ++i) {
+                free(codes[i].data);
+        }
+        codes_changed = codes_changed || num_codes > 0;
+        num_codes = 0;
+}
+
+// Update the corners to show for the codes that moved enough
+static void
+update_posted_corners()
+{
+        for (int i = 0; i < num_codes; ++i) {
+                struct cached_code *code = &codes[i];
+                for (int j = 0; j < 4; ++j) {
+                        int x = (int)roundf(code->corners_x[j]);
+                        int y = (int)roundf(code->corners_y[j]);
+                        if (abs(x - code->posted_x[j]) >= MOVE_THRESHOLD ||
+                            abs(y - code->posted_y[j]) >= MOVE_THRESHOLD) {
+                                code->posted_x[j] = x;
+                                code->posted_y[j] = y;
+                                codes_changed = true;
+                        }
+                }
+        }
+}
+
+static void
+post_codes(int rotation, bool mirrored)
+{
+        if (num_codes == 0) {
+                mp_main_set_zbar_result(NULL);
+                return;
+        }
+
+        MPZBarScanResult *result = malloc(sizeof(MPZBarScanResult));
+        result->size = num_codes;
+        if (rotation == 90 || rotation == 270) {
+                result->width = gray_height;
+                result->height = gray_width;
+        } else {
+                result->width = gray_width;
+                result->height = gray_height;
+        }
+
+        for (int i = 0; i < num_codes; ++i) {
+                result->codes[i] = make_code(
+                        &codes[i], gray_width, gray_height, rotation, mirrored);
+        }
+
+        mp_main_set_zbar_result(result);
+}
+
+// Scans a region of a grayscale image that is scale times smaller than the
+// half resolution one, on one of the workers
+static void
+scan_region(gpointer data, gpointer user_data)
+{
+        struct scan_task *task = data;
+        const struct region *region = &task->region;
+
+#ifdef PROFILE_ZBAR
+        struct timespec cpu_start;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+#endif
+
+        // zbar wants a contiguous image, only full rows can be used without
+        // a copy
+        const uint8_t *image_data = task->src + region->y * task->src_width;
+        if (region->width != task->src_width) {
+                size_t size = region->width * region->height;
+                if (size > task->crop_size) {
+                        free(task->crop);
+                        task->crop = malloc(size);
+                        task->crop_size = size;
+                }
+                for (int y = 0; y < region->height; ++y) {
+                        memcpy(task->crop + y * region->width,
+                               task->src + (region->y + y) * task->src_width +
+                                       region->x,
+                               region->width);
+                }
+                image_data = task->crop;
+        }
+
+        // The image is reused, it also holds the symbols until they are
+        // merged
+        zbar_image_t *zbar_image = task->zbar_image;
+        zbar_image_set_size(zbar_image, region->width, region->height);
+        zbar_image_set_data(
+                zbar_image, image_data, region->width * region->height, NULL);
+
+        zbar_image_scanner_t *scanner = g_async_queue_pop(idle_scanners);
+        int res = zbar_scan_image(scanner, zbar_image);
+        assert(res >= 0);
+        g_async_queue_push(idle_scanners, scanner);
+
+        task->num_found = 0;
+        const zbar_symbol_t *symbol = zbar_image_first_symbol(zbar_image);
+        for (; symbol && task->num_found < MAX_CODES;
+             symbol = zbar_symbol_next(symbol)) {
+                get_found_code(symbol,
+                               region,
+                               task->scale,
+                               &task->found[task->num_found++]);
+        }
+
+#ifdef PROFILE_ZBAR
+        struct timespec cpu_end;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+        task->cpu_time = (cpu_end.tv_sec - cpu_start.tv_sec) * 1000.0 +
+                         (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1000000.0;
+#endif
+
+        g_mutex_lock(&scan_mutex);
+        --tasks_remaining;
+        g_cond_signal(&scan_cond);
+        g_mutex_unlock(&scan_mutex);
+}
+
+static void
+add_scan_task(const uint8_t *src,
+              int src_width,
+              const struct region *region,
+              int scale)
+{
+        assert(num_tasks < MAX_SCAN_TASKS);
+
+        if (region->width <= 0 || region->height <= 0) {
+                return;
+        }
+
+        struct scan_task *task = &tasks[num_tasks++];
+        if (!task->zbar_image) {
+                task->zbar_image = zbar_image_create();
+                zbar_image_set_format(task->zbar_image,
+                                      zbar_fourcc('Y', '8', '0', '0'));
+        }
+        task->src = src;
+        task->src_width = src_width;
+        task->region = *region;
+        task->scale = scale;
+}
+
+// Scans all regions in parallel and merges the codes found in them
+static void
+run_scan_tasks()
+{
+        g_mutex_lock(&scan_mutex);
+        tasks_remaining = num_tasks;
+        g_mutex_unlock(&scan_mutex);
+
+        for (int i = 0; i < num_tasks; ++i) {
+                g_thread_pool_push(scan_pool, &tasks[i], NULL);
+        }
+
+        g_mutex_lock(&scan_mutex);
+        while (tasks_remaining > 0) {
+                g_cond_wait(&scan_cond, &scan_mutex);
+        }
+        g_mutex_unlock(&scan_mutex);
+
+        // Overlapping regions find the same codes
+        int64_t now = g_get_monotonic_time();
+        for (int i = 0; i < num_tasks; ++i) {
+                struct scan_task *task = &tasks[i];
+                for (int j = 0; j < task->num_found; ++j) {
+                        update_code(&task->found[j], now);
+                }
+        }
+
+        num_tasks = 0;
+}
+
+// Half the resolution of the sensor image, one sample of every 2x2 block
+static void
+make_gray_image(const MPZBarImage *image)
+{
         int width = image->width / 2;
         int height = image->height / 2;
+        if (width * height > gray_width * gray_height) {
+                free(gray);
+                gray = malloc(width * height * sizeof(uint8_t));
+        }
+        gray_width = width;
+        gray_height = height;
 
-        uint8_t *data = malloc(width * height * sizeof(uint8_t));
+        uint8_t *data = gray;
         size_t row_length =
                 mp_pixel_format_width_to_bytes(image->pixel_format, image->width);
         int padding_bytes =
@@ -230,40 +689,275 @@ process_image(MPPipeline *pipeline, MPZBarImage **_image)
                         padding_offset += padding_bytes * 2;
                 }
                 break;
+        case MP_PIXEL_FMT_UYVY:
+        case MP_PIXEL_FMT_YUYV:
+                // The luma plane is already grayscale, take the first pixel of
+                // every pair without converting anything
+                offset = image->pixel_format == MP_PIXEL_FMT_UYVY ? 1 : 0;
+                for (int y = 0; y < image->height; y += 2) {
+                        const uint8_t *row = image->data +
+                                             (row_length + padding_bytes) * y +
+                                             offset;
+                        for (int x = 0; x < width; ++x) {
+                                data[i++] = row[x * 4];
+                        }
+                }
+                break;
         default:
                 assert(0);
         }
+}
 
-        // Create image for zbar
-        zbar_image_t *zbar_image = zbar_image_create();
-        zbar_image_set_format(zbar_image, zbar_fourcc('Y', '8', '0', '0'));
-        zbar_image_set_size(zbar_image, width, height);
-        zbar_image_set_data(zbar_image,
-                            data,
-                            width * height * sizeof(uint8_t),
-                            zbar_image_free_data);
+// The sample make_gray_image takes for a pixel of the half resolution image
+static inline uint8_t
+sample_gray(const MPZBarImage *image,
+            size_t row_length,
+            int padding_bytes,
+            int x,
+            int y)
+{
+        switch (image->pixel_format) {
+        case MP_PIXEL_FMT_BGGR8:
+        case MP_PIXEL_FMT_GBRG8:
+        case MP_PIXEL_FMT_GRBG8:
+        case MP_PIXEL_FMT_RGGB8:
+                return image->data[x * 2 + row_length * y * 2];
+        case MP_PIXEL_FMT_BGGR10P:
+        case MP_PIXEL_FMT_GBRG10P:
+        case MP_PIXEL_FMT_GRBG10P:
+        case MP_PIXEL_FMT_RGGB10P:
+                return image->data[x * 2 + x / 2 + 1 + padding_bytes * 2 * y +
+                                   row_length * y * 2];
+        case MP_PIXEL_FMT_UYVY:
+                return image->data[(row_length + padding_bytes) * y * 2 + x * 4 +
+                                   1];
+        case MP_PIXEL_FMT_YUYV:
+                return image->data[(row_length + padding_bytes) * y * 2 + x * 4];
+        default:
+                assert(0);
+                return 0;
+        }
+}
 
-        int res = zbar_scan_image(scanner, zbar_image);
-        assert(res >= 0);
+// Compares a coarse grid of samples with the frame that was scanned last,
+// before building the grayscale image
+static bool
+scene_changed(const MPZBarImage *image)
+{
+        int width = image->width / 2;
+        int height = image->height / 2;
+        size_t row_length =
+                mp_pixel_format_width_to_bytes(image->pixel_format, image->width);
+        int padding_bytes =
+                mp_pixel_format_width_to_padding(image->pixel_format, image->width);
 
-        if (res > 0) {
-                MPZBarScanResult *result = malloc(sizeof(MPZBarScanResult));
-                result->size = res;
+        uint8_t grid[MOTION_GRID_SIZE];
+        for (int gy = 0; gy < MOTION_GRID_HEIGHT; ++gy) {
+                int y = gy * height / MOTION_GRID_HEIGHT;
+                for (int gx = 0; gx < MOTION_GRID_WIDTH; ++gx) {
+                        int x = gx * width / MOTION_GRID_WIDTH;
+                        grid[gy * MOTION_GRID_WIDTH + gx] =
+                                sample_gray(image, row_length, padding_bytes, x, y);
+                }
+        }
 
-                const zbar_symbol_t *symbol = zbar_image_first_symbol(zbar_image);
-                for (int i = 0; i < MIN(res, 8); ++i) {
-                        assert(symbol != NULL);
-                        result->codes[i] =
-                                process_symbol(image, width, height, symbol);
-                        symbol = zbar_symbol_next(symbol);
+        // Simple enough for the compiler to vectorize
+        unsigned int sad = 0;
+        for (int i = 0; i < MOTION_GRID_SIZE; ++i) {
+                sad += abs(grid[i] - scanned_grid[i]);
+        }
+
+        bool changed = !has_scanned_grid || width != gray_width ||
+                       height != gray_height ||
+                       image->rotation != posted_rotation ||
+                       image->mirrored != posted_mirrored ||
+                       sad > MOTION_THRESHOLD * MOTION_GRID_SIZE ||
+                       ++static_frames >= STATIC_SCAN_INTERVAL;
+
+        if (changed) {
+                memcpy(scanned_grid, grid, MOTION_GRID_SIZE);
+                has_scanned_grid = true;
+                static_frames = 0;
+        }
+
+        return changed;
+}
+
+// The next level of the pyramid, averaging every 2x2 block
+static void
+make_small_image()
+{
+        int width = gray_width / 2;
+        int height = gray_height / 2;
+        if (width * height > small_width * small_height) {
+                free(small);
+                small = malloc(width * height * sizeof(uint8_t));
+        }
+        small_width = width;
+        small_height = height;
+
+        for (int y = 0; y < height; ++y) {
+                const uint8_t *row0 = gray + (y * 2) * gray_width;
+                const uint8_t *row1 = row0 + gray_width;
+                uint8_t *out = small + y * width;
+                for (int x = 0; x < width; ++x) {
+                        out[x] = (row0[x * 2] + row0[x * 2 + 1] + row1[x * 2] +
+                                  row1[x * 2 + 1] + 2) >>
+                                 2;
                 }
+        }
+}
+
+// Where a tracked code is looked for, with room for it to move
+static struct region
+get_search_region(const struct region *bounds)
+{
+        int margin = MAX(bounds->width, bounds->height) / 2;
+        int x0 = MAX(bounds->x - margin, 0);
+        int y0 = MAX(bounds->y - margin, 0);
+        int x1 = MIN(bounds->x + bounds->width + margin, gray_width);
+        int y1 = MIN(bounds->y + bounds->height + margin, gray_height);
+
+        struct region region = {
+                .x = x0,
+                .y = y0,
+                .width = MAX(x1 - x0, 0),
+                .height = MAX(y1 - y0, 0),
+        };
+        return region;
+}
 
-                mp_main_set_zbar_result(result);
+static void
+process_image(MPPipeline *pipeline, MPZBarImage **_image)
+{
+        MPZBarImage *image = *_image;
+
+        assert(image->pixel_format == MP_PIXEL_FMT_BGGR8 ||
+               image->pixel_format == MP_PIXEL_FMT_GBRG8 ||
+               image->pixel_format == MP_PIXEL_FMT_GRBG8 ||
+               image->pixel_format == MP_PIXEL_FMT_RGGB8 ||
+               image->pixel_format == MP_PIXEL_FMT_BGGR10P ||
+               image->pixel_format == MP_PIXEL_FMT_GBRG10P ||
+               image->pixel_format == MP_PIXEL_FMT_GRBG10P ||
+               image->pixel_format == MP_PIXEL_FMT_RGGB10P ||
+               mp_pixel_format_is_yuv(image->pixel_format));
+
+#ifdef PROFILE_ZBAR
+        struct timespec cpu_start;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+        int64_t start = g_get_monotonic_time();
+        int64_t pixels_scanned = 0;
+#endif
+
+        // Nothing new to find when the scene is the same as in the last scan,
+        // the codes on the overlay are still there
+        if (!scene_changed(image)) {
+                int64_t now = g_get_monotonic_time();
+                for (int i = 0; i < num_codes; ++i) {
+                        codes[i].last_seen = now;
+                }
+
+                mp_zbar_image_unref(image);
+                ++frames_processed;
+                return;
+        }
+
+        // Create a grayscale image for scanning from the current preview.
+        // The rotation and mirroring are applied to the found codes.
+        int old_width = gray_width, old_height = gray_height;
+        make_gray_image(image);
+        if (gray_width != old_width || gray_height != old_height) {
+                clear_codes();
+        }
+
+        ++frame_count;
+
+        struct region full = { 0, 0, gray_width, gray_height };
+
+        if (gray_width < MIN_PYRAMID_WIDTH) {
+                // Small enough to scan all of it every frame
+                add_scan_task(gray, gray_width, &full, 1);
+#ifdef PROFILE_ZBAR
+                pixels_scanned += full.width * full.height;
+#endif
         } else {
-                mp_main_set_zbar_result(NULL);
+                // Look for codes where they were seen and in the center at
+                // half resolution, and for new ones in the entire frame at a
+                // quarter resolution now and then
+                struct region regions[MAX_CODES + 1];
+                int num_regions = 0;
+                regions[num_regions++] = (struct region){
+                        gray_width / 4,
+                        gray_height / 4,
+                        gray_width / 2,
+                        gray_height / 2,
+                };
+                for (int i = 0; i < num_codes; ++i) {
+                        struct region region =
+                                get_search_region(&codes[i].bounds);
+                        if (!region_contains(&regions[0], &region)) {
+                                regions[num_regions++] = region;
+                        }
+                }
+
+                for (int i = 0; i < num_regions; ++i) {
+                        add_scan_task(gray, gray_width, &regions[i], 1);
+#ifdef PROFILE_ZBAR
+                        pixels_scanned += regions[i].width * regions[i].height;
+#endif
+                }
+
+                if (frame_count % FULL_SCAN_INTERVAL == 0) {
+                        make_small_image();
+                        struct region small_full = {
+                                0, 0, small_width, small_height
+                        };
+                        add_scan_task(small, small_width, &small_full, 2);
+#ifdef PROFILE_ZBAR
+                        pixels_scanned += small_width * small_height;
+#endif
+                }
+        }
+
+#ifdef PROFILE_ZBAR
+        int num_regions = num_tasks;
+#endif
+        run_scan_tasks();
+        expire_codes(g_get_monotonic_time());
+        update_posted_corners();
+
+        // The overlay is only replaced when it would look different
+        if (image->rotation != posted_rotation ||
+            image->mirrored != posted_mirrored) {
+                posted_rotation = image->rotation;
+                posted_mirrored = image->mirrored;
+                codes_changed = true;
+        }
+        if (codes_changed) {
+                post_codes(image->rotation, image->mirrored);
+                codes_changed = false;
+        }
+
+#ifdef PROFILE_ZBAR
+        struct timespec cpu_end;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+        int64_t end = g_get_monotonic_time();
+        double cpu_time = (cpu_end.tv_sec - cpu_start.tv_sec) * 1000.0 +
+                          (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1000000.0;
+        for (int i = 0; i < num_regions; ++i) {
+                cpu_time += tasks[i].cpu_time;
         }
+        printf("zbar %fms (%fms cpu), %d regions on %d workers, %d%% of the "
+               "pixels, %d codes, %fms after the frame arrived\n",
+               (end - start) / 1000.0,
+               cpu_time,
+               num_regions,
+               num_scanners,
+               (int)(pixels_scanned * 100 / (gray_width * gray_height)),
+               num_codes,
+               (end - image->received) / 1000.0);
+#endif
 
-        zbar_image_destroy(zbar_image);
         mp_zbar_image_unref(image);
 
         ++frames_processed;
@@ -279,6 +973,7 @@ mp_zbar_pipeline_process_image(MPZBarImage *image)
         }
 
         ++frames_received;
+        image->received = g_get_monotonic_time();
 
         mp_pipeline_invoke(pipeline,
                            (MPPipelineCallback)process_image,
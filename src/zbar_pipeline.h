@@ -14,6 +14,10 @@ typedef struct {
 typedef struct {
         MPZBarCode codes[8];
         uint8_t size;
+
+        // Size of the rotated image the bounds are in
+        int width;
+        int height;
 } MPZBarScanResult;
 
 void mp_zbar_pipeline_start();
@@ -0,0 +1,265 @@
+#include "auto_exposure.h"
+#include "frame_stats.h"
+#include "mode.h"
+#include <glib.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Simulated sensor, roughly an ov5640 running at 30fps
+#define EXPOSURE_MIN 4
+#define EXPOSURE_MAX 1000
+#define GAIN_MIN 16
+#define GAIN_MAX 248
+#define GAIN_UNITY 16
+
+// Frames until a control change shows up in the image, and the additional
+// delay of the statistics coming back from the process pipeline
+#define SENSOR_LATENCY 2
+#define STATS_LATENCY 1
+#define AE_LATENCY 3
+
+#define NUM_FRAMES 150
+
+#define WIDTH 640
+#define HEIGHT 480
+
+// Tolerance around the final brightness to consider it converged
+#define SETTLED_TOLERANCE 0.1f
+
+struct scenario {
+        const char *name;
+        // Brightness of the scene before and after step_frame
+        float brightness;
+        float step_brightness;
+        int step_frame;
+        // Add a small window that's 20 times brighter than the rest
+        bool has_highlight;
+};
+
+static const struct scenario scenarios[] = {
+        { "dim room", 0.05f, 0.05f, 0, false },
+        { "daylight", 20.0f, 20.0f, 0, false },
+        { "backlit window", 0.5f, 0.5f, 0, true },
+        { "lights switched on", 0.05f, 2.0f, 60, false },
+        { "lights switched off", 2.0f, 0.05f, 60, false },
+        { "very dark", 0.0005f, 0.0005f, 0, false },
+};
+
+// Scene radiance, the value of a pixel at exposure 1 and unity gain
+static float *radiance;
+static uint32_t width = WIDTH;
+static uint32_t height = HEIGHT;
+
+static uint32_t noise_seed = 1;
+
+static int
+noise()
+{
+        noise_seed = noise_seed * 1103515245 + 12345;
+        return (int)((noise_seed >> 16) % 3) - 1;
+}
+
+static void
+create_synthetic_scene(bool has_highlight)
+{
+        for (uint32_t y = 0; y < height; ++y) {
+                for (uint32_t x = 0; x < width; ++x) {
+                        // Gradient with some texture
+                        float value = 0.2f + 0.6f * x / width;
+                        value *= 1.0f + 0.2f * ((x / 16 + y / 16) % 2);
+
+                        if (has_highlight && x > width / 2 && x < width * 3 / 4 &&
+                            y > height / 4 && y < height / 2) {
+                                value *= 20.0f;
+                        }
+
+                        radiance[y * width + x] = value;
+                }
+        }
+}
+
+// Use a raw BGGR8 frame as the scene, taken with the exposure that the AE
+// would settle on for a mid grey scene
+static bool
+load_replay_scene(const char *path)
+{
+        FILE *file = fopen(path, "rb");
+        if (!file) {
+                return false;
+        }
+
+        uint8_t *frame = malloc(width * height);
+        size_t size = fread(frame, 1, width * height, file);
+        fclose(file);
+
+        if (size != width * height) {
+                free(frame);
+                return false;
+        }
+
+        for (size_t i = 0; i < width * height; ++i) {
+                radiance[i] = (frame[i] + 0.5f) / 255.0f;
+        }
+
+        free(frame);
+        return true;
+}
+
+static void
+render_frame(uint8_t *frame, float brightness, int exposure, int gain)
+{
+        float scale = brightness * exposure * gain / GAIN_UNITY / EXPOSURE_MAX *
+                      255.0f;
+        for (size_t i = 0; i < width * height; ++i) {
+                int value = (int)(radiance[i] * scale) + noise();
+                frame[i] = value < 0 ? 0 : value > 255 ? 255 : value;
+        }
+}
+
+struct result {
+        int settled_frame;
+        int changes;
+        int reversals;
+        float mean;
+        int exposure;
+        int gain;
+};
+
+static struct result
+run_scenario(const struct scenario *scenario, bool is_replay)
+{
+        if (!is_replay) {
+                create_synthetic_scene(scenario->has_highlight);
+        }
+
+        MPAutoExposure ae;
+        mp_auto_exposure_init(&ae,
+                              EXPOSURE_MIN,
+                              EXPOSURE_MAX,
+                              GAIN_MIN,
+                              GAIN_MAX,
+                              GAIN_UNITY,
+                              AE_LATENCY);
+
+        // Controls requested at each frame
+        int exposures[NUM_FRAMES];
+        int gains[NUM_FRAMES];
+        float means[NUM_FRAMES];
+        MPFrameStats stats[NUM_FRAMES];
+
+        uint8_t *frame = malloc(width * height);
+
+        struct result result = {};
+        int last_direction = 0;
+        for (int i = 0; i < NUM_FRAMES; ++i) {
+                int j = MAX(i - SENSOR_LATENCY, 0);
+                int exposure = i < SENSOR_LATENCY ? ae.exposure : exposures[j];
+                int gain = i < SENSOR_LATENCY ? ae.gain : gains[j];
+
+                float brightness = i < scenario->step_frame ?
+                                           scenario->brightness :
+                                           scenario->step_brightness;
+                render_frame(frame, brightness, exposure, gain);
+                mp_frame_stats_compute(
+                        &stats[i], frame, MP_PIXEL_FMT_BGGR8, width, height);
+                means[i] = stats[i].mean_luminance;
+
+                // The sensor picks these up SENSOR_LATENCY frames later
+                exposures[i] = ae.exposure;
+                gains[i] = ae.gain;
+
+                if (i < STATS_LATENCY) {
+                        continue;
+                }
+
+                float before = (float)ae.exposure * ae.gain;
+                if (mp_auto_exposure_update(&ae, &stats[i - STATS_LATENCY])) {
+                        int direction = (float)ae.exposure * ae.gain > before ? 1 :
+                                                                                -1;
+                        if (last_direction && direction != last_direction) {
+                                ++result.reversals;
+                        }
+                        last_direction = direction;
+                        ++result.changes;
+                }
+        }
+
+        free(frame);
+
+        result.mean = means[NUM_FRAMES - 1];
+        result.exposure = ae.exposure;
+        result.gain = ae.gain;
+
+        // First frame after which the brightness stays near its final value
+        result.settled_frame = scenario->step_frame;
+        for (int i = scenario->step_frame; i < NUM_FRAMES; ++i) {
+                if (fabsf(means[i] - result.mean) >
+                    result.mean * SETTLED_TOLERANCE) {
+                        result.settled_frame = i + 1;
+                }
+        }
+        result.settled_frame -= scenario->step_frame;
+
+        return result;
+}
+
+int
+main(int argc, char *argv[])
+{
+        if (argc != 1 && argc != 4) {
+                printf("Usage: %s [<BGGR8 frame> <width> <height>]\n", argv[0]);
+                return 1;
+        }
+
+        bool is_replay = argc == 4;
+        if (is_replay) {
+                width = strtoul(argv[2], NULL, 10);
+                height = strtoul(argv[3], NULL, 10);
+        }
+
+        radiance = malloc(width * height * sizeof(float));
+
+        if (is_replay && !load_replay_scene(argv[1])) {
+                printf("Could not read a %dx%d frame from %s\n",
+                       width,
+                       height,
+                       argv[1]);
+                return 1;
+        }
+
+        printf("%-20s %8s %8s %10s %6s %9s %5s\n",
+               "Scenario",
+               "Settled",
+               "Changes",
+               "Reversals",
+               "Mean",
+               "Exposure",
+               "Gain");
+
+        bool is_stable = true;
+        for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); ++i) {
+                struct result result = run_scenario(&scenarios[i], is_replay);
+
+                printf("%-20s %8d %8d %10d %6.3f %9d %5d\n",
+                       scenarios[i].name,
+                       result.settled_frame,
+                       result.changes,
+                       result.reversals,
+                       result.mean,
+                       result.exposure,
+                       result.gain);
+
+                // Hunting around the target shows up as the controls changing
+                // direction over and over
+                if (result.reversals > 2 ||
+                    result.settled_frame > NUM_FRAMES / 3) {
+                        is_stable = false;
+                }
+        }
+
+        free(radiance);
+
+        return is_stable ? 0 : 1;
+}
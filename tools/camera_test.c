@@ -1,5 +1,6 @@
 #include "camera.h"
 #include "device.h"
+#include "jpeg.h"
 #include "mode.h"
 #include <fcntl.h>
 #include <stdio.h>
@@ -40,6 +41,30 @@ main(int argc, char *argv[])
 
         printf("Finding the device took %fms\n", (find_end - find_start) * 1000);
 
+        // The media devices are enumerated once and shared by all cameras,
+        // show what each additional camera would cost without that
+        {
+                double enumerate_start = get_time();
+                MPDeviceList *list = mp_device_list_new();
+                double enumerate_end = get_time();
+
+                int lookups = 0;
+                double lookup_start = get_time();
+                for (MPDeviceList *l = list; l; l = mp_device_list_next(l)) {
+                        mp_device_find_entity(mp_device_list_get(l), subdev_name);
+                        ++lookups;
+                }
+                double lookup_end = get_time();
+
+                mp_device_list_free(list);
+
+                printf("Enumerating media devices took %fms, saved for every camera sharing the list\n",
+                       (enumerate_end - enumerate_start) * 1000);
+                printf("Indexed entity lookup in %d devices took %fms\n",
+                       lookups,
+                       (lookup_end - lookup_start) * 1000);
+        }
+
         int video_fd;
         uint32_t video_entity_id;
         {
@@ -166,17 +191,64 @@ main(int argc, char *argv[])
                 printf("    Testing 10 captures, starting took %fms\n",
                        (last - start_capture) * 1000);
 
+                // What the preview pays for this format before debayering
+                MPPixelFormat format_8bit = mp_pixel_format_to_8bit(m->pixel_format);
+                double copy_time = 0;
+                double unpack_time = 0;
+                double decode_time = 0;
+                double first_capture = 0;
+                size_t frame_bytes = 0;
+
                 for (int i = 0; i < 10; ++i) {
                         MPBuffer buffer;
                         if (!mp_camera_capture_buffer(camera, &buffer)) {
                                 printf("      Failed to capture buffer\n");
                         }
 
-                        size_t num_bytes = mp_pixel_format_width_to_bytes(
-                                                   m->pixel_format, m->width) *
-                                           m->height;
+                        size_t num_bytes = buffer.bytesused;
+                        frame_bytes = num_bytes;
+                        double copy_start = get_time();
                         uint8_t *data = malloc(num_bytes);
                         memcpy(data, buffer.data, num_bytes);
+                        copy_time += get_time() - copy_start;
+
+                        if (format_8bit != m->pixel_format) {
+                                uint8_t *unpacked = malloc(
+                                        (mp_pixel_format_width_to_bytes(
+                                                 format_8bit, m->width) +
+                                         mp_pixel_format_width_to_padding(
+                                                 format_8bit, m->width)) *
+                                        m->height);
+
+                                double unpack_start = get_time();
+                                mp_pixel_format_unpack_to_8bit(m->pixel_format,
+                                                               m->width,
+                                                               m->height,
+                                                               buffer.data,
+                                                               unpacked);
+                                unpack_time += get_time() - unpack_start;
+
+                                free(unpacked);
+                        }
+
+                        // The preview decodes at half the size
+                        if (m->pixel_format == MP_PIXEL_FMT_MJPEG) {
+                                uint32_t width = (m->width / 2) & ~1;
+                                uint32_t height = m->height / 2;
+                                uint8_t *decoded = malloc(
+                                        (mp_pixel_format_width_to_bytes(
+                                                 MP_PIXEL_FMT_YUYV, width) +
+                                         mp_pixel_format_width_to_padding(
+                                                 MP_PIXEL_FMT_YUYV, width)) *
+                                        height);
+
+                                double decode_start = get_time();
+                                mp_jpeg_decode_yuv(
+                                        data, num_bytes, 2, decoded, width, height);
+                                decode_time += get_time() - decode_start;
+
+                                free(decoded);
+                        }
 
                         printf("      first byte: %d.", data[0]);
 
@@ -187,7 +259,25 @@ main(int argc, char *argv[])
                         double now = get_time();
                         printf(" capture took %fms\n", (now - last) * 1000);
                         last = now;
+
+                        if (i == 0) {
+                                first_capture = now;
+                        }
+                }
+
+                // The first frame includes starting the stream
+                printf("    %s: %.2fms per frame, %zu bytes, copy %.2fms",
+                       mp_pixel_format_to_str(m->pixel_format),
+                       (last - first_capture) * 1000 / 9,
+                       frame_bytes,
+                       copy_time * 1000 / 10);
+                if (format_8bit != m->pixel_format) {
+                        printf(", unpack to 8-bit %.2fms", unpack_time * 1000 / 10);
+                }
+                if (m->pixel_format == MP_PIXEL_FMT_MJPEG) {
+                        printf(", decode at 1/2 %.2fms", decode_time * 1000 / 10);
                 }
+                printf("\n");
 
                 mp_camera_stop_capture(camera);
         }